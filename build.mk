@@ -16,6 +16,13 @@ GLOBAL_DEPS	:= $(MAKEFILE_LIST)				\
 export DEFINES	:= $(addprefix -D,$(APP_DEFINES)) \
 		   -D__NO_FLOAT__
 
+# firmware update needs its own flash layout, see include/HAL/_update.h
+ifneq ($(filter HAL_UPDATE_ENABLE,$(APP_DEFINES)),)
+export PRM	:= Microplex_7_update.prm
+else
+export PRM	:= Microplex_7.prm
+endif
+
 # export these so the linker can pick it up from its config
 export OBJS	:= $(patsubst %.c,$(BUILDDIR)/%.o,$(APP_SRCS) $(LIB_SRCS)) \
 		   $(patsubst $(MCU)/lib/%.c,$(BUILDDIR)/mcu_lib/%.o,$(MCU_SRCS))
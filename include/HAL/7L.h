@@ -100,11 +100,16 @@
 #include <HAL/_adc.h>
 #include <HAL/_bootrom.h>
 #include <HAL/_can.h>
+#include <HAL/_config.h>
+#include <HAL/_crash.h>
 #include <HAL/_eeprom.h>
 #include <HAL/_init.h>
+#include <HAL/_kv.h>
+#include <HAL/_log.h>
 #include <HAL/_pin.h>
 #include <HAL/_pwm.h>
 #include <HAL/_timer.h>
+#include <HAL/_update.h>
 
 /* GPIOs */
 #define DI_CAN_ERR      _PTFD.Bits.PTFD3
@@ -1,13 +1,33 @@
 /** @file
  * Analog to digital conversion.
  *
- * The configured set of channels are sampled every 2ms,
- * and samples are averaged over the last ADC_AVG_SAMPLES.
+ * The configured set of channels are sampled in sequence, one
+ * channel per 1ms tick, and samples are averaged over the last
+ * ADC_AVG_SAMPLES.
+ *
+ * Results are published at the end of each pass (sweep) over the
+ * channel list, so results fetched together always come from the
+ * same sweep.
+ *
+ * PWM-synchronised sampling
+ * -------------------------
+ *
+ * Current-sense channels for PWM outputs are not converted on the
+ * tick. Instead the sequencer waits for the start of the next TPM1
+ * period (the output turn-on edge), and then converts at a
+ * configurable point within the on-time using a TPM2C0 alarm.
+ * Readings thus always reflect the on-state load current. Outputs
+ * that are fully on or off are sampled immediately.
+ *
+ * While waiting, the sequencer stalls on the channel, so each
+ * synchronised channel can add up to one PWM period to the sweep.
+ * If the period start does not arrive in time the channel is
+ * sampled unsynchronised.
  *
  * ADC scale factors
  * -----------------
  *
- * All measurements in 10-bit mode.
+ * Scale factors are expressed for 10-bit mode.
  *
  * Scaling is performed by taking the accumulated ADC counts
  * (sum of ADC_AVG_SAMPLES), multiplying by the scale factor
@@ -19,11 +39,54 @@
  *
  * Current sense outputs are the same but for mA.
  *
+ * Calibration
+ * -----------
+ *
+ * Each channel may have a gain and offset correction for each of its
+ * ranges (the 30V inputs have a second for the 10V range), stored in
+ * the HAL-reserved EEPROM area and loaded at init. The correction for
+ * the channel's current range is used: the gain is folded into the
+ * channel's scale factor and the offset is subtracted from the
+ * accumulated counts, so corrected results cost no more than
+ * uncorrected ones. Calibration is performed over CAN, see
+ * @p _bootrom.h.
+ *
+ * The EEPROM area is only reserved if the application defines
+ * HAL_ADC_CAL_ENABLE (in APP_DEFINES); otherwise calibration can be
+ * set but not saved, and every channel starts uncorrected.
+ *
+ * Conversion modes
+ * ----------------
+ *
+ * Each channel can be switched between three modes with
+ * @p HAL_adc_set_mode(). The same scale factors are used for
+ * all modes; the final shift is adjusted to suit.
+ *
+ * HAL_ADC_MODE_10BIT       One 10-bit conversion per sample. Shift 12.
+ *
+ * HAL_ADC_MODE_12BIT       One 12-bit conversion per sample, 4x the
+ *                          counts of 10-bit mode. Shift 14.
+ *
+ * HAL_ADC_MODE_OVERSAMPLE  Four 12-bit conversions per sample, summed
+ *                          and halved (8x the counts of 10-bit mode).
+ *                          Shift 15. Together with the 8-sample average
+ *                          this gives ~14 bits of effective resolution,
+ *                          or ~2mV/count on the 0-30V range.
+ *
+ * Conversion time is the same in 10- and 12-bit modes (~35us with
+ * long sample time), well inside the 1ms tick. Oversampled channels
+ * take four consecutive ticks per sample, lengthening the sweep by
+ * three ticks per channel, so every channel's update rate drops
+ * accordingly. The four conversions are spread over 4ms, which also
+ * filters noise faster than the input RC but means the reading takes
+ * longer to settle after a step change or range switch.
  */
 
 #pragma ONCE
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <HAL/_timer.h>
 
 /*
  * AI_1/2/3:
@@ -62,9 +125,41 @@
  */
 #define _ADC_SCALE_FACTOR_TEMP  610     /* XXX VALIDATE */
 
+/*
+ * Temperature sensor characteristics (MC9S08DZ60 datasheet, Vdd 5V);
+ * VTEMP25 in uV, slopes in uV/degC.
+ */
+#define _HAL_TEMP_VTEMP25_UV    1396000L
+#define _HAL_TEMP_SLOPE_HOT_UV  3266L   /* above 25C */
+#define _HAL_TEMP_SLOPE_COLD_UV 3638L   /* below 25C */
+
+/* factory offset in uV, added to VTEMP25; override via APP_DEFINES */
+#ifndef HAL_TEMP_OFFSET_UV
+# define HAL_TEMP_OFFSET_UV     0L
+#endif
+
 /* don't change this without adjusting the scaling factors above */
 #define _HAL_ADC_AVG_SAMPLES 8
 
+/* no PWM synchronisation for this channel */
+#define _HAL_ADC_SYNC_NONE      0xff
+
+/* minimum delay from PWM turn-on to sample (driver delay + slew + margin) */
+#define _HAL_ADC_SYNC_SETTLE_US 60
+
+/* channels that can carry calibration records */
+#define _HAL_ADC_CAL_CHANNELS   15
+
+/* conversions summed per sample in oversample mode */
+#define _HAL_ADC_OVERSAMPLE 4
+
+/** Per-channel conversion modes */
+typedef enum {
+    HAL_ADC_MODE_10BIT,         /**< 10-bit conversions (default) */
+    HAL_ADC_MODE_12BIT,         /**< 12-bit conversions */
+    HAL_ADC_MODE_OVERSAMPLE     /**< oversampled 12-bit conversions */
+} HAL_adc_mode_t;
+
 /* indices into the scaling factor table */
 typedef enum {
     _HAL_ADC_SCALE_30V,
@@ -76,14 +171,75 @@ typedef enum {
     _HAL_ADC_SCALE_END
 } _HAL_adc_scale_t;
 
+/*
+ * Per-sample hooks. A channel has one; _HAL_adc_set_notify() requires
+ * it to be free (or already the caller's), and _HAL_adc_clear_notify()
+ * only releases the caller's own.
+ */
+#define _HAL_ADC_NOTIFY_NONE        0
+#define _HAL_ADC_NOTIFY_PROTECT     1   /* _HAL_protect_sample */
+#define _HAL_ADC_NOTIFY_INPUT       2   /* _HAL_input_sample */
+
 typedef struct {
     const uint8_t   channel: 5;
     uint8_t         scale: 3;
+    const uint8_t   sync;       /* PWM channel to synchronise to, or _HAL_ADC_SYNC_NONE */
     uint16_t        samples[_HAL_ADC_AVG_SAMPLES];
+    uint16_t        accum;      /* running sum of samples[] */
+    uint16_t        result;     /* accum as of the end of the last sweep */
+    uint8_t         mode: 2;    /* HAL_adc_mode_t */
+    uint8_t         notify: 2;  /* per-sample hook, _HAL_ADC_NOTIFY_* */
+    uint16_t        factor;     /* calibrated scale factor */
+    uint16_t        offset;     /* calibrated offset in counts for the current mode */
 } _HAL_adc_channel_state_t;
 
 extern void     _HAL_adc_init(_HAL_adc_channel_state_t *state);
 extern void     _HAL_adc_set_scale(uint8_t index, _HAL_adc_scale_t scale);
+extern void     _HAL_adc_pwm_sync(void);
+extern bool     _HAL_adc_cal_zero(uint8_t index);
+extern bool     _HAL_adc_cal_span(uint8_t index, uint16_t reference);
+extern bool     _HAL_adc_cal_reset(uint8_t index);
+extern bool     _HAL_adc_cal_save(void);
+extern void     _HAL_adc_set_notify(uint8_t index, uint8_t notify);
+extern void     _HAL_adc_clear_notify(uint8_t index, uint8_t notify);
+extern uint16_t _HAL_adc_sample_threshold(uint8_t index, uint16_t value);
+extern uint16_t _HAL_adc_counts(uint8_t index);
+extern uint16_t _HAL_adc_value_counts(uint8_t index, uint16_t value);
+extern uint16_t _HAL_adc_sweep(void);
+
+/**
+ * Sequencer sweep information for a snapshot.
+ */
+typedef struct {
+    uint16_t            sweep;      /**< sweep counter, increments once per pass over the channels */
+    HAL_microseconds    timestamp;  /**< time at which the sweep completed */
+} HAL_adc_sweep_t;
+
+/**
+ * Select the conversion mode for a channel.
+ *
+ * Existing samples are rescaled to suit the new mode, so results
+ * remain valid across the change.
+ *
+ * Note that channel indices are not range-checked.
+ *
+ * @param      index  The ADC channel index to configure.
+ * @param      mode   The conversion mode to use.
+ */
+extern void     HAL_adc_set_mode(uint8_t index, HAL_adc_mode_t mode);
+
+/**
+ * Set the sample point for PWM-synchronised channels.
+ *
+ * The sample point is never less than _HAL_ADC_SYNC_SETTLE_US after
+ * the turn-on edge, and never so late that sampling would overlap
+ * the turn-off edge.
+ *
+ * @param      percent  Sample point as a percentage of the on-time,
+ *                      or 0 to disable synchronisation and sample on
+ *                      the tick. Defaults to 50.
+ */
+extern void     HAL_adc_set_sync_point(uint8_t percent);
 
 /**
  * Fetch a scaled ADC result.
@@ -96,3 +252,39 @@ extern void     _HAL_adc_set_scale(uint8_t index, _HAL_adc_scale_t scale);
  */
 extern uint16_t HAL_adc_result(uint8_t index);
 
+/**
+ * Fetch scaled ADC results for a set of channels from the same sweep.
+ *
+ * All results are taken from the most recently completed pass over
+ * the channel list, so they are mutually consistent. This is cheaper
+ * than calling @p HAL_adc_result() for each channel.
+ *
+ * Note that channel indices are not range-checked.
+ *
+ * @param      indices  Array of ADC channel indices to fetch.
+ * @param      count    Number of entries in indices / results.
+ * @param[out] results  Buffer for the scaled results.
+ * @param[out] sweep    Sweep counter and timestamp for the results, may
+ *                      be NULL.
+ */
+extern void     HAL_adc_snapshot(const uint8_t *indices,
+                                 uint8_t count,
+                                 uint16_t *results,
+                                 HAL_adc_sweep_t *sweep);
+
+/**
+ * Fetch the MCU die temperature.
+ *
+ * Converts the internal temperature sensor reading using a
+ * piecewise-linear table (10C steps, -40C to 150C) built at compile
+ * time from the datasheet sensor characteristics and
+ * HAL_TEMP_OFFSET_UV. Lookup and interpolation are integer-only with
+ * no division, so this is cheap enough to call every tick.
+ *
+ * Accuracy is limited by the sensor itself (several degrees without
+ * a per-module offset) and by Vdd, which is the ADC reference.
+ *
+ * @return     Die temperature in degrees C, clamped to -40..150.
+ */
+extern int16_t  HAL_temperature_c(void);
+
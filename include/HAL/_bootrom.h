@@ -8,7 +8,8 @@
  * 00 00                00 id id id id st 00 vv     All-call "report your ID".
  * 20 00                2f ff id id id id 00 00     Enter program mode - sets EEPROM and resets.
  * 20 10 id id id id    21 10 id id id id 00 00     Select id id id id for subsequent operations.
- * 20 03 aa aa cc       dd ...                      EEPROM read cc (1-8) bytes from address aa aa.
+ * 20 03 aa aa cc       dd ...                      EEPROM read cc (1-8) bytes from address aa aa
+ *                                                  (ignored if out of range).
  * 20 11 f3 33 af       21 11 01 00 00              EEPROM write enable
  * 20 02                20 f0 02 00 00              EEPROM write disable
  *
@@ -18,14 +19,60 @@
  *                      20 e8 0f 00 00              eeprom not unlocked
  *
  * There are lots of eeprom error messages, we just send the most generic one.
+ *
+ * The scan response is delayed by 0-63ms, in 1ms slots chosen by a hash
+ * of the serial number, so that a network of modules doesn't answer all
+ * at once. A response that finds the bus busy, or collides with another,
+ * is sent again in a random slot 1-4ms later.
+ *
+ * Extensions (not part of the MRS protocol, selected module only):
+ *
+ * receive              send
+ * 20 c0 ii             21 c0 ii st                 ADC calibration: input ii is at zero, record offset.
+ * 20 c1 ii rr rr       21 c1 ii st                 ADC calibration: input ii is at reference rr rr
+ *                                                  (mV or mA), compute gain.
+ * 20 c2 ii             21 c2 ii st                 ADC calibration: reset input ii to defaults.
+ * 20 c3                21 c3 00 st                 ADC calibration: save to EEPROM (requires
+ *                                                  EEPROM write enable and HAL_ADC_CAL_ENABLE).
+ *
+ * 20 04                dd ... 21 04 nn             Read the event log, see _log.h (empty unless
+ *                                                  HAL_LOG_ENABLE).
+ * 20 05                dd ... 21 05 st             Read the last crash, see _crash.h.
+ * 20 06 aa aa ll ll bb dd ... 21 06 st cc cc       EEPROM stream read, see below.
+ * 20 07                                            EEPROM stream read: send the next block.
+ * 20 08 ... 20 0c                                  Firmware update, see _update.h; image data
+ *                                                  is received at 0x1ffffff8 (HAL_UPDATE_ENABLE
+ *                                                  only).
+ *
+ * A stream read sends ll ll bytes from address aa aa as 8-byte messages
+ * (the last may be shorter) at 0x1ffffff4, as for 20 03, followed by the
+ * crc16() of the data, big-endian, on the response ID (st 00). If bb is present
+ * and non-zero, the module pauses after every bb messages until it
+ * receives 20 07, and abandons the read if that takes more than a
+ * second. A range outside the EEPROM, or a request shorter than 6
+ * bytes, gets 21 06 0f. Messages are sent one at a time, so they arrive
+ * in order.
+ *
+ * st is 00 for success, 0f for failure. Input indices are the ADC channel
+ * indices for the module (see tables in init.c). Calibration applies to the
+ * input's current range, takes effect immediately, and is restored at
+ * startup once saved. To calibrate an input, select its range, apply 0 and
+ * send 20 c0, then apply a reference near full scale and send 20 c1,
+ * allowing the reading to settle before each command.
  */
 
 #pragma ONCE
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <pt.h>
 #include <HAL/_can.h>
 
+/* send scan responses and EEPROM stream reads, and prepare updates; run from the main loop */
+PT_DECLARE(_HAL_bootrom_scan);
+PT_DECLARE(_HAL_bootrom_stream);
+PT_DECLARE(_HAL_bootrom_update);
+
 /**
  * Get the CAN bitrate from EEPROM.
  */
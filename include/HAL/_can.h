@@ -49,6 +49,22 @@ typedef struct {
 /** declare the CAN listener thread, run by the app framework */
 PT_DECLARE(_HAL_can_listen);
 
+/*
+ * Single-shot sends for the bootrom scan response: the frame is queued
+ * only onto an idle bus, and aborted rather than retransmitted if it
+ * collides, so the sender can back off instead.
+ *
+ * _HAL_can_send_once() returns the transmit buffer used (0 if none was
+ * free) for the other calls; _HAL_can_abort() is made once the frame has
+ * had time to start, and _HAL_can_tx_aborted() is valid once
+ * _HAL_can_tx_done().
+ */
+extern bool     _HAL_can_bus_idle(void);
+extern uint8_t  _HAL_can_send_once(uint32_t id, uint8_t dlc, const uint8_t *data);
+extern void     _HAL_can_abort(uint8_t buffer);
+extern bool     _HAL_can_tx_done(uint8_t buffer);
+extern bool     _HAL_can_tx_aborted(uint8_t buffer);
+
 /**
  * Configure CAN for the given bitrate.
  *
@@ -97,6 +113,16 @@ extern void HAL_can_send_blocking(uint32_t id, uint8_t dlc, const uint8_t *data)
  */
 extern void HAL_can_send_debug(uint32_t id, uint8_t dlc, const uint8_t *data);
 
+/**
+ * Test whether every transmit buffer is empty.
+ *
+ * Messages waiting in more than one buffer may be sent in any order;
+ * sending only when this is true keeps a sequence of messages in order.
+ *
+ * @return          True if nothing is waiting to be sent.
+ */
+extern bool HAL_can_tx_idle(void);
+
 /**
  * Fetch a CAN message from the receive buffer.
  *
@@ -0,0 +1,67 @@
+/** @file
+ *
+ * Power-fail-safe configuration blocks in EEPROM.
+ *
+ * HAL_eeprom_write() rewrites sectors in place, so a reset or loss of
+ * power part way through a multi-sector write leaves a mix of old and
+ * new data. A configuration block instead keeps two copies (A and B)
+ * of the application's data, each with a header holding a sequence
+ * number, a layout version, the data size, a CRC and a commit marker.
+ *
+ * A save overwrites the older copy. Its header is written first with
+ * the commit marker left erased, then the data; once both have been
+ * programmed, the commit marker is programmed on its own (a single
+ * byte, no erase). Until then the copy being written is invalid and
+ * the other copy is still the newest valid one, so an interrupted save
+ * leaves the previous configuration in place.
+ *
+ * A load reads the two headers, then checks the CRC of the copy with
+ * the newer sequence number; the other copy is only checked if that
+ * fails. The CRC is computed a sector (8 bytes) at a time straight
+ * from the EEPROM, without a copy of the block in RAM, and costs about
+ * as much as reading the data once.
+ *
+ * Each copy is an 8-byte header followed by the data, rounded up to a
+ * whole sector; HAL_CONFIG_SPACE() gives the EEPROM space a block
+ * needs. Blocks must be in the application area, start on a sector
+ * boundary and not overlap the key/value store (see _kv.h).
+ *
+ * @note    Not interrupt safe. A save waits for its writes (and any
+ *          already queued) to be programmed, which takes at least two
+ *          sector erases (~40ms).
+ */
+
+#pragma ONCE
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** Configuration block */
+typedef struct {
+    uint16_t    offset;         /**< EEPROM offset of copy A, a multiple of 8; copy B follows */
+    uint8_t     size;           /**< size of the data */
+    uint8_t     version;        /**< layout version; copies with another version are ignored */
+} HAL_config_block_t;
+
+/** EEPROM space used by a block holding _size bytes of data */
+#define HAL_CONFIG_SPACE(_size)     (2U * (8U + (((_size) + 7U) & ~7U)))
+
+/**
+ * Load the newest valid copy of a configuration block.
+ *
+ * @param block             The block to load.
+ * @param data              Buffer of block->size bytes; left untouched
+ *                          if there is no valid copy.
+ * @return                  True if a valid copy was loaded.
+ */
+extern bool     HAL_config_load(const HAL_config_block_t *block, void *data);
+
+/**
+ * Save a configuration block.
+ *
+ * Returns once the new copy has been committed.
+ *
+ * @param block             The block to save.
+ * @param data              The block->size bytes of data to save.
+ */
+extern void     HAL_config_save(const HAL_config_block_t *block, const void *data);
@@ -0,0 +1,67 @@
+/** @file
+ *
+ * Crash capture.
+ *
+ * When a REQUIRE() fails, __require_abort() records where it happened
+ * in a RAM segment that the startup code doesn't clear (HAL_NOINIT in
+ * Microplex_7.prm), before it does anything else; capture takes a few
+ * dozen instructions and doesn't depend on CAN or the EEPROM. The
+ * record survives the watchdog reset that follows, and is protected by
+ * a magic value and a CRC so that RAM left random by a power-on isn't
+ * mistaken for a crash.
+ *
+ * The record also holds the last few trace events. HAL_trace() is
+ * cheap enough to call from anywhere, including interrupt handlers;
+ * events logged with HAL_log() are traced too.
+ *
+ * At the next boot a valid record is moved to ordinary RAM, reported
+ * once on the CAN console, and can be read with HAL_crash_get(), or
+ * over CAN: once the module is selected, MRS bootloader command
+ * 0x20 0x05 sends the record on 0x1ffffff7 in 8-byte pieces, followed
+ * by 0x21 0x05 <status> on the response ID (0x0f if there is none).
+ */
+
+#pragma ONCE
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** Trace events kept */
+#define HAL_CRASH_TRACE_DEPTH   8
+
+/** Characters of the file name kept (the end of the name) */
+#define HAL_CRASH_FILE_LEN      16
+
+/** Captured crash */
+typedef struct {
+    uint16_t    magic;
+    uint16_t    line;                           /**< line of the failed REQUIRE() */
+    uint16_t    return_address;                 /**< address following the __require_abort() call */
+    uint16_t    stack_pointer;                  /**< stack pointer at the failed REQUIRE() */
+    char        file[HAL_CRASH_FILE_LEN];       /**< end of the file name, NUL-padded */
+    uint8_t     trace[HAL_CRASH_TRACE_DEPTH];   /**< trace events, oldest first */
+    uint8_t     trace_next;                     /* capture only; slot for the next event */
+    uint8_t     _reserved;
+    uint16_t    crc;
+} HAL_crash_t;
+
+extern void     _HAL_crash_init(void);
+extern void     _HAL_crash_report(void);
+extern void     _HAL_crash_capture(const char *file, uint16_t line, uint16_t return_address, uint16_t stack_pointer);
+
+/**
+ * Record a trace event.
+ *
+ * Safe to call from interrupt context.
+ *
+ * @param event             Application-defined event code.
+ */
+extern void     HAL_trace(uint8_t event);
+
+/**
+ * Get the crash captured before this boot, if any.
+ *
+ * @param crash             Filled in with the crash record.
+ * @return                  True if a crash was captured.
+ */
+extern bool     HAL_crash_get(HAL_crash_t *crash);
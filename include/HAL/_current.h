@@ -0,0 +1,86 @@
+/** @file
+ *
+ * Closed-loop output current control.
+ *
+ * Proportional valves need a constant coil current rather than a
+ * constant duty cycle; KL30 variation and coil heating easily shift
+ * the current by a third at a fixed duty. Outputs with current
+ * feedback (AI_CS) can instead be driven by a PI controller that
+ * adjusts the duty cycle to hold a target current.
+ *
+ * The controller runs from a 1ms timer callback, so its rate does not
+ * depend on the application loop. Every @p period_ms it compares the
+ * target with the output's latest averaged AI_CS reading and writes
+ * a 16-bit duty cycle:
+ *
+ *     error = target_mA - measured_mA
+ *     integral += ki * error
+ *     duty = integral + kp * error
+ *
+ * The AI_CS reading is only refreshed once per ADC sweep, so if the
+ * period is shorter than the sweep the controller waits for the next
+ * sweep rather than integrating the same error twice. With sampling
+ * synchronised to the PWM (the default) the reading is the on-state
+ * current; for an inductive load switched faster than its L/R time
+ * constant, this is the coil current.
+ *
+ * Gains are in 16-bit duty units per mA, 8.8 fixed-point. As a starting
+ * point, a coil drawing I mA at 100% duty has a plant gain of I / 65536
+ * mA per duty unit; kp around a third of the inverse of that, and ki
+ * a tenth of kp, is a conservative first tuning.
+ *
+ * The integral is clamped to the duty range, and is held while the
+ * output is saturated in the direction of the error or forced off by
+ * protection, so it does not wind up.
+ *
+ * Dither
+ * ------
+ *
+ * Valve spools stick if held perfectly still. Optional dither adds
+ * +/- @p dither_duty to the controller's output, alternating every
+ * @p dither_ms. Duty changes take effect at the next PWM period, so the
+ * dither half-period should be a multiple of the PWM period. The
+ * controller sees the average current, as the dither is symmetrical
+ * about the controlled duty.
+ *
+ * Cost: ~30 bus cycles per controlled output per tick for the
+ * countdowns; a control update is estimated at ~400 cycles (~20us),
+ * mostly the mA scaling and the multiplies.
+ */
+
+#pragma ONCE
+
+#include <stdint.h>
+#include <HAL/_pin.h>
+
+/** PI controller parameters */
+typedef struct {
+    uint16_t    kp;                 /**< proportional gain, duty units per mA, 8.8 */
+    uint16_t    ki;                 /**< integral gain per update, duty units per mA, 8.8 */
+    uint8_t     period_ms;          /**< control interval, at least 1 */
+    uint8_t     dither_ms;          /**< dither half-period, 0 for no dither */
+    uint16_t    dither_duty;        /**< dither amplitude in 16-bit duty units */
+} HAL_current_config_t;
+
+/**
+ * Configure closed-loop current control for an output pin.
+ *
+ * The output is switched off and the controller reset; set a target
+ * with HAL_pin_set_current_mA().
+ *
+ * @param pin           Output pin to control; must have a PWM channel
+ *                      and current feedback.
+ * @param config        Controller parameters, or NULL to return the pin
+ *                      to duty cycle control.
+ */
+extern void     HAL_pin_set_current_control(const HAL_pin_t *pin, const HAL_current_config_t *config);
+
+/**
+ * Set the target current for a current-controlled output pin.
+ *
+ * @param pin           Output pin configured with
+ *                      HAL_pin_set_current_control().
+ * @param current_mA    Target current; 0 switches the output off and
+ *                      resets the controller.
+ */
+extern void     HAL_pin_set_current_mA(const HAL_pin_t *pin, uint16_t current_mA);
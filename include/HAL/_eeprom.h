@@ -7,12 +7,83 @@
  *
  * @note    Writing to the EEPROM requires a sector erase, which
  *          takes no less than 20mS.
+ *
+ * Write-behind
+ * ------------
+ *
+ * Writes are queued as 8-byte sector images and programmed by the
+ * _HAL_eeprom_service protothread, which is run from the main loop and
+ * yields while each erase / program command runs, so the main loop,
+ * CAN and other protothreads keep running. Writes to a sector that is
+ * already queued are merged into its image; unchanged sectors are not
+ * rewritten.
+ *
+ * HAL_eeprom_write_async() returns as soon as the data is queued, with
+ * a token that can be tested with HAL_eeprom_write_done(). Reads see
+ * queued data immediately, so the EEPROM behaves as though the write
+ * had already happened; a read of a sector that is not queued waits
+ * for any command in progress (up to ~20ms for an erase).
+ *
+ * HAL_eeprom_write() and friends are unchanged: they queue the data and
+ * then run the engine until it has been written. An async write that
+ * finds the queue full (8 sectors) does the same for the oldest entry.
+ *
+ * EEPROM map
+ * ----------
+ *
+ * 0x000-0x1ff  MRS parameters and bootloader-reserved area.
+ * 0x200-...    Application, up to HAL_EEPROM_APP_END; 0x300-0x4ff by
+ *              default is the key/value store area, if the app uses it
+ *              (see _kv.h). Use configuration blocks (see _config.h)
+ *              for data that must survive an interrupted write.
+ * ...-0x7ff    HAL-reserved areas, allocated down from the top of the
+ *              EEPROM in this order:
+ *                  ADC calibration records, 128B, if HAL_ADC_CAL_ENABLE
+ *                  is defined (see _adc.h).
+ *                  fault and event log, 256B, if HAL_LOG_ENABLE is
+ *                  defined (see _log.h).
+ *                  firmware update journal, 32B, if HAL_UPDATE_ENABLE
+ *                  is defined (see _update.h).
  */
 
 #pragma ONCE
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pt.h>
+
+/** Size of the EEPROM */
+#define HAL_EEPROM_SIZE         0x800U
+
+/** Start of the application-owned EEPROM area */
+#define HAL_EEPROM_APP_START    0x200U
+
+/* HAL-reserved area sizes, zero for features that aren't enabled */
+#ifdef HAL_ADC_CAL_ENABLE
+# define _HAL_EEPROM_ADC_CAL_SIZE   0x80U
+#else
+# define _HAL_EEPROM_ADC_CAL_SIZE   0U
+#endif
+#ifdef HAL_LOG_ENABLE
+# define _HAL_EEPROM_LOG_SIZE       0x100U
+#else
+# define _HAL_EEPROM_LOG_SIZE       0U
+#endif
+#ifdef HAL_UPDATE_ENABLE
+# define _HAL_EEPROM_UPDATE_SIZE    0x20U
+#else
+# define _HAL_EEPROM_UPDATE_SIZE    0U
+#endif
+
+/* HAL-reserved areas */
+#define _HAL_EEPROM_ADC_CAL     (HAL_EEPROM_SIZE - _HAL_EEPROM_ADC_CAL_SIZE)
+#define _HAL_EEPROM_LOG         (_HAL_EEPROM_ADC_CAL - _HAL_EEPROM_LOG_SIZE)
+#define _HAL_EEPROM_UPDATE      (_HAL_EEPROM_LOG - _HAL_EEPROM_UPDATE_SIZE)
+
+/** End (exclusive) of the application-owned EEPROM area */
+#define HAL_EEPROM_APP_END      _HAL_EEPROM_UPDATE
 
 /** CAN speeds as encoded in the EEPROM */
 enum {
@@ -24,14 +95,7 @@ enum {
 };
 
 /**
- * MRS EEPROM contents.
- *
- * These are on page 0, which is always selected when the
- * EEPROM is not being actively read or written.
- *
- * @note    Because the EEPROM page select may be flipped during
- *          a read or programming operation, this structure cannot
- *          be safely accessed from an interrupt handler.
+ * MRS EEPROM contents, at EEPROM offset 2.
  */
 typedef struct {
     uint16_t    _ParameterMagic;
@@ -71,22 +135,47 @@ typedef struct {
     uint8_t     _reserved2[7];
 } MRS_parameters_t;
 
-/** Direct-mapped version of the MRS parameter structure in EEPROM. */
-extern const MRS_parameters_t   MRS_parameters @ 0x1402;
+/* EEPROM offset of the MRS parameters */
+#define _HAL_EEPROM_MRS_PARAM   0x002U
+
+/* size of the RAM image of the EEPROM, from offset 0 to the end of the MRS parameters */
+#define _HAL_MRS_IMAGE_SIZE     (_HAL_EEPROM_MRS_PARAM + sizeof(MRS_parameters_t))
+
+extern uint8_t _HAL_mrs_image[_HAL_MRS_IMAGE_SIZE];
+
+/**
+ * The MRS parameters.
+ *
+ * A view of a RAM image of the start of the EEPROM, read at startup
+ * and updated as writes to it are queued, so reading it never touches
+ * the EEPROM or its page select. Safe to read from interrupt context;
+ * an update happens with interrupts disabled, so a value is never seen
+ * half written.
+ */
+#define MRS_parameters          (*(const MRS_parameters_t *)&_HAL_mrs_image[_HAL_EEPROM_MRS_PARAM])
 
-/** EEPROM offset for the named MRS EEPROM parameter */
+/**
+ * EEPROM offset for the named MRS EEPROM parameter.
+ *
+ * @note    This counts from the start of the EEPROM, not from the
+ *          structure at offset 2, as the MRS tools do; it, the
+ *          MRS_set_*() macros and MRS_PARAM_READ() address the same
+ *          bytes, which are not the ones MRS_parameters shows.
+ */
 #define MRS_PARAM_OFFSET(_p)    offsetof(MRS_parameters_t, _p)
 
 /** Size of the named MRS EEPROM parameter */
-#define MRS_PARAM_SIZE(_p)      sizeof(MRS_parameters. ## _p)
+#define MRS_PARAM_SIZE(_p)      sizeof(MRS_parameters._p)
 
 /** Copy named parameter to buffer - must be large enough */
-#define MRS_PARAM_READ(_p, _b)              \
-    HAL_eeprom_read(MRS_PARAM_OFFSET(_p),   \
-                    MRS_PARAM_SIZE(_p),     \
-                    (uint8_t *)_b)
+#define MRS_PARAM_READ(_p, _b)  memcpy((_b), &_HAL_mrs_image[MRS_PARAM_OFFSET(_p)], MRS_PARAM_SIZE(_p))
 
+/** Write completion token */
+typedef uint16_t HAL_eeprom_token_t;
+
+extern void _HAL_eeprom_init(void);
 extern void _HAL_eeprom_write(uint16_t offset, uint8_t len, const uint8_t *data);
+extern HAL_eeprom_token_t _HAL_eeprom_write_async(uint16_t offset, uint8_t len, const uint8_t *data);
 extern void _HAL_eeprom_write_str(uint16_t offset, uint8_t len, const char *data);
 
 /** Set the SoftwareVersion parameter to the string (truncated) in _version */
@@ -106,7 +195,9 @@ extern void _HAL_eeprom_write_str(uint16_t offset, uint8_t len, const char *data
 /**
  * Write data to the EEPROM.
  *
- * Does not allow overwriting the MRS reserved area (offsets below 0x200).
+ * Does not allow overwriting the MRS reserved area (offsets below
+ * HAL_EEPROM_APP_START) or the HAL-reserved area (offsets at or above
+ * HAL_EEPROM_APP_END).
  *
  * @param offset            Offset from the base of the EEPROM.
  * @param len               The number of bytes to write.
@@ -114,6 +205,35 @@ extern void _HAL_eeprom_write_str(uint16_t offset, uint8_t len, const char *data
  */
 extern void HAL_eeprom_write(uint16_t offset, uint8_t len, const uint8_t *data);
 
+/**
+ * Queue data to be written to the EEPROM.
+ *
+ * Restricted to the application area as for HAL_eeprom_write().
+ *
+ * @param offset            Offset from the base of the EEPROM.
+ * @param len               The number of bytes to write.
+ * @param data              The data to write; copied before returning.
+ * @return                  Token to pass to HAL_eeprom_write_done().
+ */
+extern HAL_eeprom_token_t HAL_eeprom_write_async(uint16_t offset, uint8_t len, const uint8_t *data);
+
+/**
+ * Test whether a queued write has reached the EEPROM.
+ *
+ * @param token             Token returned by HAL_eeprom_write_async().
+ * @return                  True once the write (and every write queued
+ *                          before it) has been programmed.
+ */
+extern bool HAL_eeprom_write_done(HAL_eeprom_token_t token);
+
+/**
+ * Wait for all queued writes to reach the EEPROM.
+ */
+extern void HAL_eeprom_flush(void);
+
+/* write-behind engine, run from the main loop */
+PT_DECLARE(_HAL_eeprom_service);
+
 /**
  *  Write a byte to the EEPROM.
  *
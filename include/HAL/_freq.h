@@ -0,0 +1,103 @@
+/** @file
+ *
+ * Frequency, duty cycle and pulse count input on FREQ_IN (7X only).
+ *
+ * FREQ_IN is on TPM1C0, which is otherwise unused on the 7X (on the 7H
+ * it drives an output). The channel captures both edges; each edge is
+ * timestamped on the microsecond timebase by backing off the time the
+ * TPM1 counter has run since the capture, so timestamps are 32 bits
+ * wide regardless of the PWM period, with 4us resolution.
+ *
+ * Rising-to-rising intervals and high times are accumulated and
+ * averaged over a configurable window. A period longer than the
+ * window simply carries into the following windows, so signals well
+ * below 1Hz are measured without overflow; after @p timeout_ms with no
+ * edges the input reads 0Hz and its duty cycle follows the pin level.
+ *
+ * The pin level is read in the interrupt to tell rising from falling
+ * edges. If two consecutive edges read the same level, an edge was
+ * missed (interrupt latency exceeded the pulse width) and the
+ * measurement restarts from the next rising edge.
+ *
+ * High rates
+ * ----------
+ *
+ * Each edge costs an interrupt, estimated at ~250 bus cycles (~13us);
+ * a 10kHz signal would take ~25% of the CPU. With a non-zero @p burst,
+ * capture interrupts are turned off once 2 * burst of them have been
+ * taken in the current window, and turned back on at the start of the
+ * next one, bounding the load to 2 * burst interrupts per window (e.g.
+ * 32 periods per 100ms window is ~0.8%) at any input frequency. Every
+ * interrupt counts, including those for edges that turn out to have
+ * followed a missed one, so the bound holds even when no period can be
+ * measured. Frequency and duty cycle are averaged over the burst.
+ * Pulses that arrive while capture is off are estimated from the
+ * measured period, so the pulse count is exact only while no bursts
+ * are cut short.
+ *
+ * Upper limit
+ * -----------
+ *
+ * A period is only measured when all three of its edges are seen, so
+ * both the high and the low time must outlast the edge interrupt plus
+ * the longest time interrupts are held off elsewhere; the 1ms timer
+ * tick is the longest of these. With nothing else running that is
+ * roughly 15us, or about 30kHz at 50% duty; in practice expect missed
+ * edges, and so no reading, well below that while outputs are being
+ * protected. Above the limit the reading holds its last value, and
+ * without @p burst the edge interrupts take most of the CPU.
+ */
+
+#pragma ONCE
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/** Frequency input parameters */
+typedef struct {
+    uint16_t    window_ms;          /**< averaging window, at least 1 */
+    uint16_t    timeout_ms;         /**< report 0Hz after this long without edges */
+    uint16_t    burst;              /**< periods measured per window, 0 for all */
+} HAL_freq_config_t;
+
+/* capture hook called from the TPM1C0 interrupt */
+extern void     _HAL_freq_edge(uint16_t capture);
+
+/**
+ * Configure the frequency input.
+ *
+ * Resets the pulse count and any measurement in progress.
+ *
+ * @param config        Input parameters, or NULL to stop capturing.
+ */
+extern void     HAL_freq_configure(const HAL_freq_config_t *config);
+
+/**
+ * Get the average input period.
+ *
+ * @return              Period in microseconds over the last window that
+ *                      completed a period, or 0 if the input is idle.
+ */
+extern uint32_t HAL_freq_period_us(void);
+
+/**
+ * Get the average input frequency.
+ *
+ * @return              Frequency in millihertz, or 0 if the input is idle.
+ */
+extern uint32_t HAL_freq_mHz(void);
+
+/**
+ * Get the average input duty cycle.
+ *
+ * @return              High time as a fraction of the period, 0 to
+ *                      0xffff; when idle, 0 or 0xffff following the pin.
+ */
+extern uint16_t HAL_freq_duty16(void);
+
+/**
+ * Get the number of rising edges since the input was configured.
+ *
+ * @return              Pulse count; see above for accuracy at high rates.
+ */
+extern uint32_t HAL_freq_count(void);
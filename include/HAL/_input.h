@@ -0,0 +1,104 @@
+/** @file
+ *
+ * Debounced digital inputs.
+ *
+ * The 7X inputs (IN_1..IN_3, and KL15) are analogue; this layer turns
+ * them into debounced digital inputs with change events, so that the
+ * application doesn't have to poll and threshold millivolt readings.
+ *
+ * Each input has a high and a low threshold; a sample at or above the
+ * high threshold reads high, at or below the low threshold reads low,
+ * and anything in between leaves the input where it was (hysteresis).
+ * Thresholds are converted to raw ADC counts when the input is
+ * configured, so each check is a compare; configure the input again
+ * after changing its range or calibration.
+ *
+ * Debouncing is time-based and runs on every ADC sample as it is taken,
+ * in the sequencer's timer interrupt: the input changes once every
+ * sample for @p debounce_ms has read the new level. A sample reading
+ * the old level restarts the wait. Samples arrive once per ADC sweep
+ * (see @p _adc.h), so the debounce time is rounded up to the next
+ * sample, and a pulse shorter than one sweep may not be seen at all.
+ *
+ * Changes are delivered as events, either to a callback (in interrupt
+ * context) or through a queue read with HAL_input_get_event(). If the
+ * queue is full, the oldest event is discarded; the current state is
+ * always available from HAL_pin_get_input().
+ *
+ * Cost: a compare or two per sample, plus a timestamp while an input
+ * is changing; estimated at ~100 bus cycles per input per sweep.
+ */
+
+#pragma ONCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <HAL/_pin.h>
+#include <HAL/_timer.h>
+
+/** Maximum number of digital inputs */
+#define HAL_INPUT_MAX           4
+
+/** Event queue depth */
+#define HAL_INPUT_QUEUE_DEPTH   8
+
+/** Digital input parameters */
+typedef struct {
+    uint16_t    high_mV;            /**< reads high at or above this voltage */
+    uint16_t    low_mV;             /**< reads low at or below this voltage */
+    uint16_t    debounce_ms;        /**< time a new level must be stable for */
+    bool        pullup;             /**< enable the pin's pull-up, if it has one */
+} HAL_input_config_t;
+
+/** Input change event */
+typedef struct {
+    const HAL_pin_t     *pin;       /**< input that changed */
+    bool                level;      /**< new level */
+    HAL_microseconds    time_us;    /**< time the change was accepted */
+} HAL_input_event_t;
+
+/** Input change callback, called in interrupt context */
+typedef void (*HAL_input_callback_t)(const HAL_input_event_t *event);
+
+/* per-sample hook called by the ADC sequencer in interrupt context */
+extern void     _HAL_input_sample(uint8_t index, uint16_t counts);
+
+/**
+ * Configure a pin as a debounced digital input.
+ *
+ * The initial level is taken from the pin's current voltage reading,
+ * without an event.
+ *
+ * @param pin           Pin to configure; must have voltage feedback,
+ *                      not already checked by output protection.
+ * @param config        Input parameters, or NULL to stop treating the
+ *                      pin as a digital input.
+ */
+extern void     HAL_pin_set_input(const HAL_pin_t *pin, const HAL_input_config_t *config);
+
+/**
+ * Get the debounced level of a digital input.
+ *
+ * @param pin           Pin configured with HAL_pin_set_input().
+ * @return              True if the input is high.
+ */
+extern bool     HAL_pin_get_input(const HAL_pin_t *pin);
+
+/**
+ * Set a callback for input changes.
+ *
+ * Events delivered to the callback are not queued.
+ *
+ * @param callback      Function to call in interrupt context, or NULL
+ *                      to queue events instead.
+ */
+extern void     HAL_input_set_callback(HAL_input_callback_t callback);
+
+/**
+ * Take the oldest queued input change.
+ *
+ * @param event         Filled in with the event.
+ * @return              True if an event was returned, false if the
+ *                      queue was empty.
+ */
+extern bool     HAL_input_get_event(HAL_input_event_t *event);
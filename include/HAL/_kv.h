@@ -0,0 +1,75 @@
+/** @file
+ *
+ * Wear-levelled key/value store in EEPROM.
+ *
+ * Small values that change often (counters, last-used settings) wear
+ * out a fixed EEPROM location quickly, as every update erases its
+ * sector, and each erase takes 20ms. The key/value store instead keeps
+ * an append-only log of 4-byte records (key, 16-bit value, check byte)
+ * in an area of the EEPROM, split into two halves.
+ *
+ * An update appends a record to the active half. Appending only
+ * programs bytes that are still erased, so it takes four byte programs
+ * and no erase. When the active half is full, the latest value of each
+ * key is copied to the other half, which is committed by writing its
+ * header (a generation count) last; the old half is then erased in the
+ * background by the _HAL_kv_service protothread. Each sector is erased
+ * once per compaction rather than once per update.
+ *
+ * A RAM index holds the current value of every key, so reads never
+ * touch the EEPROM. The log is replayed on first use; a record torn by
+ * a reset fails its check byte and is ignored, leaving the previous
+ * value.
+ *
+ * The area defaults to 0x300-0x4ff, within the application's EEPROM
+ * area, and can be moved by defining HAL_KV_START and HAL_KV_END (e.g.
+ * in APP_DEFINES); its size must be a multiple of 16 bytes, with room
+ * for at least HAL_KV_KEYS + 1 records per half. The application must
+ * not write to the area directly. An area that holds no valid header
+ * is erased on first use.
+ *
+ * @note    Not interrupt safe. Compaction waits for the EEPROM queue
+ *          to drain, which may take tens of milliseconds.
+ */
+
+#pragma ONCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pt.h>
+
+#ifndef HAL_KV_START
+/** Start of the key/value store area */
+# define HAL_KV_START           0x300U
+#endif
+
+#ifndef HAL_KV_END
+/** End (exclusive) of the key/value store area */
+# define HAL_KV_END             0x500U
+#endif
+
+/** Number of keys; keys are 0 to HAL_KV_KEYS - 1 */
+#define HAL_KV_KEYS             32
+
+/* background compaction, run from the main loop */
+PT_DECLARE(_HAL_kv_service);
+
+/**
+ * Get the value for a key.
+ *
+ * @param key               Key to look up.
+ * @param value             Set to the value if the key has been stored.
+ * @return                  True if the key has a value.
+ */
+extern bool     HAL_kv_get(uint8_t key, uint16_t *value);
+
+/**
+ * Store a value for a key.
+ *
+ * Returns once the record is queued for writing; see @p _eeprom.h.
+ * Storing the value a key already has does nothing.
+ *
+ * @param key               Key to store.
+ * @param value             Value to store.
+ */
+extern void     HAL_kv_set(uint8_t key, uint16_t value);
@@ -0,0 +1,108 @@
+/** @file
+ *
+ * Persistent fault and event log.
+ *
+ * A ring of 32 timestamped records in the HAL-reserved EEPROM area, so
+ * that faults seen in the field (aborts, CAN bus-off, output trips,
+ * resets) can be read back later over CAN without a laptop having
+ * been attached when they happened.
+ *
+ * HAL_log() may be called from interrupt context: it stamps the event
+ * and adds it to a small RAM queue. The _HAL_log_service protothread,
+ * run from the main loop, writes queued events to the next slot in the
+ * ring through the write-behind engine (see _eeprom.h), one at a time,
+ * so logging never waits for the EEPROM and wear is spread over the
+ * whole ring. If the queue is full, the new event is dropped.
+ *
+ * The log's EEPROM area is only reserved, and the log only written, if
+ * the application defines HAL_LOG_ENABLE (in APP_DEFINES); otherwise
+ * HAL_log() just traces the event (see _crash.h) and the log reads as
+ * empty.
+ *
+ * The HAL logs a RESET event at startup, and the first CAN bus-off
+ * after startup. An output trip is logged once until the output's
+ * protection is reset or reconfigured. Repeated faults are not logged,
+ * so a fault that keeps recurring doesn't wear out the log.
+ *
+ * An abort writes nothing to the EEPROM; it is logged at the next boot,
+ * as an ABORT record before the RESET, from the crash record that
+ * survived the reset (see _crash.h). Events still queued at the abort
+ * are lost from the log, but are in the crash record's trace.
+ *
+ * Each record is one EEPROM sector, stored as:
+ *
+ *   byte 0     sequence number, incremented for each record
+ *   byte 1-3   time, HAL_timer_us() >> 8 (256us units, wraps ~71min)
+ *   byte 4-5   argument, big-endian
+ *   byte 6     event
+ *   byte 7     low byte of crc16() over bytes 0-6
+ *
+ * A record torn by a reset fails its check byte and ends the log; the
+ * next record is written over it.
+ *
+ * The log can be read in bulk by the MRS bootloader protocol; once
+ * the module is selected, command 0x20 0x04 sends every record,
+ * oldest first, as 8-byte messages on 0x1ffffff6, followed by
+ * 0x21 0x04 <count> on the response ID.
+ */
+
+#pragma ONCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pt.h>
+#include <HAL/_timer.h>
+
+/** Number of records kept */
+#define HAL_LOG_RECORDS         32
+
+/** Events queued before they are written */
+#define HAL_LOG_QUEUE_DEPTH     8
+
+/** Size of a record as stored */
+#define HAL_LOG_RECORD_SIZE     8
+
+/** Logged events */
+typedef enum {
+    HAL_LOG_RESET = 1,          /**< HAL started; arg is the HAL_reset_reason_t */
+    HAL_LOG_ABORT,              /**< REQUIRE() failed before the last reset; arg is the line number */
+    HAL_LOG_CAN_BUS_OFF,        /**< CAN controller went bus-off */
+    HAL_LOG_OUTPUT_TRIP,        /**< output protection tripped; arg is channel << 8 | HAL_protect_fault_t */
+    HAL_LOG_APP = 0x80          /**< first application-defined event */
+} HAL_log_event_t;
+
+/** A logged event */
+typedef struct {
+    HAL_microseconds    time_us;    /**< HAL_timer_us() when logged, to 256us */
+    uint16_t            arg;        /**< event-specific argument */
+    uint8_t             event;      /**< HAL_log_event_t */
+} HAL_log_entry_t;
+
+extern void     _HAL_log_init(void);
+extern bool     _HAL_log_record(uint8_t age, uint8_t *record);
+
+/* writes queued events, run from the main loop */
+PT_DECLARE(_HAL_log_service);
+
+/**
+ * Log an event.
+ *
+ * Safe to call from interrupt context.
+ *
+ * @param event             Event, HAL_LOG_APP or above for application
+ *                          events.
+ * @param arg               Event-specific argument.
+ */
+extern void     HAL_log(uint8_t event, uint16_t arg);
+
+/**
+ * Read a logged event.
+ *
+ * Events still waiting in the RAM queue are not seen.
+ *
+ * @param age               0 for the newest event, 1 for the one
+ *                          before, etc.
+ * @param entry             Filled in with the event.
+ * @return                  True if there is an event of that age.
+ */
+extern bool     HAL_log_read(uint8_t age, HAL_log_entry_t *entry);
@@ -6,6 +6,12 @@
 #pragma ONCE
 
 #include <stdbool.h>
+#include <HAL/_adc.h>
+#include <HAL/_pwm.h>
+
+/* unassigned pin resources */
+#define _HAL_PIN_PWM_NONE   7
+#define _HAL_PIN_AI_NONE    15
 
 /**
  * Generic GPIO.
@@ -46,6 +52,64 @@ extern const HAL_pin_t  _HAL_7X_pin[];
  */
 extern void     HAL_pin_set_duty(const HAL_pin_t *pin, uint8_t duty);
 
+/**
+ * Configure and drive a PWM pin with a high-resolution duty cycle.
+ *
+ * @param pin           Pin to configure.
+ * @param duty          Output duty cycle as a fraction of the period,
+ *                      0 (off) to HAL_PWM_DUTY_FULL (on).
+ */
+extern void     HAL_pin_set_duty16(const HAL_pin_t *pin, uint16_t duty);
+
+/**
+ * Stage a duty cycle for a PWM pin, to be applied with other staged
+ * pins by HAL_pwm_commit().
+ *
+ * @param pin           Pin to stage.
+ * @param duty          Output duty cycle in percent.
+ */
+extern void     HAL_pin_stage_duty(const HAL_pin_t *pin, uint8_t duty);
+
+/**
+ * Stage a high-resolution duty cycle for a PWM pin, to be applied with
+ * other staged pins by HAL_pwm_commit().
+ *
+ * @param pin           Pin to stage.
+ * @param duty          Output duty cycle as a fraction of the period.
+ */
+extern void     HAL_pin_stage_duty16(const HAL_pin_t *pin, uint16_t duty);
+
+/**
+ * Ramp a PWM pin to a new duty cycle over a fixed time.
+ *
+ * See @p HAL_pwm_ramp().
+ *
+ * @param pin           Pin to ramp.
+ * @param duty          Target duty cycle in percent.
+ * @param time_ms       Ramp duration; 0 sets the duty cycle immediately.
+ */
+extern void     HAL_pin_ramp_duty(const HAL_pin_t *pin, uint8_t duty, uint16_t time_ms);
+
+/**
+ * Ramp a PWM pin to a new duty cycle at a fixed rate.
+ *
+ * See @p HAL_pwm_ramp_rate().
+ *
+ * @param pin           Pin to ramp.
+ * @param duty          Target duty cycle in percent.
+ * @param rate          Ramp rate in percent per second.
+ */
+extern void     HAL_pin_ramp_duty_rate(const HAL_pin_t *pin, uint8_t duty, uint16_t rate);
+
+/**
+ * Select the PWM frequency group for a pin.
+ *
+ * @param pin           Pin to configure.
+ * @param group         HAL_PWM_GROUP_TPM1 or HAL_PWM_GROUP_SOFT; see
+ *                      @p _pwm.h.
+ */
+extern void     HAL_pin_set_pwm_group(const HAL_pin_t *pin, uint8_t group);
+
 /**
  * Configure and drive a DO pin in digital output mode.
  *
@@ -77,6 +141,16 @@ extern void     HAL_pin_set_range(const HAL_pin_t *pin, bool high_range);
  */
 extern void     HAL_pin_set_pullup(const HAL_pin_t *pin, bool enable);
 
+/**
+ * Select the ADC conversion mode used to measure the voltage on a pin.
+ *
+ * See @p _adc.h for the resolution / update rate trade-offs.
+ *
+ * @param pin           Pin to configure.
+ * @param mode          Conversion mode.
+ */
+extern void     HAL_pin_set_adc_mode(const HAL_pin_t *pin, HAL_adc_mode_t mode);
+
 /**
  * Read the voltage on a pin.
  *
@@ -0,0 +1,202 @@
+/** @file
+ *
+ * Output fault protection.
+ *
+ * Outputs with current (AI_CS) and/or voltage (AI_OP) feedback can be
+ * protected against overcurrent, open load and short to battery. Each
+ * ADC sample for a protected output is checked against the output's
+ * limits as soon as it is taken, in the ADC sequencer's timer
+ * interrupt; the application loop is not involved.
+ *
+ * On a trip, the output is forced off immediately (the TPM1 channel
+ * is disconnected from the pin, rather than waiting for the end of
+ * the PWM period) and the fault reason is latched. The requested duty
+ * cycle is remembered; the output is retried after a delay that
+ * doubles on each subsequent trip, up to the configured number of
+ * retries, after which it stays off until the fault is cleared.
+ *
+ * Checks
+ * ------
+ *
+ * Overcurrent      Any current sample above the limit.
+ *
+ * Open load        A current sample below the limit while the output
+ *                  is known to be on; i.e. at 100% duty, or sampled
+ *                  synchronised to the PWM on-time (see @p _adc.h).
+ *
+ * Short to battery A voltage sample above the limit while the output
+ *                  is commanded off (7X only; the 7H has no output
+ *                  voltage feedback).
+ *
+ * Limits are converted to raw ADC counts when they are set, so each
+ * check is a single compare. Thresholds are not updated if the ADC
+ * calibration changes; set the protection again after calibrating.
+ *
+ * Latency
+ * -------
+ *
+ * Detection latency is bounded by the time between consecutive
+ * samples of the output's feedback channel, i.e. one ADC sweep: 1ms
+ * per channel, plus up to (PWM period + 2ms) for each channel that is
+ * waiting to synchronise with a PWM output, plus 3ms for each
+ * oversampled channel. The time from the sample to the output being
+ * forced off is a few tens of microseconds.
+ *
+ * @p HAL_protect_latency_us() reports the worst case actually
+ * observed. The VNQ5050 drivers have their own current limit and
+ * thermal shutdown, which act much faster; this layer bounds how long
+ * a fault may persist beyond that.
+ *
+ * I2t thermal model
+ * -----------------
+ *
+ * A fixed overcurrent limit must either sit above lamp and motor
+ * inrush or let moderate overloads run indefinitely. The I2t model
+ * instead tracks the output's heating as a first-order filter of
+ * the on-state current squared, weighted by the PWM duty cycle:
+ *
+ *     heat += (I^2 * duty - heat) * 1ms / tau
+ *
+ * with current relative to the configured trip current, so that heat
+ * settles at 100% when running continuously at the trip current. A
+ * short inrush well above the trip current only raises the heat
+ * briefly; a sustained overload eventually reaches 100%, after
+ * roughly tau * -ln(1 - (Itrip / I)^2).
+ *
+ * On reaching 100% the output either trips (fault HAL_PROTECT_OVERLOAD,
+ * retried according to the pin's protection policy, but not until the
+ * heat has fallen back below 87.5%), or if derating is selected its
+ * duty cycle is limited, reducing the limit by 1/8 per ADC sweep
+ * while the heat is at or above 100% and relaxing it again once the
+ * heat falls below 87.5%.
+ *
+ * The current is the channel's averaged AI_CS reading, which is the
+ * on-state current when sampling is synchronised to the PWM (the
+ * default); with synchronisation disabled, PWM outputs under-read.
+ *
+ * Cost: the filter runs from a 1ms timer callback. Per enabled channel
+ * each tick costs one signed 16x16 multiply, a 32-bit add and a
+ * compare. When the ADC publishes a new sweep (typically every
+ * 10-70ms) the heating inputs are recomputed one channel per tick,
+ * each with three 32-bit multiplies and no divides: the current is
+ * scaled by a reciprocal of the trip current taken when the model is
+ * configured, and weighted by the duty cycle with a per-period scale
+ * set by HAL_pwm_set_period(). The worst tick is one filter step per
+ * enabled channel plus one input. Disabled channels cost a test and
+ * branch.
+ */
+
+#pragma ONCE
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <HAL/_pin.h>
+#include <HAL/_timer.h>
+
+/** Retry count meaning "retry forever" */
+#define HAL_PROTECT_RETRY_FOREVER   0xff
+
+/** Upper limit for the retry backoff */
+#define HAL_PROTECT_BACKOFF_MAX_MS  0x8000U
+
+/** Output fault reasons */
+typedef enum {
+    HAL_PROTECT_OK,                 /**< no fault */
+    HAL_PROTECT_OVERCURRENT,        /**< current above the limit */
+    HAL_PROTECT_OPEN_LOAD,          /**< current below the limit while on */
+    HAL_PROTECT_SHORT_TO_BATTERY,   /**< voltage above the limit while off */
+    HAL_PROTECT_OVERLOAD,           /**< I2t model reached its trip level */
+} HAL_protect_fault_t;
+
+/** Output protection limits and policy */
+typedef struct {
+    uint16_t    overcurrent_mA;     /**< trip above this current, 0 to disable */
+    uint16_t    open_load_mA;       /**< trip below this current while on, 0 to disable */
+    uint16_t    short_mV;           /**< trip above this voltage while off, 0 to disable */
+    uint16_t    retry_ms;           /**< delay before the first retry */
+    uint8_t     retries;            /**< retries before staying off, or HAL_PROTECT_RETRY_FOREVER */
+} HAL_protect_config_t;
+
+/** I2t thermal model parameters */
+typedef struct {
+    uint16_t    trip_mA;            /**< continuous current at which the model trips */
+    uint16_t    tau_ms;             /**< thermal time constant, at least 2ms */
+    bool        derate;             /**< limit the duty cycle rather than tripping */
+} HAL_i2t_config_t;
+
+/* per-sample hook called by the ADC sequencer in interrupt context */
+extern void     _HAL_protect_sample(uint8_t index, uint16_t counts, bool synced);
+
+/**
+ * Configure protection for an output pin.
+ *
+ * Clears any latched fault and re-arms the retry count.
+ *
+ * @param pin           Output pin to protect; must have a PWM channel,
+ *                      and its feedback must not be a digital input
+ *                      (HAL_pin_set_input()).
+ * @param config        Limits and retry policy, or NULL to disable
+ *                      protection for the pin.
+ */
+extern void     HAL_pin_set_protection(const HAL_pin_t *pin, const HAL_protect_config_t *config);
+
+/**
+ * Get the latched fault for an output pin.
+ *
+ * The fault remains latched across retries, including successful
+ * ones, until cleared.
+ *
+ * @param pin           Output pin to check.
+ * @return              The most recent fault, or HAL_PROTECT_OK.
+ */
+extern HAL_protect_fault_t HAL_pin_get_fault(const HAL_pin_t *pin);
+
+/**
+ * Test whether an output pin is currently forced off by protection.
+ *
+ * @param pin           Output pin to check.
+ * @return              True if the output is off due to a fault.
+ */
+extern bool     HAL_pin_is_tripped(const HAL_pin_t *pin);
+
+/**
+ * Clear the latched fault for an output pin.
+ *
+ * The output resumes at the most recently requested duty cycle, and
+ * the retry count and backoff are reset.
+ *
+ * @param pin           Output pin to clear.
+ */
+extern void     HAL_pin_clear_fault(const HAL_pin_t *pin);
+
+/**
+ * Configure the I2t thermal model for an output pin.
+ *
+ * Resets the model to cold and removes any derating.
+ *
+ * @param pin           Output pin to model; must have a PWM channel and
+ *                      current feedback.
+ * @param config        Model parameters, or NULL to disable the model
+ *                      for the pin.
+ */
+extern void     HAL_pin_set_i2t(const HAL_pin_t *pin, const HAL_i2t_config_t *config);
+
+/**
+ * Get the remaining I2t headroom for an output pin.
+ *
+ * @param pin           Output pin to check.
+ * @return              Headroom in percent; 100 when cold (or the model
+ *                      is disabled), 0 when tripped or derating.
+ */
+extern uint8_t  HAL_pin_get_i2t_headroom(const HAL_pin_t *pin);
+
+/**
+ * Report the worst-case protection latency observed so far.
+ *
+ * This is the longest interval seen between consecutive samples of a
+ * protected output's feedback, plus the longest time taken from a
+ * sample to the output being forced off.
+ *
+ * @return              Worst-case detection latency in microseconds.
+ */
+extern HAL_microseconds HAL_protect_latency_us(void);
@@ -14,15 +14,190 @@
  * To avoid runt cycles, any pulse duration less than 100us (high
  * or low) is converted to a steady state.
  *
+ * Duty cycles can be set in percent, or with full timer resolution
+ * as a 16-bit fraction of the period using HAL_pwm_set_duty16(). The
+ * fraction is scaled by the period count with a multiply and shift;
+ * neither API divides at runtime.
+ *
  * The 7L's drivers are not identified, but we make the assumption
  * that they're likely to be similar.
+ *
+ * Ramps
+ * -----
+ *
+ * HAL_pwm_ramp() and HAL_pwm_ramp_rate() move an output from its
+ * current duty cycle to a target linearly, stepping every 1ms from a
+ * timer callback so that the ramp does not depend on main-loop timing.
+ * Steps are precomputed when the ramp starts, so each tick is an add
+ * and a compare register update per ramping channel. The hardware only
+ * takes a new duty cycle at the start of each period, so the output
+ * moves in per-period steps. Once no channel is ramping the callback
+ * stops, costing nothing.
+ *
+ * Batched updates
+ * ---------------
+ *
+ * Outputs that must change together (H-bridge pairs, colour mixing)
+ * can have their duty cycles staged with HAL_pwm_stage() and then
+ * applied together with HAL_pwm_commit(). The staged values are
+ * written from the TPM1 overflow interrupt at the start of the next
+ * period, and take effect together at the start of the period after
+ * that (or at each channel's next turn-on in staggered mode).
+ *
+ * Channel mode registers are shadowed, and only rewritten when the
+ * mode changes; normally only the compare value is written.
+ *
+ * Staggered mode
+ * --------------
+ *
+ * In the default edge-aligned mode every channel turns on at the start
+ * of the period, so the inrush of all active loads lands on KL30 at
+ * the same instant. HAL_pwm_set_staggered() switches to a mode where
+ * channel n turns on at n/6 of the way through the period instead,
+ * using output compares that set and clear the pin, with the next
+ * edge programmed from the channel's compare interrupt. Steady on/off
+ * outputs are static and take no interrupts.
+ *
+ * Worst-case number of outputs on at once, six outputs at the same
+ * duty (from stepping both schemes over one 2001-count period; see
+ * test/host/test_pwm.c):
+ *
+ *     duty    edge-aligned    staggered
+ *     10%     6               1
+ *     25%     6               2
+ *     50%     6               4
+ *     75%     6               5
+ *
+ * and no more than one output ever turns on at the same instant.
+ *
+ * Costs: two compare interrupts per switching output per period,
+ * i.e. 1.5kHz with six outputs at the default 8ms period. Duty changes
+ * take effect at the channel's next turn-on.
+ *
+ * Each edge is programmed from the previous edge's interrupt. The
+ * compare interrupts can be held off by the 1ms tick (which runs the
+ * ADC sequencer, protection, ramps and the application's timer calls)
+ * and by each other; if one runs after the next edge was due, that edge
+ * is taken at once rather than a period later. Edges stay on their
+ * schedule, so a late edge lengthens one pulse by the latency and
+ * shortens the next by as much; the period and the average duty cycle
+ * don't drift. Pulses are limited to 100us as in edge-aligned mode, so
+ * the duty range doesn't depend on the latency:
+ *
+ *     period  duty range
+ *     1ms     10% - 90%
+ *     2ms     5% - 95%
+ *     4ms     2.5% - 97.5%
+ *     8ms     1.25% - 98.75%
+ *     20ms    0.5% - 99.5%
+ *
+ * with anything outside it converted to off or on. A short pulse may
+ * come out as long as the latency when its edge is late.
+ * test/host/test_pwm.c checks the pulse widths against a model of TPM1
+ * with a long tick.
+ *
+ * Frequency groups
+ * ----------------
+ *
+ * All TPM1 channels share one period. Outputs that need a different
+ * frequency (e.g. a valve at 200Hz alongside lamps at 125Hz) can be
+ * moved to the software group with HAL_pwm_set_group(). The second
+ * timer, TPM2, has only two channels, and both are taken by the tick
+ * and the microsecond alarms, so the software group is driven from
+ * the alarms: the channel is disconnected from TPM1 and its pin
+ * driven as GPIO, turned on at the start of each software period and
+ * off at the channel's edge. Edges are scheduled against the previous
+ * deadline, so the period does not drift; channels with the same
+ * on-time share an edge. The duty cycle APIs, ramps, batched updates,
+ * protection and derating all work unchanged; a change takes effect at
+ * the start of the next software period.
+ *
+ * Costs are estimates, not measured on the target: ~40us at the start
+ * of each software period (more when a new schedule is taken up) and
+ * ~20us per distinct turn-off edge. At the default 10ms period with
+ * six channels at distinct duty cycles, that is 700 interrupts/s, and
+ * roughly 1.6% of the CPU if the estimates hold.
+ *
+ * Jitter: edges are generated in interrupt context, so each edge is
+ * late by whatever interrupt is running when it falls due; the 1ms
+ * tick (ADC sequencer, protection, ramps and application timer calls)
+ * is the usual culprit, typically tens of microseconds. Edges within
+ * ~20us of each other are taken back to back. Pulses shorter than
+ * 100us are converted to steady states, as for TPM1.
+ *
+ * test/host/test_soft_pwm.c runs the group against a model of TPM2
+ * with these costs and a 60us tick, and checks the interrupt and alarm
+ * rates, that the period doesn't drift, and that no edge is later than
+ * the tick plus one period interrupt.
+ *
+ * Software channels are not synchronised with the ADC, so their
+ * current is sampled at a random point in the period and open load is
+ * only checked at 100% duty. The group's pins are written with
+ * read-modify-write cycles on PTDD from interrupt context; other PTDD
+ * bits should only be changed with single-bit writes (as the 7X.h
+ * macros do) or with interrupts disabled.
  */
 
 #pragma ONCE
 
+#include <stdbool.h>
 #include <stdint.h>
 
-extern void _HAL_pwm_init(void);
+/** 16-bit fractional duty cycle meaning fully on */
+#define HAL_PWM_DUTY_FULL       0xffffU
+
+/* TPM1 count period in microseconds */
+#define _HAL_PWM_QUANTUM_US     4
+
+/* number of TPM1 channels */
+#define _HAL_PWM_CHANNELS       6
+
+/** Frequency groups */
+#define HAL_PWM_GROUP_TPM1      0       /**< TPM1 hardware PWM, HAL_pwm_set_period() */
+#define HAL_PWM_GROUP_SOFT      1       /**< software PWM, HAL_pwm_set_soft_period() */
+
+/** Software PWM period limits */
+#define HAL_PWM_SOFT_PERIOD_MIN_US  2000U
+#define HAL_PWM_SOFT_PERIOD_MAX_US  32000U
+
+/* TPM1 channel shared with the FREQ_IN input capture */
+#define _HAL_PWM_CAPTURE_CHANNEL    0
+
+/* one-shot TPM1 overflow (period start) requests */
+#define _HAL_PWM_OVF_ADC_SYNC   0x01    /* call _HAL_adc_pwm_sync */
+#define _HAL_PWM_OVF_COMMIT     0x02    /* apply staged duty cycles */
+
+extern void     _HAL_pwm_init(void);
+extern void     _HAL_pwm_overflow_request(uint8_t request);
+extern uint16_t _HAL_pwm_cycles(uint8_t channel);
+extern uint16_t _HAL_pwm_duty16(uint8_t channel);
+extern uint16_t _HAL_pwm_period_cycles(void);
+extern uint8_t  _HAL_pwm_period_ms(void);
+extern uint16_t _HAL_pwm_phase_cycles(uint8_t channel);
+extern bool     _HAL_pwm_is_soft(uint8_t channel);
+
+/*
+ * Hand the capture channel to FREQ_IN, capturing both edges, and gate
+ * its interrupt. Interrupt-safe.
+ */
+extern void     _HAL_pwm_set_capture(bool enable);
+extern void     _HAL_pwm_capture_enable(bool enable);
+
+/*
+ * Force a channel off immediately, independent of the requested duty
+ * cycle, and restore it. Interrupt-safe.
+ */
+extern void     _HAL_pwm_inhibit(uint8_t channel);
+extern void     _HAL_pwm_release(uint8_t channel);
+extern bool     _HAL_pwm_is_inhibited(uint8_t channel);
+
+/*
+ * Limit a channel's duty cycle to cap/256 of the period, independent
+ * of the requested duty cycle; _HAL_PWM_CAP_NONE removes the limit.
+ * Interrupt-safe.
+ */
+#define _HAL_PWM_CAP_NONE       256
+extern void     _HAL_pwm_set_cap(uint8_t channel, uint16_t cap);
 
 /**
  * Set the PWM period.
@@ -31,10 +206,109 @@ extern void _HAL_pwm_init(void);
  */
 extern void HAL_pwm_set_period(uint8_t period_ms);
 
+/**
+ * Select staggered or edge-aligned PWM.
+ *
+ * @param enable    [in]    True to stagger channel turn-on points across
+ *                          the period, false for edge-aligned PWM (the
+ *                          default).
+ */
+extern void HAL_pwm_set_staggered(bool enable);
+
+/**
+ * Move a PWM output between frequency groups.
+ *
+ * The output keeps its requested duty cycle as a fraction of the
+ * period.
+ *
+ * @param channel   [in]    PWM channel to move.
+ * @param group     [in]    HAL_PWM_GROUP_TPM1 (the default) or
+ *                          HAL_PWM_GROUP_SOFT.
+ */
+extern void HAL_pwm_set_group(uint8_t channel, uint8_t group);
+
+/**
+ * Set the software PWM group's period.
+ *
+ * @param period_us [in]    Period in microseconds, between
+ *                          HAL_PWM_SOFT_PERIOD_MIN_US and
+ *                          HAL_PWM_SOFT_PERIOD_MAX_US; other values
+ *                          are ignored. The default is 10ms.
+ */
+extern void HAL_pwm_set_soft_period(uint16_t period_us);
+
 /**
  * Configure a PWM output.
  *
+ * Cancels any ramp in progress on the channel.
+ *
  * @param channel   [in]    PWM channel to configure.
  * @param duty      [in]    Active duty cycle; high for 7H/7X, low for 7L.
  */
 extern void HAL_pwm_set(uint8_t channel, uint8_t duty);
+
+/**
+ * Configure a PWM output with a high-resolution duty cycle.
+ *
+ * Cancels any ramp in progress on the channel.
+ *
+ * @param channel   [in]    PWM channel to configure.
+ * @param duty      [in]    Active duty cycle as a fraction of the period,
+ *                          0 (off) to HAL_PWM_DUTY_FULL (on).
+ */
+extern void HAL_pwm_set_duty16(uint8_t channel, uint16_t duty);
+
+/**
+ * Stage a duty cycle for a PWM output, to be applied by HAL_pwm_commit().
+ *
+ * @param channel   [in]    PWM channel to stage.
+ * @param duty      [in]    Duty cycle in percent.
+ */
+extern void HAL_pwm_stage(uint8_t channel, uint8_t duty);
+
+/**
+ * Stage a high-resolution duty cycle for a PWM output, to be applied
+ * by HAL_pwm_commit().
+ *
+ * @param channel   [in]    PWM channel to stage.
+ * @param duty      [in]    Duty cycle as a fraction of the period.
+ */
+extern void HAL_pwm_stage_duty16(uint8_t channel, uint16_t duty);
+
+/**
+ * Apply all staged duty cycles together at the next period boundary.
+ *
+ * Returns immediately. Committed channels cancel any ramp in progress.
+ * Channels staged before a pending commit completes may be applied
+ * with it; use HAL_pwm_commit_pending() to avoid this.
+ */
+extern void HAL_pwm_commit(void);
+
+/**
+ * Test whether a commit is waiting for the period boundary.
+ *
+ * @return                  True if the last commit has not been applied yet.
+ */
+extern bool HAL_pwm_commit_pending(void);
+
+/**
+ * Ramp a PWM output to a new duty cycle over a fixed time.
+ *
+ * Replaces any ramp in progress on the channel, starting from the
+ * duty cycle it has reached.
+ *
+ * @param channel   [in]    PWM channel to ramp.
+ * @param duty      [in]    Target duty cycle in percent.
+ * @param time_ms   [in]    Ramp duration; 0 sets the duty cycle immediately.
+ */
+extern void HAL_pwm_ramp(uint8_t channel, uint8_t duty, uint16_t time_ms);
+
+/**
+ * Ramp a PWM output to a new duty cycle at a fixed rate.
+ *
+ * @param channel   [in]    PWM channel to ramp.
+ * @param duty      [in]    Target duty cycle in percent.
+ * @param rate      [in]    Ramp rate in percent per second; 0 sets the duty
+ *                          cycle immediately.
+ */
+extern void HAL_pwm_ramp_rate(uint8_t channel, uint8_t duty, uint16_t rate);
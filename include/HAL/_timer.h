@@ -2,7 +2,7 @@
  *
  * Timers and timebase.
  *
- * Using TPM2C2
+ * Using TPM2C1 for the 1ms tick, and TPM2C0 for microsecond alarms.
  *
  * FFCLK is 1MHz, so we run with a /1 prescaler to count microseconds.
  *
@@ -46,6 +46,27 @@ typedef struct _HAL_timer_call {
  */
 typedef uint32_t HAL_microseconds;
 
+/*
+ * One-shot microsecond alarm, private to the HAL.
+ *
+ * Alarms are kept in deadline order and fired from the TPM2C0
+ * compare interrupt. The callback runs in interrupt context.
+ * Delays must be less than 32ms.
+ *
+ * _HAL_timer_alarm_set_at() takes an absolute deadline in TPM2 counts
+ * (e.g. a previous alarm's _when plus an interval) for periodic work
+ * that must not drift; deadlines already passed fire immediately.
+ */
+typedef struct _HAL_timer_alarm {
+    void (*callback)(void);
+    uint16_t                    _when;
+    struct _HAL_timer_alarm     *_next;
+} _HAL_timer_alarm_t;
+
+extern void         _HAL_timer_alarm_set(_HAL_timer_alarm_t *alarm, uint16_t delay_us);
+extern void         _HAL_timer_alarm_set_at(_HAL_timer_alarm_t *alarm, uint16_t when);
+extern void         _HAL_timer_alarm_cancel(_HAL_timer_alarm_t *alarm);
+
 extern void         _HAL_timer_init(void);
 
 /**
@@ -55,6 +76,9 @@ extern void         _HAL_timer_init(void);
  */
 extern HAL_microseconds HAL_timer_us(void);
 
+/* interrupt-context version of HAL_timer_us; interrupts must be disabled */
+extern HAL_microseconds _HAL_timer_us_isr(void);
+
 /**
  * check whether some time has elapsed
  *
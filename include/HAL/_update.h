@@ -0,0 +1,174 @@
+/** @file
+ *
+ * In-application firmware update.
+ *
+ * A new application image can be sent over CAN while the current one
+ * keeps running, and is swapped in during a short reset window. If the
+ * new image doesn't confirm that it is healthy on its first boot, the
+ * old one is swapped back.
+ *
+ * This needs its own flash layout, which roughly halves the space for
+ * the application, so it is only built if the application defines
+ * HAL_UPDATE_ENABLE (in APP_DEFINES); the build then links with
+ * resources/Microplex_7_update.prm instead of the stock layout.
+ * Otherwise the update commands are not answered, nothing is reserved
+ * in the EEPROM, HAL_update_state() returns HAL_UPDATE_NONE and
+ * HAL_update_confirm() does nothing.
+ *
+ * Flash map
+ * ---------
+ *
+ * The flash between the MRS ROM's boundaries (see the README) is split
+ * into 768-byte sectors (see Microplex_7_update.prm):
+ *
+ *   0x2200-0x66ff  active image, 23 sectors; the application is linked
+ *                  here, after a jump to _Startup and a table of jumps
+ *                  to the interrupt handlers in its first 64 bytes.
+ *   0x6700-0xabff  staging area, 23 sectors; the new image is received
+ *                  here, and holds the old image after a swap.
+ *   0xac00-0xaeff  spare sector, used to swap a sector at a time.
+ *   0xaf00-0xb1ff  not used; shares a sector with the MRS ROM's jump
+ *                  table at 0xaf80.
+ *   0xb200-0xbdff  resident code (update_boot.c, the HAL_UPDATE
+ *                  segment): the reset entry point, the swap, and the
+ *                  flash and journal routines. Never written by an
+ *                  update.
+ *
+ * An image is therefore at most 17664 bytes, and is only ever the
+ * active area. The resident code and the interrupt vectors (patched
+ * into the MRS ROM's jump table by the flash tool) are not updated, so
+ * an image can only be sent if it was built with the same resident code
+ * (checked, see below). The vectors point at the table of jumps, which
+ * is at the same place in every image (see lib/start.c), so the HAL's
+ * handlers can move between images; an application's own handlers
+ * can't, unless it adds them to the table. Anything else needs the MRS
+ * flash tool.
+ *
+ * Update
+ * ------
+ *
+ * Once the module is selected and EEPROM writes are enabled, using the
+ * MRS bootloader protocol (see _bootrom.h):
+ *
+ * receive                      send
+ * 20 08 ll ll cc cc rr rr      21 08 st            Start an update of ll ll bytes with
+ *                                                  crc16() cc cc; rr rr is the crc16()
+ *                                                  of the new image's 0xb200-0xbdff.
+ *                                                  Sent once the staging area is erased.
+ * oo oo dd ... at 0x1ffffff8   21 09 oo oo st      Program 1-6 bytes at image offset oo oo.
+ * 20 0a                        21 0a st            Check the CRC and stage the image.
+ * 20 0b                        21 0b st            Swap in the staged image (then resets).
+ * 20 0c                        21 0c ss            Get the HAL_update_state_t.
+ *
+ * st is 00 for success, 0f for failure. Data may be sent in any order,
+ * and resent; resending a byte with a different value fails, as does
+ * anything after 21 08 0f. Erasing the staging area disables interrupts
+ * for ~20ms per sector, and programming for ~50us per byte. The
+ * application keeps running, but during each erase everything driven by
+ * interrupts stops: the 1ms tick (so timers and timer calls lose the
+ * time), output protection and the I2t model, the ADC sequencer, PWM
+ * edges in staggered and software modes, and CAN reception, which may
+ * drop messages. Outputs should be off, or safe to leave unprotected
+ * for 20ms at a time, while an update is being loaded.
+ *
+ * Swap
+ * ----
+ *
+ * The swap runs from the resident code at the next reset, before the
+ * startup code, with each flash command launched from a few bytes of
+ * code copied to the stack. Each of the 23 sectors is swapped in three
+ * copies through the spare sector (active to spare, staging to active,
+ * spare to staging), so the old image ends up in the staging area.
+ * Before each copy its place is recorded in a journal in the
+ * HAL-reserved EEPROM, and each copy only depends on sectors it doesn't
+ * write, so a swap interrupted by a reset or power loss carries on
+ * where it left off. A swap takes a few seconds.
+ *
+ * Health check
+ * ------------
+ *
+ * After the swap the new image is on trial. It should check that it is
+ * working (e.g. after its first few seconds of running, once CAN is up)
+ * and call HAL_update_confirm(). If the module resets before then, for
+ * any reason, the old image is swapped back and the state becomes
+ * HAL_UPDATE_ROLLED_BACK.
+ *
+ * Testing on a host
+ * -----------------
+ *
+ * The resident code (lib/HAL/update_boot.c) only touches the flash
+ * through byte program and sector erase commands, and the EEPROM
+ * through the journal, so test/host/test_update.c runs it against a
+ * model of the flash: an array with 768-byte sectors that erase to
+ * 0xff, where programming can only clear bits, commands launched by
+ * interpreting the code copied to the stack, and a reset injected
+ * part-way through a command. The journal must then always bring the
+ * active and staging areas to a consistent pair of images. The test
+ * also checks that the resident object has no outside references.
+ */
+
+#pragma ONCE
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/** Largest image, bytes */
+#define HAL_UPDATE_IMAGE_SIZE   0x4500U
+
+/* flash map, see above */
+#define _HAL_UPDATE_SECTOR_SIZE 0x300U
+#define _HAL_UPDATE_SECTORS     (HAL_UPDATE_IMAGE_SIZE / _HAL_UPDATE_SECTOR_SIZE)
+#define _HAL_UPDATE_ACTIVE      0x2200U
+#define _HAL_UPDATE_STAGE       0x6700U
+#define _HAL_UPDATE_SPARE       0xac00U
+#define _HAL_UPDATE_RESIDENT    0xb200U
+#define _HAL_UPDATE_RESIDENT_SIZE 0x0c00U
+
+/** Update state */
+typedef enum {
+    HAL_UPDATE_NONE = 0,        /**< no update, or one being received */
+    HAL_UPDATE_STAGED,          /**< an image is staged, waiting for 20 0b */
+    HAL_UPDATE_TRIAL,           /**< running a new image; call HAL_update_confirm() */
+    HAL_UPDATE_CONFIRMED,       /**< running a new image that was confirmed */
+    HAL_UPDATE_ROLLED_BACK      /**< a new image wasn't confirmed; running the old one */
+} HAL_update_state_t;
+
+/* the journal, in the HAL-reserved EEPROM; of its two copies, the newer valid one is current */
+typedef struct {
+    uint8_t     sequence;
+    uint8_t     state;
+    uint8_t     sector;         /* swap in progress: the sector ... */
+    uint8_t     step;           /* ... and the copy about to run */
+    uint8_t     boots;          /* boots of a trial image */
+    uint8_t     _reserved;
+    uint16_t    check;          /* crc16() of the fields above */
+} _HAL_update_journal_t;
+
+/* resident code, update_boot.c */
+extern void     _HAL_update_boot(void);
+extern bool     _HAL_update_flash(uint16_t address, uint8_t value, uint8_t command);
+extern bool     _HAL_update_journal_read(_HAL_update_journal_t *j, uint8_t *copy);
+extern void     _HAL_update_journal_write(_HAL_update_journal_t *j);
+
+/* receiving an image, update.c */
+extern bool     _HAL_update_begin(uint16_t length, uint16_t crc, uint16_t resident_crc);
+extern bool     _HAL_update_erase_next(void);
+extern bool     _HAL_update_ready(void);
+extern bool     _HAL_update_write(uint16_t offset, uint8_t len, const uint8_t *data);
+extern bool     _HAL_update_finish(void);
+extern bool     _HAL_update_activate(void);
+
+/**
+ * Get the update state.
+ *
+ * @return                  The HAL_update_state_t.
+ */
+extern HAL_update_state_t HAL_update_state(void);
+
+/**
+ * Confirm that a new image is healthy.
+ *
+ * Does nothing unless the state is HAL_UPDATE_TRIAL. Waits ~20ms for
+ * the EEPROM.
+ */
+extern void     HAL_update_confirm(void);
@@ -35,6 +35,26 @@ extern void __require_abort(const char *file, int line);
 #define EXIT_CRITICAL_SECTION   \
     if (__interrupt_state) __asm CLI; } while(0)
 
+/**
+ * Storage class and vector number for an interrupt handler, as in
+ *
+ *      VECTOR_HANDLER void
+ *      __interrupt VECTOR(Vtpm1ovf)
+ *      Vtpm1ovf_handler(void)
+ *
+ * With HAL_UPDATE_ENABLE the vectors point at a table of jumps at a
+ * fixed place in the image instead (see lib/start.c and HAL/_update.h),
+ * so that an update can move the handlers; each handler is then global
+ * and has no vector of its own.
+ */
+#ifdef HAL_UPDATE_ENABLE
+# define VECTOR_HANDLER
+# define VECTOR(_v)
+#else
+# define VECTOR_HANDLER         static
+# define VECTOR(_v)             VectorNumber_##_v
+#endif
+
 /**
  * Wrapper for printf().
  *
@@ -62,3 +82,16 @@ extern void printn(const char *format, ...);
  * @param[in]  count  Count in bytes.
  */
 extern void hexdump(uint8_t *addr, unsigned int count);
+
+/**
+ * Calculate a CRC-16/CCITT (polynomial 0x1021) over a buffer.
+ *
+ * Can be called repeatedly to accumulate a CRC over several buffers.
+ *
+ * @param      crc    Initial / accumulated CRC value; start with 0xffff.
+ * @param[in]  data   Data to process.
+ * @param      len    Count in bytes.
+ *
+ * @return     The updated CRC value.
+ */
+extern uint16_t crc16(uint16_t crc, const uint8_t *data, uint16_t len);
@@ -1,8 +1,77 @@
+#include <stddef.h>
 #include <mc9s08dz60.h>
 #include <lib.h>
 #include <HAL/_adc.h>
+#include <HAL/_eeprom.h>
+#include <HAL/_input.h>
+#include <HAL/_protect.h>
+#include <HAL/_pwm.h>
 #include <HAL/_timer.h>
 
+/* time allowed for the sample phase of a synchronised conversion */
+#define _SYNC_SAMPLE_US     20
+
+/* calibration records */
+#define _CAL_MAGIC          0xca1cU
+#define _CAL_GAIN_UNITY     0x4000U         /* 2.14 fixed-point */
+#define _CAL_GAIN_MIN       (_CAL_GAIN_UNITY / 2)
+#define _CAL_GAIN_MAX       0x7fffU
+
+typedef struct {
+    uint16_t    gain;                       /* 2.14 fixed-point */
+    uint16_t    offset;                     /* in 10-bit accumulated counts */
+} _cal_t;
+
+/*
+ * Each input has a record per range: the 30V inputs can be switched to
+ * the 10V scale, which needs its own gain and offset.
+ */
+#define _CAL_RANGES         2
+#define _CAL_RANGE(_scale)  (((_scale) == _HAL_ADC_SCALE_10V) ? 1 : 0)
+
+/* temperature sensor */
+#define _TEMP_CHANNEL       26
+#define _TEMP_NONE          0xff
+#define _TEMP_STEP_C        10
+#define _TEMP_MIN_C         (-40)
+#define _TEMP_MAX_C         150
+
+/* sensor output in uV at temperature _t */
+#define _TEMP_UV(_t)                                                        \
+    (_HAL_TEMP_VTEMP25_UV + HAL_TEMP_OFFSET_UV +                            \
+     (((_t) >= 25) ? -(((_t) - 25) * _HAL_TEMP_SLOPE_HOT_UV)                \
+                   : ((25 - (_t)) * _HAL_TEMP_SLOPE_COLD_UV)))
+
+/* sensor output in 10-bit accumulated counts (5V reference) at temperature _t */
+#define _TEMP_COUNTS(_t)                                                    \
+    ((uint16_t)(((_TEMP_UV(_t) * 1024L) + 312500L) / 625000L))
+
+/* table point; slope is 0.16 fixed-point degrees per count to the next point */
+#define _TEMP_POINT(_t)                                                     \
+    { _TEMP_COUNTS(_t),                                                     \
+      (uint16_t)(((uint32_t)_TEMP_STEP_C << 16) /                           \
+                 (_TEMP_COUNTS(_t) - _TEMP_COUNTS((_t) + _TEMP_STEP_C))) }
+
+typedef struct {
+    uint16_t    counts;
+    uint16_t    slope;
+} _temp_point_t;
+
+static const _temp_point_t _temp_table[] = {
+    _TEMP_POINT(-40), _TEMP_POINT(-30), _TEMP_POINT(-20), _TEMP_POINT(-10),
+    _TEMP_POINT(0),   _TEMP_POINT(10),  _TEMP_POINT(20),  _TEMP_POINT(30),
+    _TEMP_POINT(40),  _TEMP_POINT(50),  _TEMP_POINT(60),  _TEMP_POINT(70),
+    _TEMP_POINT(80),  _TEMP_POINT(90),  _TEMP_POINT(100), _TEMP_POINT(110),
+    _TEMP_POINT(120), _TEMP_POINT(130), _TEMP_POINT(140), _TEMP_POINT(150),
+};
+#define _TEMP_POINTS        (sizeof(_temp_table) / sizeof(_temp_table[0]))
+
+typedef struct {
+    uint16_t    magic;
+    uint16_t    crc;                        /* over cal[] */
+    _cal_t      cal[_HAL_ADC_CAL_CHANNELS][_CAL_RANGES];
+} _cal_block_t;
+
 static const uint16_t _scale_table[] = {
     /* _HAL_ADC_SCALE_30V */    _ADC_SCALE_FACTOR_30V,
     /* _HAL_ADC_SCALE_10V */    _ADC_SCALE_FACTOR_10V,
@@ -12,12 +81,39 @@ static const uint16_t _scale_table[] = {
     /* _HAL_ADC_SCALE_TEMP */   _ADC_SCALE_FACTOR_TEMP,
 };
 
+/* post-scaling right shift for each HAL_adc_mode_t */
+static const uint8_t _mode_shift[] = {
+    /* HAL_ADC_MODE_10BIT */        12,
+    /* HAL_ADC_MODE_12BIT */        14,
+    /* HAL_ADC_MODE_OVERSAMPLE */   15,
+};
+
 static _HAL_adc_channel_state_t *_state;
 static uint8_t                  _sequence;
+static uint8_t                  _conv_mode;
+static uint8_t                  _os_count;
+static uint16_t                 _os_accum;
 static uint8_t                  _bucket;
+static uint16_t                 _sweep;
+static HAL_microseconds         _sweep_time;
 static HAL_timer_call_t         _call;
+static uint8_t                  _count;
+static _cal_block_t             _cal_block;
+static uint8_t                  _temp_index = _TEMP_NONE;
+static uint8_t                  _temp_segment;
 
+static void _adc_calibrate(uint8_t index);
+static _cal_t *_adc_cal(uint8_t index);
+static void _adc_start(void);
 static void _adc_tick(void);
+static void _adc_sync_convert(void);
+
+/* sample point as a fraction of the on-time in 1/256ths, 0 for no sync */
+static uint8_t                  _sync_point = 128;
+static uint16_t                 _sync_wait;
+static uint16_t                 _sync_delay_us;
+static bool                     _synced;
+static _HAL_timer_alarm_t       _sync_alarm = { _adc_sync_convert };
 
 HAL_microseconds adc_channel_interval;
 
@@ -38,21 +134,46 @@ _HAL_adc_init(_HAL_adc_channel_state_t *state)
      */
     ADCCFG_ADICLK = 1;  /* bus clock /2 (10MHz) */
     ADCCFG_ADIV = 3;    /* /8 -> 1.25MHz ADCK -> 800ns / cycle */
-    ADCCFG_MODE = 2;    /* 10-bit mode */
+    ADCCFG_MODE = 2;    /* 10-bit mode, adjusted per-channel in _adc_start */
     ADCCFG_ADLSMP = 1;  /* long sample time */
 
     /* configure for manual conversion trigger */
     ADCSC2 = 0;
 
+    /* load calibration records, fall back to defaults if not enabled or not valid */
+#ifdef HAL_ADC_CAL_ENABLE
+    HAL_eeprom_read(_HAL_EEPROM_ADC_CAL, sizeof(_cal_block), (uint8_t *)&_cal_block);
+#endif
+
+    if ((_cal_block.magic != _CAL_MAGIC) ||
+        (_cal_block.crc != crc16(0xffff,
+                                 (const uint8_t *)&_cal_block.cal[0][0],
+                                 sizeof(_cal_block.cal)))) {
+        for (i = 0; i < _HAL_ADC_CAL_CHANNELS; i++) {
+            uint8_t r;
+
+            for (r = 0; r < _CAL_RANGES; r++) {
+                _cal_block.cal[i][r].gain = _CAL_GAIN_UNITY;
+                _cal_block.cal[i][r].offset = 0;
+            }
+        }
+    }
+
     /* configure channels */
     for (i = 0; _state[i].scale != _HAL_ADC_SCALE_END; i++) {
         if (_state[i].channel < 8) {
             APCTL1 |= (1 << _state[i].channel);
         } else if (_state[i].channel < 16) {
             APCTL2 |= (1 << (_state[i].channel - 8));
+        } else if (_state[i].channel == _TEMP_CHANNEL) {
+            _temp_index = i;
         }
+
+        _adc_calibrate(i);
     }
 
+    _count = i;
+
     /* configure a periodic sample kick every 1ms */
     _call.delay_ms = 1;
     _call.period_ms = 1;
@@ -60,43 +181,494 @@ _HAL_adc_init(_HAL_adc_channel_state_t *state)
     HAL_timer_call_register(_call);
 
     /* start the first conversion */
-    ADCSC1 = _state[0].channel;
+    _adc_start();
+}
+
+/*
+ * Compute the calibrated scale factor and offset for a channel's
+ * current scale and mode.
+ */
+static void
+_adc_calibrate(uint8_t index)
+{
+    _HAL_adc_channel_state_t *const s = &_state[index];
+    uint16_t gain = _CAL_GAIN_UNITY;
+    uint16_t offset = 0;
+
+    if (index < _HAL_ADC_CAL_CHANNELS) {
+        const _cal_t *const cal = _adc_cal(index);
+
+        gain = cal->gain;
+        offset = cal->offset;
+    }
+
+    ENTER_CRITICAL_SECTION;
+    s->factor = (uint16_t)(((uint32_t)_scale_table[s->scale] * gain) >> 14);
+    s->offset = offset << (_mode_shift[s->mode] - 12);
+    EXIT_CRITICAL_SECTION;
+}
+
+/* calibration record for a channel's current scale */
+static _cal_t *
+_adc_cal(uint8_t index)
+{
+    return &_cal_block.cal[index][_CAL_RANGE(_state[index].scale)];
+}
+
+void
+_HAL_adc_set_notify(uint8_t index, uint8_t notify)
+{
+    ENTER_CRITICAL_SECTION;
+
+    /* one hook per channel; taking another user's would silently stop its checks */
+    REQUIRE((_state[index].notify == _HAL_ADC_NOTIFY_NONE) || (_state[index].notify == notify));
+    _state[index].notify = notify;
+
+    EXIT_CRITICAL_SECTION;
+}
+
+void
+_HAL_adc_clear_notify(uint8_t index, uint8_t notify)
+{
+    ENTER_CRITICAL_SECTION;
+
+    /* only the hook's own user can release it */
+    if (_state[index].notify == notify) {
+        _state[index].notify = _HAL_ADC_NOTIFY_NONE;
+    }
+
+    EXIT_CRITICAL_SECTION;
+}
+
+uint16_t
+_HAL_adc_sample_threshold(uint8_t index, uint16_t value)
+{
+    const _HAL_adc_channel_state_t *const s = &_state[index];
+    uint32_t accum;
+
+    if (s->factor == 0) {
+        return 0xffff;
+    }
+
+    /* add back the offset, then divide down to a single sample */
+    accum = (uint32_t)_HAL_adc_value_counts(index, value) +
+            (s->offset >> (_mode_shift[s->mode] - 12));
+    accum /= _HAL_ADC_AVG_SAMPLES;
+
+    return (accum > 0xffff) ? 0xffff : (uint16_t)accum;
 }
 
 void
 _HAL_adc_set_scale(uint8_t index, _HAL_adc_scale_t scale)
 {
     _state[index].scale = (uint8_t)scale;
+    _adc_calibrate(index);
+}
+
+static uint16_t
+_adc_scale(uint8_t index, uint16_t accum)
+{
+    const _HAL_adc_channel_state_t *const s = &_state[index];
+    uint32_t b;
+
+    /* remove offset, clamping at zero */
+    accum = (accum > s->offset) ? (accum - s->offset) : 0;
+
+    /* fixed-point scaling for speed */
+    b = (uint32_t)accum * s->factor;
+    return (uint16_t)(b >> _mode_shift[s->mode]);
+}
+
+/* published result for a channel, in 10-bit accumulated counts */
+static uint16_t
+_adc_counts(uint8_t index)
+{
+    uint16_t accum;
+
+    ENTER_CRITICAL_SECTION;
+    accum = _state[index].result;
+    EXIT_CRITICAL_SECTION;
+
+    return accum >> (_mode_shift[_state[index].mode] - 12);
+}
+
+uint16_t
+_HAL_adc_counts(uint8_t index)
+{
+    const uint16_t counts = _adc_counts(index);
+    const uint16_t offset = _state[index].offset >> (_mode_shift[_state[index].mode] - 12);
+
+    return (counts > offset) ? (counts - offset) : 0;
+}
+
+uint16_t
+_HAL_adc_value_counts(uint8_t index, uint16_t value)
+{
+    const uint16_t factor = _state[index].factor;
+    uint32_t counts;
+
+    if (factor == 0) {
+        return 0xffff;
+    }
+
+    /* invert _adc_scale for 10-bit mode */
+    counts = ((uint32_t)value << 12) / factor;
+
+    return (counts > 0xffff) ? 0xffff : (uint16_t)counts;
+}
+
+uint16_t
+_HAL_adc_sweep(void)
+{
+    uint16_t sweep;
+
+    ENTER_CRITICAL_SECTION;
+    sweep = _sweep;
+    EXIT_CRITICAL_SECTION;
+
+    return sweep;
+}
+
+bool
+_HAL_adc_cal_zero(uint8_t index)
+{
+    if ((index >= _count) || (index >= _HAL_ADC_CAL_CHANNELS)) {
+        return false;
+    }
+
+    /* input is at zero, so whatever we're reading is offset */
+    _adc_cal(index)->offset = _adc_counts(index);
+    _adc_calibrate(index);
+    return true;
+}
+
+bool
+_HAL_adc_cal_span(uint8_t index, uint16_t reference)
+{
+    _cal_t *cal;
+    uint16_t counts;
+    uint32_t uncorrected;
+    uint32_t gain;
+
+    if ((index >= _count) || (index >= _HAL_ADC_CAL_CHANNELS)) {
+        return false;
+    }
+
+    cal = _adc_cal(index);
+
+    /* offset-corrected reading with unity gain */
+    counts = _adc_counts(index);
+    counts = (counts > cal->offset) ? (counts - cal->offset) : 0;
+    uncorrected = ((uint32_t)counts * _scale_table[_state[index].scale]) >> 12;
+
+    if (uncorrected == 0) {
+        return false;
+    }
+
+    /* gain that makes the reading match the reference */
+    gain = ((uint32_t)reference << 14) / uncorrected;
+
+    if ((gain < _CAL_GAIN_MIN) || (gain > _CAL_GAIN_MAX)) {
+        return false;
+    }
+
+    cal->gain = (uint16_t)gain;
+    _adc_calibrate(index);
+    return true;
+}
+
+bool
+_HAL_adc_cal_reset(uint8_t index)
+{
+    _cal_t *cal;
+
+    if ((index >= _count) || (index >= _HAL_ADC_CAL_CHANNELS)) {
+        return false;
+    }
+
+    cal = _adc_cal(index);
+    cal->gain = _CAL_GAIN_UNITY;
+    cal->offset = 0;
+    _adc_calibrate(index);
+    return true;
+}
+
+bool
+_HAL_adc_cal_save(void)
+{
+#ifdef HAL_ADC_CAL_ENABLE
+    _cal_block.magic = _CAL_MAGIC;
+    _cal_block.crc = crc16(0xffff,
+                           (const uint8_t *)&_cal_block.cal[0][0],
+                           sizeof(_cal_block.cal));
+    _HAL_eeprom_write(_HAL_EEPROM_ADC_CAL, sizeof(_cal_block), (const uint8_t *)&_cal_block);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void
+HAL_adc_set_sync_point(uint8_t percent)
+{
+    uint16_t point = ((uint16_t)percent * 256) / 100;
+
+    _sync_point = (point > 255) ? 255 : (uint8_t)point;
+}
+
+void
+HAL_adc_set_mode(uint8_t index, HAL_adc_mode_t mode)
+{
+    _HAL_adc_channel_state_t *const s = &_state[index];
+    uint8_t i;
+
+    ENTER_CRITICAL_SECTION;
+
+    if (s->mode != mode) {
+        const uint8_t from = _mode_shift[s->mode];
+        const uint8_t to = _mode_shift[mode];
+
+        /* rescale existing samples so that results remain valid */
+        for (i = 0; i < _HAL_ADC_AVG_SAMPLES; i++) {
+            if (to > from) {
+                s->samples[i] <<= (to - from);
+            } else {
+                s->samples[i] >>= (from - to);
+            }
+        }
+
+        if (to > from) {
+            s->accum <<= (to - from);
+            s->result <<= (to - from);
+        } else {
+            s->accum >>= (from - to);
+            s->result >>= (from - to);
+        }
+
+        s->mode = mode;
+    }
+
+    EXIT_CRITICAL_SECTION;
+
+    _adc_calibrate(index);
 }
 
 uint16_t
 HAL_adc_result(uint8_t index)
+{
+    uint16_t accum;
+
+    ENTER_CRITICAL_SECTION;
+    accum = _state[index].result;
+    EXIT_CRITICAL_SECTION;
+
+    return _adc_scale(index, accum);
+}
+
+void
+HAL_adc_snapshot(const uint8_t *indices,
+                 uint8_t count,
+                 uint16_t *results,
+                 HAL_adc_sweep_t *sweep)
 {
     uint8_t i;
-    uint32_t b;
-    uint16_t accum = 0;
 
-    for (i = 0; i < _HAL_ADC_AVG_SAMPLES; i++) {
-        uint16_t v;
-        ENTER_CRITICAL_SECTION;
-        v = _state[index].samples[i];
-        EXIT_CRITICAL_SECTION;
-        accum += v;
+    /* copy raw sums in one pass so that they all come from the same sweep */
+    ENTER_CRITICAL_SECTION;
+
+    for (i = 0; i < count; i++) {
+        results[i] = _state[indices[i]].result;
     }
 
-    /* fixed-point scaling for speed */
-    b = (uint32_t)accum * _scale_table[_state[index].scale];
-    return (uint16_t)(b >> 12);
+    if (sweep != NULL) {
+        sweep->sweep = _sweep;
+        sweep->timestamp = _sweep_time;
+    }
+
+    EXIT_CRITICAL_SECTION;
+
+    /* scale outside the critical section */
+    for (i = 0; i < count; i++) {
+        results[i] = _adc_scale(indices[i], results[i]);
+    }
+}
+
+int16_t
+HAL_temperature_c(void)
+{
+    uint16_t counts;
+    uint8_t i;
+
+    REQUIRE(_temp_index != _TEMP_NONE);
+    counts = _adc_counts(_temp_index);
+
+    /* sensor voltage falls with temperature, so the table is descending */
+    if (counts >= _temp_table[0].counts) {
+        return _TEMP_MIN_C;
+    }
+
+    if (counts <= _temp_table[_TEMP_POINTS - 1].counts) {
+        return _TEMP_MAX_C;
+    }
+
+    /* walk from the last segment used; temperature moves slowly */
+    i = _temp_segment;
+
+    while (counts > _temp_table[i].counts) {
+        i--;
+    }
+
+    while (counts <= _temp_table[i + 1].counts) {
+        i++;
+    }
+
+    _temp_segment = i;
+
+    /* interpolate within the segment, rounding to the nearest degree */
+    return (int16_t)(_TEMP_MIN_C + (i * _TEMP_STEP_C) +
+                     (int16_t)((((uint32_t)(_temp_table[i].counts - counts) *
+                                 _temp_table[i].slope) + 0x8000U) >> 16));
+}
+
+static void
+_adc_start(void)
+{
+    const _HAL_adc_channel_state_t *const s = &_state[_sequence];
+
+    /* select resolution for this channel; must be done before starting */
+    _conv_mode = s->mode;
+    _synced = false;
+    ADCCFG_MODE = (_conv_mode == HAL_ADC_MODE_10BIT) ? 2 : 1;
+
+    /* software PWM channels aren't aligned with TPM1, so can't be synchronised */
+    if ((s->sync != _HAL_ADC_SYNC_NONE) && (_sync_point != 0) && !_HAL_pwm_is_soft(s->sync)) {
+        const uint16_t on_cycles = _HAL_pwm_cycles(s->sync);
+
+        /* only worth synchronising if the output is switching */
+        if ((on_cycles != 0) && (on_cycles < _HAL_pwm_period_cycles())) {
+            const uint32_t on_us = (uint32_t)on_cycles * _HAL_PWM_QUANTUM_US;
+            uint32_t delay_us = (on_us * _sync_point) >> 8;
+
+            /* let the output settle, but finish sampling before turn-off */
+            if (delay_us < _HAL_ADC_SYNC_SETTLE_US) {
+                delay_us = _HAL_ADC_SYNC_SETTLE_US;
+            }
+
+            if (delay_us > (on_us - _SYNC_SAMPLE_US)) {
+                delay_us = on_us - _SYNC_SAMPLE_US;
+            }
+
+            /* in staggered mode the channel turns on part-way through the period */
+            delay_us += (uint32_t)_HAL_pwm_phase_cycles(s->sync) * _HAL_PWM_QUANTUM_US;
+
+            /* too far into the period for an alarm; fall back to unsynchronised */
+            if (delay_us <= 0x7fffU) {
+                /* wait for the start of the next PWM period */
+                _sync_delay_us = (uint16_t)delay_us;
+                _sync_wait = (uint16_t)_HAL_pwm_period_ms() + (uint16_t)(delay_us >> 10) + 2;
+                _HAL_pwm_overflow_request(_HAL_PWM_OVF_ADC_SYNC);
+                return;
+            }
+        }
+    }
+
+    /* start conversion, no interrupt */
+    ADCSC1 = s->channel;
+}
+
+void
+_HAL_adc_pwm_sync(void)
+{
+    /* PWM period has started, schedule the conversion */
+    if (_sync_wait != 0) {
+        _HAL_timer_alarm_set(&_sync_alarm, _sync_delay_us);
+    }
+}
+
+static void
+_adc_sync_convert(void)
+{
+    if (_sync_wait != 0) {
+        ADCSC1 = _state[_sequence].channel;
+        _synced = true;
+    }
 }
 
 static void
 _adc_tick(void)
 {
-    /* store new sample */
-    _state[_sequence].samples[_bucket] = ADCR;
+    _HAL_adc_channel_state_t *const s = &_state[_sequence];
+    uint16_t sample;
+
+    /* waiting for a synchronised conversion? */
+    if (_sync_wait != 0) {
+        if (!ADCSC1_COCO) {
+            if (--_sync_wait != 0) {
+                return;
+            }
+
+            /* timed out, sample unsynchronised */
+            _HAL_timer_alarm_cancel(&_sync_alarm);
+            ADCSC1 = s->channel;
+            return;
+        }
+
+        _sync_wait = 0;
+    }
+
+    sample = ADCR;
+
+    /* mode changed while converting; discard and start over */
+    if (_conv_mode != s->mode) {
+        _os_count = 0;
+        _os_accum = 0;
+        _adc_start();
+        return;
+    }
+
+    /* accumulate oversampled conversions, then decimate */
+    if (_conv_mode == HAL_ADC_MODE_OVERSAMPLE) {
+        _os_accum += sample;
+
+        if (++_os_count < _HAL_ADC_OVERSAMPLE) {
+            _adc_start();
+            return;
+        }
+
+        sample = _os_accum >> 1;
+        _os_count = 0;
+        _os_accum = 0;
+    }
+
+    /* store new sample and update the running sum */
+    s->accum += sample - s->samples[_bucket];
+    s->samples[_bucket] = sample;
+
+    /* output protection and digital inputs get every sample, in 10-bit counts */
+    switch (s->notify) {
+    case _HAL_ADC_NOTIFY_PROTECT:
+        _HAL_protect_sample(_sequence, sample >> (_mode_shift[_conv_mode] - 12), _synced);
+        break;
+
+    case _HAL_ADC_NOTIFY_INPUT:
+        _HAL_input_sample(_sequence, sample >> (_mode_shift[_conv_mode] - 12));
+        break;
+
+    default:
+        break;
+    }
 
     /* proceed to next channel / bucket */
     if (_state[++_sequence].scale >= _HAL_ADC_SCALE_END) {
+        uint8_t i;
+
+        /* publish the results of this sweep */
+        for (i = 0; i < _sequence; i++) {
+            _state[i].result = _state[i].accum;
+        }
+
+        _sweep++;
+        _sweep_time = _HAL_timer_us_isr();
         _sequence = 0;
 
         if (++_bucket >= _HAL_ADC_AVG_SAMPLES) {
@@ -104,6 +676,5 @@ _adc_tick(void)
         }
     }
 
-    /* start next conversion, no interrupt */
-    ADCSC1 = _state[_sequence].channel;
+    _adc_start();
 }
@@ -1,10 +1,16 @@
 #include <stdbool.h>
 #include <string.h>
 #include <lib.h>
+#include <pt.h>
+#include <HAL/_adc.h>
 #include <HAL/_can.h>
+#include <HAL/_crash.h>
 #include <HAL/_bootrom.h>
 #include <HAL/_eeprom.h>
+#include <HAL/_log.h>
 #include <HAL/_reset.h>
+#include <HAL/_timer.h>
+#include <HAL/_update.h>
 
 #define _ID_MASK            (HAL_CAN_ID_EXT | 0x1ffffff0)  /* XXX TODO fetch from EEPROM */
 #define _SCAN_RSP_ID        (HAL_CAN_ID_EXT | 0x1ffffff0)
@@ -12,10 +18,47 @@
 #define _RESPONSE_ID        (HAL_CAN_ID_EXT | 0x1ffffff2)
 #define _EEPROM_READ_ID     (HAL_CAN_ID_EXT | 0x1ffffff4)
 #define _EEPROM_WRITE_ID    (HAL_CAN_ID_EXT | 0x1ffffff5)
+#define _LOG_READ_ID        (HAL_CAN_ID_EXT | 0x1ffffff6)
+#define _CRASH_READ_ID      (HAL_CAN_ID_EXT | 0x1ffffff7)
+#define _UPDATE_DATA_ID     (HAL_CAN_ID_EXT | 0x1ffffff8)
+
+#define _STREAM_TIMEOUT_MS  1000
+#define _ACTIVATE_TX_US     20000   /* longest wait for the 21 0b response to go */
+
+/*
+ * Scan responses are spread over timer-tick slots (a response takes about
+ * 1.1ms at 125kbps) picked by a hash of the serial number; a response
+ * that finds the bus busy, or collides, moves to a random later slot.
+ */
+#define _SCAN_SLOTS         64
+#define _SCAN_SLOT_MS       1
+#define _SCAN_RETRY_SLOTS   4
 
 static bool     _module_selected = false;
 static bool     _eeprom_write_enable = false;
 
+/* scan response waiting for its slot */
+static bool         _scan_pending;
+static HAL_timer_t  _scan_timer;
+static uint8_t      _scan_data[8];
+static uint16_t     _scan_random;   /* xorshift state, seeded from the serial number */
+static uint8_t      _scan_buffer;   /* transmit buffer of the response being sent */
+
+/* EEPROM stream read in progress */
+static struct {
+    bool        active;
+    bool        start;      /* new request, restart the CRC */
+    uint16_t    offset;
+    uint16_t    remaining;
+    uint8_t     block;      /* messages per 20 07, 0 for no flow control */
+    uint8_t     credit;     /* messages left in this block */
+} _stream;
+
+#ifdef HAL_UPDATE_ENABLE
+/* update staging area being erased, answer 20 08 when done */
+static bool     _update_erasing;
+#endif
+
 typedef struct {
     uint32_t    id;
     uint8_t     len;
@@ -33,16 +76,46 @@ static const _handler_t  _unselected_handlers[] = {
 
 static void     _enter_program(const HAL_can_message_t *msg);
 static void     _read_eeprom(const HAL_can_message_t *msg);
+static void     _read_log(const HAL_can_message_t *msg);
+static void     _read_crash(const HAL_can_message_t *msg);
+static void     _read_stream(const HAL_can_message_t *msg);
+static void     _read_stream_next(const HAL_can_message_t *msg);
 static void     _write_eeprom_enable(const HAL_can_message_t *msg);
 static void     _write_eeprom_disable(const HAL_can_message_t *msg);
 static void     _write_eeprom(const HAL_can_message_t *msg);
+static void     _adc_cal_zero(const HAL_can_message_t *msg);
+static void     _adc_cal_span(const HAL_can_message_t *msg);
+static void     _adc_cal_reset(const HAL_can_message_t *msg);
+static void     _adc_cal_save(const HAL_can_message_t *msg);
+#ifdef HAL_UPDATE_ENABLE
+static void     _update_begin(const HAL_can_message_t *msg);
+static void     _update_data(const HAL_can_message_t *msg);
+static void     _update_finish(const HAL_can_message_t *msg);
+static void     _update_activate(const HAL_can_message_t *msg);
+static void     _update_state(const HAL_can_message_t *msg);
+#endif
 
 static const _handler_t  _selected_handlers[] = {
     { _COMMAND_ID,       2, { 0x20, 0x00},                   _enter_program },
     { _COMMAND_ID,       2, { 0x20, 0x03},                   _read_eeprom },
+    { _COMMAND_ID,       2, { 0x20, 0x04},                   _read_log },
+    { _COMMAND_ID,       2, { 0x20, 0x05},                   _read_crash },
+    { _COMMAND_ID,       2, { 0x20, 0x06},                   _read_stream },
+    { _COMMAND_ID,       2, { 0x20, 0x07},                   _read_stream_next },
     { _COMMAND_ID,       5, { 0x20, 0x11, 0xf3, 0x33, 0xaf}, _write_eeprom_enable },
     { _COMMAND_ID,       2, { 0x20, 0x02},                   _write_eeprom_disable },
-    { _EEPROM_WRITE_ID,  0, { 0 },                           _write_eeprom }
+    { _EEPROM_WRITE_ID,  0, { 0 },                           _write_eeprom },
+    { _COMMAND_ID,       2, { 0x20, 0xc0},                   _adc_cal_zero },
+    { _COMMAND_ID,       2, { 0x20, 0xc1},                   _adc_cal_span },
+    { _COMMAND_ID,       2, { 0x20, 0xc2},                   _adc_cal_reset },
+    { _COMMAND_ID,       2, { 0x20, 0xc3},                   _adc_cal_save },
+#ifdef HAL_UPDATE_ENABLE
+    { _COMMAND_ID,       2, { 0x20, 0x08},                   _update_begin },
+    { _UPDATE_DATA_ID,   0, { 0 },                           _update_data },
+    { _COMMAND_ID,       2, { 0x20, 0x0a},                   _update_finish },
+    { _COMMAND_ID,       2, { 0x20, 0x0b},                   _update_activate },
+    { _COMMAND_ID,       2, { 0x20, 0x0c},                   _update_state },
+#endif
 };
 
 static uint8_t
@@ -123,21 +196,46 @@ MRS_bootrom_rx(const HAL_can_message_t *msg)
     return false;
 }
 
+/* next number from the scan xorshift, which must not be seeded with 0 */
+static uint16_t
+_scan_next_random(void)
+{
+    _scan_random ^= _scan_random << 7;
+    _scan_random ^= _scan_random >> 9;
+    _scan_random ^= _scan_random << 8;
+    return _scan_random;
+}
+
 static void
 _scan(const HAL_can_message_t *msg)
 {
-    uint8_t data[8] = {0};
     uint16_t bl_vers;
     (void)msg;
 
-    /* send the scan response message */
-    MRS_PARAM_READ(SerialNumber, &data[1]);
+    /*
+     * Every module answers a scan, so wait for a slot picked by serial
+     * number rather than all sending at once; _HAL_bootrom_scan sends
+     * the response.
+     */
+    memset(&_scan_data[0], 0, sizeof(_scan_data));
+    MRS_PARAM_READ(SerialNumber, &_scan_data[1]);
     MRS_PARAM_READ(BootloaderVersion, &bl_vers);
-    data[7] = bl_vers & 0xff;                   /* only the low byte */
-    HAL_can_send_blocking(_SCAN_RSP_ID, sizeof(data), &data[0]);
+    _scan_data[7] = bl_vers & 0xff;             /* only the low byte */
+
+    /* all of the serial number picks the slot; serials often share their low bits */
+    _scan_random = ((uint16_t)(_scan_data[1] ^ _scan_data[3]) << 8) | (_scan_data[2] ^ _scan_data[4]);
+
+    if (_scan_random == 0) {
+        _scan_random = 1;
+    }
+
+    HAL_timer_register(_scan_timer);
+    HAL_timer_reset(_scan_timer, (_scan_next_random() % _SCAN_SLOTS) * _SCAN_SLOT_MS);
+    _scan_pending = true;
 
     _module_selected = false;
     _eeprom_write_enable = false;
+    _stream.active = false;
 }
 
 static void
@@ -184,10 +282,198 @@ _read_eeprom(const HAL_can_message_t *msg)
     const uint8_t param_len = msg->data[4];
     uint8_t data[8];
 
+    /* no reply to a bad request, rather than an abort */
+    if ((param_len > sizeof(data)) ||
+        (param_offset >= HAL_EEPROM_SIZE) ||
+        (param_len > (HAL_EEPROM_SIZE - param_offset))) {
+        return;
+    }
+
     HAL_eeprom_read(param_offset, param_len, &data[0]);
     HAL_can_send_blocking(_EEPROM_READ_ID, param_len, &data[0]);
 }
 
+static void
+_read_log(const HAL_can_message_t *msg)
+{
+    uint8_t record[HAL_LOG_RECORD_SIZE];
+    uint8_t data[3] = {0x21, 0x04};
+    uint8_t age = HAL_LOG_RECORDS;
+    (void)msg;
+
+    /* oldest first */
+    while (age-- > 0) {
+        if (_HAL_log_record(age, &record[0])) {
+            HAL_can_send_blocking(_LOG_READ_ID, sizeof(record), &record[0]);
+            data[2]++;
+        }
+    }
+
+    HAL_can_send_blocking(_RESPONSE_ID, sizeof(data), &data[0]);
+}
+
+static void
+_read_crash(const HAL_can_message_t *msg)
+{
+    HAL_crash_t crash;
+    uint8_t data[3] = {0x21, 0x05, 0x0f};   /* default to none */
+    uint8_t offset;
+    (void)msg;
+
+    if (HAL_crash_get(&crash)) {
+        for (offset = 0; offset < sizeof(crash); offset += 8) {
+            const uint8_t len = ((sizeof(crash) - offset) < 8) ? (uint8_t)(sizeof(crash) - offset) : 8;
+
+            HAL_can_send_blocking(_CRASH_READ_ID, len, (const uint8_t *)&crash + offset);
+        }
+
+        data[2] = 0;
+    }
+
+    HAL_can_send_blocking(_RESPONSE_ID, sizeof(data), &data[0]);
+}
+
+static void
+_read_stream(const HAL_can_message_t *msg)
+{
+    const uint16_t offset = *(const uint16_t *)(&msg->data[2]);
+    const uint16_t len = *(const uint16_t *)(&msg->data[4]);
+
+    /* a short request gets the same reply as a bad range */
+    if ((msg->dlc < 6) ||
+        (len == 0) ||
+        (offset >= HAL_EEPROM_SIZE) ||
+        (len > (HAL_EEPROM_SIZE - offset))) {
+        static const uint8_t data[3] = {0x21, 0x06, 0x0f};
+
+        _stream.active = false;
+        HAL_can_send_blocking(_RESPONSE_ID, sizeof(data), &data[0]);
+        return;
+    }
+
+    /* replaces any read in progress; _HAL_bootrom_stream does the work */
+    _stream.offset = offset;
+    _stream.remaining = len;
+    _stream.block = (msg->dlc >= 7) ? msg->data[6] : 0;
+    _stream.credit = _stream.block;
+    _stream.start = true;
+    _stream.active = true;
+}
+
+static void
+_read_stream_next(const HAL_can_message_t *msg)
+{
+    (void)msg;
+
+    _stream.credit = _stream.block;
+}
+
+/*
+ * Send a scan response once its slot comes round. It is sent only onto an
+ * idle bus and only once: a frame that collides with another module's is
+ * aborted rather than retransmitted straight back into the same collision,
+ * and tried again in a random later slot.
+ */
+PT_DEFINE(_HAL_bootrom_scan)
+{
+    pt_begin(pt);
+
+    for (;;) {
+        pt_wait(pt, _scan_pending && HAL_timer_expired(_scan_timer));
+
+        _scan_buffer = 0;
+
+        if (_HAL_can_bus_idle()) {
+            _scan_buffer = _HAL_can_send_once(_SCAN_RSP_ID, sizeof(_scan_data), &_scan_data[0]);
+        }
+
+        if (_scan_buffer != 0) {
+            /* a pass of the main loop is many bit times; it has started by now */
+            pt_yield(pt);
+            _HAL_can_abort(_scan_buffer);
+            pt_wait(pt, _HAL_can_tx_done(_scan_buffer));
+
+            if (!_HAL_can_tx_aborted(_scan_buffer)) {
+                _scan_pending = false;
+                continue;
+            }
+        }
+
+        HAL_timer_reset(_scan_timer, (1 + (_scan_next_random() % _SCAN_RETRY_SLOTS)) * _SCAN_SLOT_MS);
+    }
+
+    pt_end(pt);
+}
+
+/*
+ * Send an EEPROM stream read, one message at a time so that they stay
+ * in order and the main loop keeps running.
+ */
+PT_DEFINE(_HAL_bootrom_stream)
+{
+    static HAL_timer_t  _timeout;
+    static uint8_t      _data[8];
+    static uint8_t      _len;
+    static uint16_t     _crc;
+
+    pt_begin(pt);
+
+    HAL_timer_register(_timeout);
+
+    for (;;) {
+        pt_wait(pt, _stream.active);
+
+        if (_stream.start) {
+            _stream.start = false;
+            _crc = 0xffff;
+        }
+
+        /* wait for the host to ask for the next block */
+        if ((_stream.remaining != 0) && (_stream.block != 0) && (_stream.credit == 0)) {
+            HAL_timer_reset(_timeout, _STREAM_TIMEOUT_MS);
+            pt_wait(pt, (_stream.credit != 0) || _stream.start || HAL_timer_expired(_timeout));
+
+            if ((_stream.credit == 0) && !_stream.start) {
+                _stream.active = false;
+            }
+
+            continue;
+        }
+
+        /* a new request starts again; a scan abandons the read */
+        pt_wait(pt, HAL_can_tx_idle() || _stream.start || !_stream.active);
+
+        if (_stream.start || !_stream.active) {
+            continue;
+        }
+
+        /* send the next message, or the CRC once done */
+        if (_stream.remaining != 0) {
+            _len = (_stream.remaining < sizeof(_data)) ? (uint8_t)_stream.remaining : sizeof(_data);
+            HAL_eeprom_read(_stream.offset, _len, &_data[0]);
+            _crc = crc16(_crc, &_data[0], _len);
+            (void)HAL_can_send(_EEPROM_READ_ID, _len, &_data[0]);
+
+            _stream.offset += _len;
+            _stream.remaining -= _len;
+
+            if (_stream.block != 0) {
+                _stream.credit--;
+            }
+        } else {
+            _data[0] = 0x21;
+            _data[1] = 0x06;
+            _data[2] = 0x00;
+            _data[3] = _crc >> 8;
+            _data[4] = _crc & 0xff;
+            (void)HAL_can_send(_RESPONSE_ID, 5, &_data[0]);
+            _stream.active = false;
+        }
+    }
+
+    pt_end(pt);
+}
+
 static void
 _write_eeprom_enable(const HAL_can_message_t *msg)
 {
@@ -227,20 +513,21 @@ _write_eeprom(const HAL_can_message_t *msg)
             (src[1] >= MRS_CAN_1000KBPS) &&         /* value is within bounds */
             (src[1] <= MRS_CAN_125KBPS)) {
 
-            /* update both copies */
-            _HAL_eeprom_write(MRS_PARAM_OFFSET(BaudrateBootloader2),
-                              MRS_PARAM_SIZE(BaudrateBootloader2),
-                              src);
-            _HAL_eeprom_write(MRS_PARAM_OFFSET(BaudrateBootloader1),
-                              MRS_PARAM_SIZE(BaudrateBootloader1),
-                              src);
+            /* update both copies, the backup first; the queue writes them in order */
+            (void)_HAL_eeprom_write_async(MRS_PARAM_OFFSET(BaudrateBootloader2),
+                                          MRS_PARAM_SIZE(BaudrateBootloader2),
+                                          src);
+            (void)_HAL_eeprom_write_async(MRS_PARAM_OFFSET(BaudrateBootloader1),
+                                          MRS_PARAM_SIZE(BaudrateBootloader1),
+                                          src);
             /* success */
             data[2] = 0;
         }
 
-        /* Normal EEPROM write, cannot overwrite parameters. */
-        else if (address >= 0x200) {
-            HAL_eeprom_write(address, len, data);
+        /* Normal EEPROM write, cannot overwrite parameters; queued, not waited for. */
+        else if ((address >= HAL_EEPROM_APP_START) &&
+                 ((address + len) <= HAL_EEPROM_APP_END)) {
+            (void)HAL_eeprom_write_async(address, len, src);
 
             /* success */
             data[2] = 0;
@@ -249,3 +536,138 @@ _write_eeprom(const HAL_can_message_t *msg)
 
     HAL_can_send_blocking(_RESPONSE_ID, sizeof(data), &data[0]);
 }
+
+static void
+_adc_cal_response(const HAL_can_message_t *msg, bool ok)
+{
+    uint8_t data[4] = {0x21};
+
+    data[1] = msg->data[1];
+    data[2] = msg->data[2];
+    data[3] = ok ? 0x00 : 0x0f;
+    HAL_can_send_blocking(_RESPONSE_ID, sizeof(data), &data[0]);
+}
+
+static void
+_adc_cal_zero(const HAL_can_message_t *msg)
+{
+    _adc_cal_response(msg, (msg->dlc >= 3) && _HAL_adc_cal_zero(msg->data[2]));
+}
+
+static void
+_adc_cal_span(const HAL_can_message_t *msg)
+{
+    const uint16_t reference = *(const uint16_t *)(&msg->data[3]);
+
+    _adc_cal_response(msg, (msg->dlc >= 5) && _HAL_adc_cal_span(msg->data[2], reference));
+}
+
+static void
+_adc_cal_reset(const HAL_can_message_t *msg)
+{
+    _adc_cal_response(msg, (msg->dlc >= 3) && _HAL_adc_cal_reset(msg->data[2]));
+}
+
+static void
+_adc_cal_save(const HAL_can_message_t *msg)
+{
+    /* calibration affects measurements, so require the EEPROM write unlock */
+    _adc_cal_response(msg, _eeprom_write_enable && _HAL_adc_cal_save());
+}
+
+#ifdef HAL_UPDATE_ENABLE
+static void
+_update_response(uint8_t command, uint8_t status)
+{
+    uint8_t data[3] = {0x21};
+
+    data[1] = command;
+    data[2] = status;
+    HAL_can_send_blocking(_RESPONSE_ID, sizeof(data), &data[0]);
+}
+
+static void
+_update_begin(const HAL_can_message_t *msg)
+{
+    const uint16_t length = *(const uint16_t *)(&msg->data[2]);
+    const uint16_t crc = *(const uint16_t *)(&msg->data[4]);
+    const uint16_t resident_crc = *(const uint16_t *)(&msg->data[6]);
+
+    /* replacing the application needs the EEPROM write unlock too */
+    _update_erasing = (msg->dlc >= 8) &&
+                      _eeprom_write_enable &&
+                      _HAL_update_begin(length, crc, resident_crc);
+
+    /* otherwise _HAL_bootrom_update answers once the staging area is erased */
+    if (!_update_erasing) {
+        _update_response(0x08, 0x0f);
+    }
+}
+
+static void
+_update_data(const HAL_can_message_t *msg)
+{
+    const uint16_t offset = *(const uint16_t *)(&msg->data[0]);
+    uint8_t data[5] = {0x21, 0x09};
+
+    data[2] = msg->data[0];
+    data[3] = msg->data[1];
+    data[4] = ((msg->dlc > 2) && _HAL_update_write(offset, msg->dlc - 2, &msg->data[2])) ? 0x00 : 0x0f;
+    HAL_can_send_blocking(_RESPONSE_ID, sizeof(data), &data[0]);
+}
+
+static void
+_update_finish(const HAL_can_message_t *msg)
+{
+    (void)msg;
+
+    _update_response(0x0a, _HAL_update_finish() ? 0x00 : 0x0f);
+}
+
+static void
+_update_activate(const HAL_can_message_t *msg)
+{
+    const bool ok = _eeprom_write_enable && _HAL_update_activate();
+
+    (void)msg;
+
+    _update_response(0x0b, ok ? 0x00 : 0x0f);
+
+    if (ok) {
+        const HAL_microseconds start = HAL_timer_us();
+
+        /* let the response go before the swap, unless the bus won't take it */
+        while (!HAL_can_tx_idle() && !HAL_timer_elapsed_us(start, _ACTIVATE_TX_US)) {
+        }
+
+        HAL_reset();
+    }
+}
+
+static void
+_update_state(const HAL_can_message_t *msg)
+{
+    (void)msg;
+
+    _update_response(0x0c, (uint8_t)HAL_update_state());
+}
+
+/* erase the update staging area a sector per pass, since each erase stops everything for ~20ms */
+PT_DEFINE(_HAL_bootrom_update)
+{
+    pt_begin(pt);
+
+    for (;;) {
+        pt_wait(pt, _update_erasing);
+
+        if (_HAL_update_erase_next()) {
+            _update_erasing = false;
+            _update_response(0x08, _HAL_update_ready() ? 0x00 : 0x0f);
+        }
+
+        pt_yield(pt);
+    }
+
+    pt_end(pt);
+}
+#endif
@@ -7,6 +7,7 @@
 #include <pt.h>
 #include <HAL/_bootrom.h>
 #include <HAL/_can.h>
+#include <HAL/_log.h>
 #include <HAL/_timer.h>
 
 
@@ -37,10 +38,10 @@ typedef enum {
     WM_SENT
 } _wait_mode_t;
 
-static bool _send(uint32_t id,
-                  uint8_t dlc,
-                  const uint8_t *data,
-                  _wait_mode_t wait);
+static uint8_t _send(uint32_t id,
+                     uint8_t dlc,
+                     const uint8_t *data,
+                     _wait_mode_t wait);
 
 void
 HAL_can_configure(uint8_t bitrate,
@@ -102,7 +103,7 @@ bool
 HAL_can_send(uint32_t id, uint8_t dlc, const uint8_t *data)
 {
     /* return false if not possible to send immediately */
-    return _send(id, dlc, data, WM_NONE);
+    return _send(id, dlc, data, WM_NONE) != 0;
 }
 
 void
@@ -123,7 +124,48 @@ HAL_can_send_debug(uint32_t id, uint8_t dlc, const uint8_t *data)
     (void)_send(id, dlc, data, WM_SENT);
 }
 
-static bool
+bool
+HAL_can_tx_idle(void)
+{
+    return CANTFLG == (CANTFLG_TXE0_MASK | CANTFLG_TXE1_MASK | CANTFLG_TXE2_MASK);
+}
+
+bool
+_HAL_can_bus_idle(void)
+{
+    /* RXACT is set while another node's frame is on the bus; ours are in CANTFLG */
+    return !CANCTL0_RXACT && HAL_can_tx_idle();
+}
+
+uint8_t
+_HAL_can_send_once(uint32_t id, uint8_t dlc, const uint8_t *data)
+{
+    return _send(id, dlc, data, WM_NONE);
+}
+
+void
+_HAL_can_abort(uint8_t buffer)
+{
+    /*
+     * Granted if the frame hasn't started, or when it loses arbitration
+     * or meets an error; a frame that goes out cleanly is unaffected.
+     */
+    CANTARQ = buffer;
+}
+
+bool
+_HAL_can_tx_done(uint8_t buffer)
+{
+    return (CANTFLG & buffer) != 0;
+}
+
+bool
+_HAL_can_tx_aborted(uint8_t buffer)
+{
+    return (CANTAAK & buffer) != 0;
+}
+
+static uint8_t
 _send(uint32_t id,
       uint8_t dlc,
       const uint8_t *data,
@@ -141,7 +183,7 @@ _send(uint32_t id,
 
         /* ... or don't */
         if (wait_mode == WM_NONE) {
-            return false;
+            return 0;
         }
     }
 
@@ -183,7 +225,7 @@ _send(uint32_t id,
     while ((wait_mode == WM_SENT) && !(CANTFLG & txe)) {
     }
 
-    return true;
+    return txe;
 }
 
 void
@@ -201,8 +243,8 @@ HAL_can_putchar(char c)
     }
 }
 
-static void
-__interrupt VectorNumber_Vcanrx
+VECTOR_HANDLER void
+__interrupt VECTOR(Vcanrx)
 Vcanrx_handler(void)
 {
     HAL_can_message_t *msg;
@@ -253,6 +295,7 @@ PT_DEFINE(_HAL_can_listen)
 {
     static HAL_timer_t  _idle_timer;
     static bool         _idle_flag = false;
+    static bool         _bus_off_logged = false;
     uint8_t             limit;
 
     pt_begin(pt);
@@ -286,6 +329,12 @@ PT_DEFINE(_HAL_can_listen)
             _can_buf_tail++;
         }
 
+        /* log the first bus-off (TSTAT = 3); a broken bus would repeat it forever */
+        if (!_bus_off_logged && CANRFLG_TSTAT1 && CANRFLG_TSTAT0) {
+            _bus_off_logged = true;
+            HAL_log(HAL_LOG_CAN_BUS_OFF, 0);
+        }
+
         /* if we haven't heard a useful CAN message for a while... */
         if (!_idle_flag && HAL_timer_expired(_idle_timer)) {
             _idle_flag = true;
@@ -0,0 +1,129 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <lib.h>
+#include <HAL/_config.h>
+#include <HAL/_eeprom.h>
+
+#define _SECTOR_SIZE        8
+#define _COMMIT             0x5a
+#define _NONE               0       /* never in the application area */
+
+/* one sector, at the start of each copy */
+typedef struct {
+    uint16_t    sequence;
+    uint8_t     version;
+    uint8_t     size;
+    uint16_t    crc;                /* over the fields above, then the data */
+    uint8_t     _reserved;
+    uint8_t     commit;             /* erased until the copy is complete */
+} _header_t;
+
+#define _CRC_HEADER_LEN     offsetof(_header_t, crc)
+
+static uint16_t
+_config_copy_b(const HAL_config_block_t *block)
+{
+    return block->offset + (HAL_CONFIG_SPACE(block->size) / 2);
+}
+
+/* check a copy, computing the CRC a sector at a time */
+static bool
+_config_valid(const HAL_config_block_t *block, uint16_t offset, _header_t *h)
+{
+    uint8_t buf[_SECTOR_SIZE];
+    uint16_t crc;
+    uint16_t done;
+
+    HAL_eeprom_read(offset, sizeof(*h), (uint8_t *)h);
+
+    if ((h->commit != _COMMIT) ||
+        (h->version != block->version) ||
+        (h->size != block->size)) {
+        return false;
+    }
+
+    crc = crc16(0xffff, (const uint8_t *)h, _CRC_HEADER_LEN);
+
+    for (done = 0; done < block->size; done += _SECTOR_SIZE) {
+        const uint8_t len = ((block->size - done) < _SECTOR_SIZE) ? (uint8_t)(block->size - done) : _SECTOR_SIZE;
+
+        HAL_eeprom_read(offset + _SECTOR_SIZE + done, len, &buf[0]);
+        crc = crc16(crc, &buf[0], len);
+    }
+
+    return crc == h->crc;
+}
+
+/* find the newest valid copy, checking the newer sequence number first */
+static uint16_t
+_config_find(const HAL_config_block_t *block, _header_t *h)
+{
+    uint16_t first = block->offset;
+    uint16_t second = _config_copy_b(block);
+
+    if ((int16_t)(HAL_eeprom_read16(second) - HAL_eeprom_read16(first)) > 0) {
+        first = second;
+        second = block->offset;
+    }
+
+    if (_config_valid(block, first, h)) {
+        return first;
+    }
+
+    if (_config_valid(block, second, h)) {
+        return second;
+    }
+
+    return _NONE;
+}
+
+bool
+HAL_config_load(const HAL_config_block_t *block, void *data)
+{
+    _header_t h;
+    const uint16_t offset = _config_find(block, &h);
+
+    if (offset == _NONE) {
+        return false;
+    }
+
+    HAL_eeprom_read(offset + _SECTOR_SIZE, block->size, (uint8_t *)data);
+    return true;
+}
+
+void
+HAL_config_save(const HAL_config_block_t *block, const void *data)
+{
+    static const uint8_t commit = _COMMIT;
+    _header_t h;
+    const uint16_t current = _config_find(block, &h);
+    uint16_t target;
+
+    REQUIRE((block->offset % _SECTOR_SIZE) == 0);
+
+    /* overwrite the older (or invalid) copy */
+    if (current == _NONE) {
+        target = block->offset;
+        h.sequence = 0;
+    } else {
+        target = (current == block->offset) ? _config_copy_b(block) : block->offset;
+        h.sequence++;
+    }
+
+    h.version = block->version;
+    h.size = block->size;
+    h.crc = crc16(crc16(0xffff, (const uint8_t *)&h, _CRC_HEADER_LEN),
+                  (const uint8_t *)data,
+                  block->size);
+    h._reserved = 0xff;
+    h.commit = 0xff;
+
+    /* header first, so the copy reads as uncommitted while its data is written */
+    (void)HAL_eeprom_write_async(target, sizeof(h), (const uint8_t *)&h);
+    (void)HAL_eeprom_write_async(target + _SECTOR_SIZE, block->size, (const uint8_t *)data);
+    HAL_eeprom_flush();
+
+    /* commit; the marker byte is still erased, so this is a single byte program */
+    HAL_eeprom_write(target + offsetof(_header_t, commit), 1, &commit);
+}
@@ -0,0 +1,101 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <lib.h>
+#include <HAL/_crash.h>
+
+#define _CRASH_MAGIC        0xdead
+#define _CRC_LEN            offsetof(HAL_crash_t, crc)
+
+/* not cleared at startup; see Microplex_7.prm */
+#pragma DATA_SEG HAL_NOINIT
+static HAL_crash_t          _capture;
+#pragma DATA_SEG DEFAULT
+
+/* the crash from before this boot */
+static HAL_crash_t          _report;
+static bool                 _have_report;
+
+static uint16_t
+_crash_crc(const HAL_crash_t *c)
+{
+    return crc16(0xffff, (const uint8_t *)c, _CRC_LEN);
+}
+
+/* called first thing at startup, before anything is traced */
+void
+_HAL_crash_init(void)
+{
+    uint8_t i;
+
+    if ((_capture.magic == _CRASH_MAGIC) && (_capture.crc == _crash_crc(&_capture))) {
+        _report = _capture;
+
+        /* unroll the trace, oldest first */
+        for (i = 0; i < HAL_CRASH_TRACE_DEPTH; i++) {
+            _report.trace[i] = _capture.trace[(_capture.trace_next + i) % HAL_CRASH_TRACE_DEPTH];
+        }
+
+        _report.trace_next = 0;
+        _have_report = true;
+    }
+
+    /* start a fresh trace, and make sure a record can't be reported twice */
+    memset(&_capture, 0, sizeof(_capture));
+}
+
+/* called once CAN is configured */
+void
+_HAL_crash_report(void)
+{
+    if (_have_report) {
+        print("CRASH: %s:%u ret %04x sp %04x",
+              _report.file,
+              _report.line,
+              _report.return_address,
+              _report.stack_pointer);
+    }
+}
+
+/* interrupts are disabled; keep this short and self-contained */
+void
+_HAL_crash_capture(const char *file, uint16_t line, uint16_t return_address, uint16_t stack_pointer)
+{
+    const uint8_t len = (uint8_t)strlen(file);
+
+    if (len > (HAL_CRASH_FILE_LEN - 1)) {
+        file += len - (HAL_CRASH_FILE_LEN - 1);
+    }
+
+    (void)strncpy(&_capture.file[0], file, HAL_CRASH_FILE_LEN);
+    _capture.line = line;
+    _capture.return_address = return_address;
+    _capture.stack_pointer = stack_pointer;
+    _capture.magic = _CRASH_MAGIC;
+    _capture.crc = _crash_crc(&_capture);
+}
+
+void
+HAL_trace(uint8_t event)
+{
+    ENTER_CRITICAL_SECTION;
+
+    /* once captured, the trace is frozen so the CRC stays good */
+    if (_capture.magic != _CRASH_MAGIC) {
+        _capture.trace[_capture.trace_next] = event;
+        _capture.trace_next = (_capture.trace_next + 1) % HAL_CRASH_TRACE_DEPTH;
+    }
+
+    EXIT_CRITICAL_SECTION;
+}
+
+bool
+HAL_crash_get(HAL_crash_t *crash)
+{
+    if (_have_report) {
+        *crash = _report;
+    }
+
+    return _have_report;
+}
@@ -0,0 +1,224 @@
+#include <stddef.h>
+#include <mc9s08dz60.h>
+#include <lib.h>
+#include <HAL/_adc.h>
+#include <HAL/_current.h>
+#include <HAL/_pin.h>
+#include <HAL/_pwm.h>
+#include <HAL/_timer.h>
+
+/* largest error acted on, keeps gain * error within 32 bits */
+#define _ERROR_MAX          8191
+
+/* integral limit, full duty in 16.8 fixed-point */
+#define _INTEGRAL_MAX       ((int32_t)HAL_PWM_DUTY_FULL << 8)
+
+typedef struct {
+    bool        enabled;
+    bool        dither_high;
+    uint8_t     adc_i;
+    uint8_t     period_ms;
+    uint8_t     countdown_ms;
+    uint8_t     dither_ms;
+    uint8_t     dither_countdown_ms;
+    uint16_t    dither_duty;
+    uint16_t    kp;
+    uint16_t    ki;
+    uint16_t    target_mA;
+    uint16_t    sweep;          /* ADC sweep used by the last update */
+    uint16_t    duty;           /* controller output, before dither */
+    int32_t     integral;       /* 16.8 fixed-point duty */
+} _loop_t;
+
+static _loop_t          _loop[_HAL_PWM_CHANNELS];
+static uint8_t          _active;    /* channels with a non-zero target */
+
+static void _current_tick(void);
+
+static HAL_timer_call_t _current_call = { _current_tick };
+
+/* run the PI controller; returns true if the output changed */
+static bool
+_current_update(uint8_t channel)
+{
+    _loop_t *const l = &_loop[channel];
+    const uint16_t sweep = _HAL_adc_sweep();
+    int32_t error;
+    int32_t duty;
+
+    /* nothing new to act on */
+    if (sweep == l->sweep) {
+        return false;
+    }
+
+    l->sweep = sweep;
+
+    /* forced off by protection; hold until released */
+    if (_HAL_pwm_is_inhibited(channel)) {
+        return false;
+    }
+
+    error = (int32_t)l->target_mA - (int32_t)HAL_adc_result(l->adc_i);
+
+    if (error > _ERROR_MAX) {
+        error = _ERROR_MAX;
+    } else if (error < -_ERROR_MAX) {
+        error = -_ERROR_MAX;
+    }
+
+    /* integrate, unless already saturated in the direction of the error */
+    if (!(((l->duty == HAL_PWM_DUTY_FULL) && (error > 0)) ||
+          ((l->duty == 0) && (error < 0)))) {
+        l->integral += error * l->ki;
+
+        if (l->integral > _INTEGRAL_MAX) {
+            l->integral = _INTEGRAL_MAX;
+        } else if (l->integral < 0) {
+            l->integral = 0;
+        }
+    }
+
+    duty = (l->integral + error * l->kp) >> 8;
+
+    if (duty > (int32_t)HAL_PWM_DUTY_FULL) {
+        duty = HAL_PWM_DUTY_FULL;
+    } else if (duty < 0) {
+        duty = 0;
+    }
+
+    if ((uint16_t)duty == l->duty) {
+        return false;
+    }
+
+    l->duty = (uint16_t)duty;
+    return true;
+}
+
+/* write the controller output, plus any dither */
+static void
+_current_write(uint8_t channel)
+{
+    const _loop_t *const l = &_loop[channel];
+    int32_t duty = l->duty;
+
+    if (l->dither_ms != 0) {
+        if (l->dither_high) {
+            duty += l->dither_duty;
+        } else {
+            duty -= l->dither_duty;
+        }
+
+        if (duty > (int32_t)HAL_PWM_DUTY_FULL) {
+            duty = HAL_PWM_DUTY_FULL;
+        } else if (duty < 0) {
+            duty = 0;
+        }
+    }
+
+    HAL_pwm_set_duty16(channel, (uint16_t)duty);
+}
+
+static void
+_current_tick(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < _HAL_PWM_CHANNELS; i++) {
+        if (_active & (1 << i)) {
+            _loop_t *const l = &_loop[i];
+            bool write = false;
+
+            if (--l->countdown_ms == 0) {
+                l->countdown_ms = l->period_ms;
+                write = _current_update(i);
+            }
+
+            if ((l->dither_ms != 0) && (--l->dither_countdown_ms == 0)) {
+                l->dither_countdown_ms = l->dither_ms;
+                l->dither_high = !l->dither_high;
+                write = true;
+            }
+
+            if (write) {
+                _current_write(i);
+            }
+        }
+    }
+
+    /* stop ticking once nothing is being controlled */
+    if (_active == 0) {
+        _current_call.period_ms = 0;
+    }
+}
+
+void
+HAL_pin_set_current_control(const HAL_pin_t *pin, const HAL_current_config_t *config)
+{
+    const uint8_t channel = pin->pwm;
+    _loop_t *const l = &_loop[channel];
+
+    REQUIRE(channel < _HAL_PWM_CHANNELS);
+    REQUIRE(pin->adc_i != _HAL_PIN_AI_NONE);
+    REQUIRE((config == NULL) || (config->period_ms != 0));
+
+    _HAL_timer_call_register(&_current_call);
+
+    ENTER_CRITICAL_SECTION;
+
+    _active &= ~(1 << channel);
+    l->enabled = (config != NULL);
+    l->adc_i = pin->adc_i;
+    l->target_mA = 0;
+    l->duty = 0;
+    l->integral = 0;
+
+    if (config != NULL) {
+        l->kp = config->kp;
+        l->ki = config->ki;
+        l->period_ms = config->period_ms;
+        l->dither_ms = config->dither_ms;
+        l->dither_duty = config->dither_duty;
+    }
+
+    EXIT_CRITICAL_SECTION;
+
+    HAL_pwm_set_duty16(channel, 0);
+}
+
+void
+HAL_pin_set_current_mA(const HAL_pin_t *pin, uint16_t current_mA)
+{
+    const uint8_t channel = pin->pwm;
+    const uint8_t mask = 1 << channel;
+    _loop_t *const l = &_loop[channel];
+
+    REQUIRE(channel < _HAL_PWM_CHANNELS);
+    REQUIRE(l->enabled);
+
+    ENTER_CRITICAL_SECTION;
+
+    l->target_mA = current_mA;
+
+    if (current_mA == 0) {
+        _active &= ~mask;
+        l->duty = 0;
+        l->integral = 0;
+        HAL_pwm_set_duty16(channel, 0);
+
+    } else if (!(_active & mask)) {
+        /* update on the next tick, with whatever measurement is current */
+        _active |= mask;
+        l->countdown_ms = 1;
+        l->dither_countdown_ms = l->dither_ms;
+        l->sweep = _HAL_adc_sweep() - 1;
+
+        /* start ticking */
+        _current_call.period_ms = 1;
+
+        if (_current_call.delay_ms == 0) {
+            _current_call.delay_ms = 1;
+        }
+    }
+
+    EXIT_CRITICAL_SECTION;
+}
@@ -1,19 +1,45 @@
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 #include <mc9s08dz60.h>
 #include <lib.h>
+#include <pt.h>
 #include <HAL/_eeprom.h>
 
 #define _EEPROM_BASE        0x1400U
-#define _EEPROM_SIZE        0x800U
+#define _EEPROM_SIZE        HAL_EEPROM_SIZE
 #define _EEPROM_SECTOR_SIZE 8
 #define _EEPROM_BANK_SIZE   (_EEPROM_SIZE / 2)
-#define _EEPROM_KEEPOUT     0x200U
+
+/*
+ * The selected page of the array, and the address latch of a command
+ * (a write to the array); the host tests put a flash model behind them.
+ */
+#ifndef _EEPROM_PAGE
+# define _EEPROM_PAGE                   ((const uint8_t *)_EEPROM_BASE)
+# define _EEPROM_LATCH(_bofs, _value)   (*(uint8_t *)(_EEPROM_BASE + (_bofs)) = (_value))
+#endif
 
 #define _CMD_BYTE_PROG      0x20
 #define _CMD_SECTOR_ERASE   0x40
 
-const MRS_parameters_t MRS_parameters;
+/* sectors waiting to be written */
+#define _QUEUE_DEPTH        8
+#define _SECTOR_MASK        (uint16_t)~(_EEPROM_SECTOR_SIZE - 1)
+
+typedef struct {
+    uint16_t            sector;     /* offset of the sector */
+    HAL_eeprom_token_t  first;      /* oldest write merged into the image */
+    uint8_t             image[_EEPROM_SECTOR_SIZE];
+} _sector_t;
+
+static _sector_t            _queue[_QUEUE_DEPTH];
+static uint8_t              _queue_head;
+static uint8_t              _queue_count;
+static bool                 _writing;   /* head entry is being programmed */
+static HAL_eeprom_token_t   _token;
+
+uint8_t                     _HAL_mrs_image[_HAL_MRS_IMAGE_SIZE];
 
 static uint16_t
 _eeprom_pagesel(uint16_t offset)
@@ -30,93 +56,287 @@ _eeprom_pagesel(uint16_t offset)
     }
 }
 
-static uint8_t
-_eeprom_write_sector(uint16_t offset, uint8_t len, const uint8_t *data)
+/* wait for any flash command to finish */
+static void
+_eeprom_idle(void)
 {
-    const uint8_t data_offset = (offset % _EEPROM_SECTOR_SIZE);
-    const uint8_t data_max = _EEPROM_SECTOR_SIZE - data_offset;
-    const uint8_t data_len = ((len < data_max) ? len : data_max);
-    const uint16_t sector_offset = _eeprom_pagesel(offset - data_offset);
-    uint8_t buf[_EEPROM_SECTOR_SIZE];
-    uint8_t i;
-    bool need_write = false;
+    while (FSTAT_FCCF == 0) {
+        REQUIRE(FSTAT_FACCERR == 0);
+    }
+}
 
-    REQUIRE(data_offset <= offset);
-    REQUIRE(data_len <= len);
-    REQUIRE(data_len > 0);
+/* launch a command on the byte at offset */
+static void
+_eeprom_command(uint16_t offset, uint8_t value, uint8_t command)
+{
+    const uint16_t bofs = _eeprom_pagesel(offset);
 
-    /* fill buffer from EEPROM */
-    for (i = 0; i < _EEPROM_SECTOR_SIZE; i++) {
-        buf[i] = *(uint8_t *)(_EEPROM_BASE + sector_offset + i);
-    }
+    REQUIRE(FSTAT_FCBEF != 0);
+    REQUIRE(FSTAT_FACCERR == 0);
+
+    ENTER_CRITICAL_SECTION;
+    _EEPROM_LATCH(bofs, value);
+    FCMD = command;
+    FSTAT_FCBEF = 1;
+    EXIT_CRITICAL_SECTION;
+}
+
+/* newest queued copy of a sector, optionally skipping the one being written */
+static _sector_t *
+_eeprom_pending(uint16_t sector, bool skip_writing)
+{
+    uint8_t i = _queue_count;
+
+    while (i-- > 0) {
+        _sector_t *const e = &_queue[(_queue_head + i) % _QUEUE_DEPTH];
 
-    /* compare & overwrite buffer with new data */
-    for (i = 0; i < data_len; i++) {
-        if (buf[data_offset + i] != data[i]) {
-            buf[data_offset + i] = data[i];
-            need_write = true;
+        if ((i == 0) && skip_writing && _writing) {
+            break;
+        }
+
+        if (e->sector == sector) {
+            return e;
         }
     }
 
-    /* don't erase / write unless necessary */
-    if (need_write) {
+    return NULL;
+}
 
-        /* erase operation will take ~20ms, ensure watchdog doesn't get upset */
-        __RESET_WATCHDOG();
+/* select the page holding offset and return its address; sectors never span pages */
+static const uint8_t *
+_eeprom_array(uint16_t offset)
+{
+    const uint16_t bofs = _eeprom_pagesel(offset);
 
-        REQUIRE(FSTAT_FCBEF != 0);
-        REQUIRE(FSTAT_FACCERR == 0);
+    return _EEPROM_PAGE + bofs;
+}
 
-        /* erase sector */
-        ENTER_CRITICAL_SECTION;
-        *(uint8_t *)(_EEPROM_BASE + sector_offset) = 0;
-        FCMD = _CMD_SECTOR_ERASE;
-        FSTAT_FCBEF = 1;
-        EXIT_CRITICAL_SECTION;
+/* read a run within one page a sector at a time, preferring data waiting to be written */
+static void
+_eeprom_read_run(uint16_t offset, uint8_t len, uint8_t *data)
+{
+    const uint8_t *page = NULL;
 
-        /* wait for operation to complete */
-        while (FSTAT_FCCF == 0) {
-            REQUIRE(FSTAT_FACCERR == 0);
+    while (len > 0) {
+        const _sector_t *const e = _eeprom_pending(offset & _SECTOR_MASK, false);
+        uint8_t n = _EEPROM_SECTOR_SIZE - (offset % _EEPROM_SECTOR_SIZE);
+
+        if (n > len) {
+            n = len;
         }
 
-        /* rewrite sector contents */
-        for (i = 0; i < _EEPROM_SECTOR_SIZE; i++) {
-            REQUIRE(FSTAT_FCBEF != 0);
-            REQUIRE(FSTAT_FACCERR == 0);
-            ENTER_CRITICAL_SECTION;
-            *(uint8_t *)(_EEPROM_BASE + sector_offset + i) = buf[i];
-            FCMD = _CMD_BYTE_PROG;
-            FSTAT_FCBEF = 1;
-            EXIT_CRITICAL_SECTION;
-
-            /* wait for operation to complete */
-            while (FSTAT_FCCF == 0) {
-                REQUIRE(FSTAT_FACCERR == 0);
+        if (e != NULL) {
+            memcpy(data, &e->image[offset % _EEPROM_SECTOR_SIZE], n);
+        } else {
+            /* the array can't be read, nor the page changed, while a command is running */
+            _eeprom_idle();
+
+            if (page == NULL) {
+                page = _eeprom_array(offset) - (offset % _EEPROM_BANK_SIZE);
             }
+
+            memcpy(data, &page[offset % _EEPROM_BANK_SIZE], n);
         }
+
+        offset += n;
+        data += n;
+        len -= n;
+    }
+}
+
+/* run the write-behind engine until a token has completed */
+static void
+_eeprom_wait(HAL_eeprom_token_t token)
+{
+    while (!HAL_eeprom_write_done(token)) {
+        __RESET_WATCHDOG();
+        PT_RUN(_HAL_eeprom_service);
+    }
+}
+
+/* find or queue the sector image that a write should go to */
+static _sector_t *
+_eeprom_queue_sector(uint16_t sector, HAL_eeprom_token_t token)
+{
+    _sector_t *e = _eeprom_pending(sector, true);
+
+    if (e != NULL) {
+        return e;
+    }
+
+    /* queue full, wait for the oldest entry */
+    if (_queue_count == _QUEUE_DEPTH) {
+        _eeprom_wait(_queue[_queue_head].first);
     }
 
-    return data_len;
+    e = &_queue[(_queue_head + _queue_count) % _QUEUE_DEPTH];
+
+    /* start from the current contents, including any copy being written */
+    HAL_eeprom_read(sector, _EEPROM_SECTOR_SIZE, &e->image[0]);
+
+    e->sector = sector;
+    e->first = token;
+    _queue_count++;
+
+    return e;
 }
 
 void
-_HAL_eeprom_write(uint16_t offset, uint8_t len, const uint8_t *data)
+_HAL_eeprom_init(void)
+{
+    /* nothing is queued yet, so this reads the array */
+    HAL_eeprom_read(0, sizeof(_HAL_mrs_image), &_HAL_mrs_image[0]);
+}
+
+/* copy any part of a write that falls on the MRS parameters to their image */
+static void
+_eeprom_shadow(uint16_t offset, uint8_t len, const uint8_t *data)
 {
+    uint16_t end = offset + len;
+
+    if (offset >= _HAL_MRS_IMAGE_SIZE) {
+        return;
+    }
+
+    if (end > _HAL_MRS_IMAGE_SIZE) {
+        end = _HAL_MRS_IMAGE_SIZE;
+    }
+
+    ENTER_CRITICAL_SECTION;
+    memcpy(&_HAL_mrs_image[offset], data, end - offset);
+    EXIT_CRITICAL_SECTION;
+}
+
+HAL_eeprom_token_t
+_HAL_eeprom_write_async(uint16_t offset, uint8_t len, const uint8_t *data)
+{
+    const HAL_eeprom_token_t token = ++_token;
+
     /*
      * Even though this is the 'private' interface, refuse to overwrite
      * any of the immutable or bootloader-owned parameters.
      */
     REQUIRE(offset >= MRS_PARAM_OFFSET(BaudrateBootloader1));
+    REQUIRE((offset + len) <= _EEPROM_SIZE);
+
+    _eeprom_shadow(offset, len, data);
+
+    /* a sector at a time, merging into any image already queued */
+    while (len > 0) {
+        _sector_t *const e = _eeprom_queue_sector(offset & _SECTOR_MASK, token);
+        uint8_t n = _EEPROM_SECTOR_SIZE - (offset % _EEPROM_SECTOR_SIZE);
+
+        if (n > len) {
+            n = len;
+        }
+
+        memcpy(&e->image[offset % _EEPROM_SECTOR_SIZE], data, n);
+        offset += n;
+        data += n;
+        len -= n;
+    }
+
+    return token;
+}
+
+void
+_HAL_eeprom_write(uint16_t offset, uint8_t len, const uint8_t *data)
+{
+    _eeprom_wait(_HAL_eeprom_write_async(offset, len, data));
+}
+
+bool
+HAL_eeprom_write_done(HAL_eeprom_token_t token)
+{
+    uint8_t i;
+
+    /* done once nothing queued contains data from this write or earlier */
+    for (i = 0; i < _queue_count; i++) {
+        if ((int16_t)(_queue[(_queue_head + i) % _QUEUE_DEPTH].first - token) <= 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void
+HAL_eeprom_flush(void)
+{
+    _eeprom_wait(_token);
+}
 
-    /* Write sector-at-a-time. */
-    while (len) {
-        uint8_t count = _eeprom_write_sector(offset, len, data);
-        len -= count;
-        data += count;
+/*
+ * Write-behind engine; programs one queued sector at a time, yielding
+ * while each flash command runs.
+ */
+PT_DEFINE(_HAL_eeprom_service)
+{
+    static _sector_t    *e;
+    static const uint8_t *_array;
+    static uint8_t      i;
+    static uint8_t      _program;   /* bytes to program */
+    static bool         _erase;
+
+    pt_begin(pt);
+
+    for (;;) {
+        pt_wait(pt, _queue_count != 0);
+
+        e = &_queue[_queue_head];
+        _writing = true;
+
+        /*
+         * Bytes can be programmed once between erases; if every byte
+         * that changes is still erased, just program those (e.g. an
+         * append to a log), otherwise erase and rewrite the sector.
+         */
+        _erase = false;
+        _program = 0;
+        _array = _eeprom_array(e->sector);
+
+        for (i = 0; i < _EEPROM_SECTOR_SIZE; i++) {
+            const uint8_t current = _array[i];
+
+            if (current != e->image[i]) {
+                _program |= (uint8_t)(1 << i);
+
+                if (current != 0xff) {
+                    _erase = true;
+                }
+            }
+        }
+
+        if (_erase) {
+            /* erase sector, ~20ms */
+            _eeprom_command(e->sector, 0, _CMD_SECTOR_ERASE);
+            pt_wait(pt, FSTAT_FCCF != 0);
+            REQUIRE(FSTAT_FACCERR == 0);
+
+            /* everything that isn't left erased needs programming */
+            _program = 0;
+
+            for (i = 0; i < _EEPROM_SECTOR_SIZE; i++) {
+                if (e->image[i] != 0xff) {
+                    _program |= (uint8_t)(1 << i);
+                }
+            }
+        }
+
+        for (i = 0; i < _EEPROM_SECTOR_SIZE; i++) {
+            if (_program & (1 << i)) {
+                _eeprom_command(e->sector + i, e->image[i], _CMD_BYTE_PROG);
+                pt_wait(pt, FSTAT_FCCF != 0);
+                REQUIRE(FSTAT_FACCERR == 0);
+            }
+        }
+
+        _writing = false;
+        _queue_head = (_queue_head + 1) % _QUEUE_DEPTH;
+        _queue_count--;
     }
 
-    /* Leave page 0 selected so that direct parameter access works. */
-    (void)_eeprom_pagesel(0);
+    pt_end(pt);
 }
 
 void
@@ -141,8 +361,15 @@ _HAL_eeprom_write_str(uint16_t offset, uint8_t len, const char *str)
 void
 HAL_eeprom_write(uint16_t offset, uint8_t len, const uint8_t *data)
 {
-    REQUIRE(offset > _EEPROM_KEEPOUT);
-    _HAL_eeprom_write(offset, len, data);
+    _eeprom_wait(HAL_eeprom_write_async(offset, len, data));
+}
+
+HAL_eeprom_token_t
+HAL_eeprom_write_async(uint16_t offset, uint8_t len, const uint8_t *data)
+{
+    REQUIRE(offset >= HAL_EEPROM_APP_START);
+    REQUIRE((offset + len) <= HAL_EEPROM_APP_END);
+    return _HAL_eeprom_write_async(offset, len, data);
 }
 
 void
@@ -166,13 +393,19 @@ HAL_eeprom_write32(uint16_t offset, uint32_t data)
 void
 HAL_eeprom_read(uint16_t offset, uint8_t len, uint8_t *data)
 {
-    while (len--) {
-        uint16_t bofs = _eeprom_pagesel(offset++);
-        *data++ = *(uint8_t *)(_EEPROM_BASE + bofs);
+    REQUIRE((offset + len) <= _EEPROM_SIZE);
+
+    /* at most two runs, one per page */
+    if ((offset < _EEPROM_BANK_SIZE) && ((offset + len) > _EEPROM_BANK_SIZE)) {
+        const uint8_t n = (uint8_t)(_EEPROM_BANK_SIZE - offset);
+
+        _eeprom_read_run(offset, n, data);
+        offset += n;
+        data += n;
+        len -= n;
     }
 
-    /* Leave page 0 selected so that direct parameter access works. */
-    (void)_eeprom_pagesel(0);
+    _eeprom_read_run(offset, len, data);
 }
 
 uint8_t
@@ -0,0 +1,247 @@
+#include <stddef.h>
+#include <mc9s08dz60.h>
+#include <lib.h>
+#include <HAL/_freq.h>
+#include <HAL/_pwm.h>
+#include <HAL/_timer.h>
+
+static bool             _enabled;
+static uint16_t         _window_ms;
+static uint16_t         _timeout_ms;
+static uint16_t         _burst;
+static uint16_t         _countdown_ms;
+static uint16_t         _idle_ms;
+
+/* accumulated by the edge interrupt */
+static bool             _level;         /* pin level after the last edge */
+static bool             _have_rise;     /* _last_rise is valid */
+static bool             _gated;         /* capture off until the next window */
+static uint16_t         _edges;         /* interrupts taken this window, when gating */
+static HAL_microseconds _last_rise;
+static uint32_t         _period_sum;
+static uint16_t         _periods;
+static uint32_t         _high_sum;
+static uint16_t         _highs;
+static uint32_t         _count;
+
+/* published at the end of each window */
+static uint32_t         _period_us;
+static uint16_t         _duty;
+
+static void _freq_tick(void);
+
+static HAL_timer_call_t _freq_call = { _freq_tick };
+
+void
+_HAL_freq_edge(uint16_t capture)
+{
+    const HAL_microseconds now = _HAL_timer_us_isr();
+    const uint16_t counter = TPM1CNT;
+    const bool level = PTDD_PTDD2;
+    uint16_t elapsed = counter - capture;
+    HAL_microseconds t;
+
+    /* the counter runs 0..MOD inclusive */
+    if (counter < capture) {
+        elapsed += _HAL_pwm_period_cycles() + 1;
+    }
+
+    t = now - (HAL_microseconds)elapsed * _HAL_PWM_QUANTUM_US;
+
+    _idle_ms = 0;
+
+    /*
+     * Gate on interrupts taken rather than periods measured: when edges
+     * are being missed no period completes, and the load is at its worst.
+     */
+    if ((_burst != 0) && ((++_edges / 2) >= _burst)) {
+        _gated = true;
+        _HAL_pwm_capture_enable(false);
+    }
+
+    if (level == _level) {
+        /* missed an edge, start again from the next rising edge */
+        _have_rise = false;
+        return;
+    }
+
+    _level = level;
+
+    if (level) {
+        _count++;
+
+        if (_have_rise) {
+            _period_sum += t - _last_rise;
+            _periods++;
+        }
+
+        _last_rise = t;
+        _have_rise = true;
+
+    } else if (_have_rise) {
+        _high_sum += t - _last_rise;
+        _highs++;
+    }
+}
+
+/* publish the window's averages; called with interrupts disabled */
+static void
+_freq_publish(void)
+{
+    uint32_t period = _period_sum / _periods;
+    uint32_t high;
+
+    _period_us = period;
+
+    if (_highs != 0) {
+        high = _high_sum / _highs;
+
+        /* keep (high << 16) within 32 bits for slow signals */
+        while (period > 0xffff) {
+            period >>= 1;
+            high >>= 1;
+        }
+
+        if (period == 0) {
+            /* ignore */
+        } else if (high >= period) {
+            _duty = 0xffff;
+        } else {
+            _duty = (uint16_t)((high << 16) / period);
+        }
+    }
+
+    _period_sum = 0;
+    _periods = 0;
+    _high_sum = 0;
+    _highs = 0;
+}
+
+static void
+_freq_tick(void)
+{
+    if (!_enabled) {
+        return;
+    }
+
+    if (!_gated && (_idle_ms < 0xffff)) {
+        _idle_ms++;
+    }
+
+    if (--_countdown_ms != 0) {
+        return;
+    }
+
+    _countdown_ms = _window_ms;
+
+    if (_periods != 0) {
+        _freq_publish();
+
+        /* estimate the pulses missed while capture was off */
+        if (_gated && _have_rise && (_period_us != 0)) {
+            _count += (_HAL_timer_us_isr() - _last_rise) / _period_us;
+        }
+
+    } else if (_idle_ms >= _timeout_ms) {
+        /* no edges; a slow signal's partial period carries over otherwise */
+        _period_us = 0;
+        _duty = PTDD_PTDD2 ? 0xffff : 0;
+        _have_rise = false;
+        _high_sum = 0;
+        _highs = 0;
+    }
+
+    _edges = 0;
+
+    if (_gated) {
+        _gated = false;
+        _have_rise = false;
+        _HAL_pwm_capture_enable(true);
+    }
+}
+
+void
+HAL_freq_configure(const HAL_freq_config_t *config)
+{
+    REQUIRE((config == NULL) || (config->window_ms != 0));
+
+    _HAL_timer_call_register(&_freq_call);
+
+    ENTER_CRITICAL_SECTION;
+
+    _enabled = (config != NULL);
+    _HAL_pwm_set_capture(false);
+
+    _level = PTDD_PTDD2;
+    _have_rise = false;
+    _gated = false;
+    _edges = 0;
+    _period_sum = 0;
+    _periods = 0;
+    _high_sum = 0;
+    _highs = 0;
+    _count = 0;
+    _period_us = 0;
+    _duty = _level ? 0xffff : 0;
+    _idle_ms = 0;
+
+    if (_enabled) {
+        _window_ms = config->window_ms;
+        _timeout_ms = config->timeout_ms;
+        _burst = config->burst;
+        _countdown_ms = _window_ms;
+
+        _HAL_pwm_set_capture(true);
+        _freq_call.delay_ms = 1;
+        _freq_call.period_ms = 1;
+
+    } else {
+        _freq_call.period_ms = 0;
+    }
+
+    EXIT_CRITICAL_SECTION;
+}
+
+uint32_t
+HAL_freq_period_us(void)
+{
+    uint32_t period;
+
+    ENTER_CRITICAL_SECTION;
+    period = _period_us;
+    EXIT_CRITICAL_SECTION;
+
+    return period;
+}
+
+uint32_t
+HAL_freq_mHz(void)
+{
+    const uint32_t period = HAL_freq_period_us();
+
+    return (period != 0) ? (1000000000UL / period) : 0;
+}
+
+uint16_t
+HAL_freq_duty16(void)
+{
+    uint16_t duty;
+
+    ENTER_CRITICAL_SECTION;
+    duty = _duty;
+    EXIT_CRITICAL_SECTION;
+
+    return duty;
+}
+
+uint32_t
+HAL_freq_count(void)
+{
+    uint32_t count;
+
+    ENTER_CRITICAL_SECTION;
+    count = _count;
+    EXIT_CRITICAL_SECTION;
+
+    return count;
+}
@@ -3,7 +3,10 @@
 #include <HAL/_adc.h>
 #include <HAL/_bootrom.h>
 #include <HAL/_can.h>
+#include <HAL/_crash.h>
+#include <HAL/_eeprom.h>
 #include <HAL/_init.h>
+#include <HAL/_log.h>
 #include <HAL/_pwm.h>
 #include <HAL/_timer.h>
 
@@ -16,21 +19,24 @@ static const HAL_can_filters_t _HAL_default_filters = {
 };
 
 static _HAL_adc_channel_state_t _HAL_7H_adc_state[] = {
-    /* AI_CS_1 */ { 10, _HAL_ADC_SCALE_DO_I, 0, {0} },
-    /* AI_CS_2 */ { 2,  _HAL_ADC_SCALE_DO_I, 0, {0} },
-    /* AI_CS_3 */ { 11, _HAL_ADC_SCALE_DO_I, 0, {0} },
-    /* AI_CS_4 */ { 12, _HAL_ADC_SCALE_DO_I, 0, {0} },
-    /* AI_CS_5 */ { 0,  _HAL_ADC_SCALE_DO_I, 0, {0} },
-    /* AI_CS_6 */ { 1,  _HAL_ADC_SCALE_DO_I, 0, {0} },
-    /* AI_CS_7 */ { 8,  _HAL_ADC_SCALE_DO_I, 0, {0} },
-    /* AI_KL15 */ { 14, _HAL_ADC_SCALE_KL15, 0, {0} },
-    /* AI_TEMP */ { 26, _HAL_ADC_SCALE_TEMP, 0, {0} },
-    /* END     */ { 0,  _HAL_ADC_SCALE_END,  0, {0} },
+    /* AI_CS_1 */ { 10, _HAL_ADC_SCALE_DO_I,  2 },
+    /* AI_CS_2 */ { 2,  _HAL_ADC_SCALE_DO_I,  5 },
+    /* AI_CS_3 */ { 11, _HAL_ADC_SCALE_DO_I,  3 },
+    /* AI_CS_4 */ { 12, _HAL_ADC_SCALE_DO_I,  4 },
+    /* AI_CS_5 */ { 0,  _HAL_ADC_SCALE_DO_I,  0 },
+    /* AI_CS_6 */ { 1,  _HAL_ADC_SCALE_DO_I,  1 },
+    /* AI_CS_7 */ { 8,  _HAL_ADC_SCALE_DO_I,  _HAL_ADC_SYNC_NONE },
+    /* AI_KL15 */ { 14, _HAL_ADC_SCALE_KL15,  _HAL_ADC_SYNC_NONE },
+    /* AI_TEMP */ { 26, _HAL_ADC_SCALE_TEMP,  _HAL_ADC_SYNC_NONE },
+    /* END     */ { 0,  _HAL_ADC_SCALE_END,   _HAL_ADC_SYNC_NONE },
 };
 
 void
 _HAL_7H_init(void)
 {
+    /* before anything can overwrite the previous crash */
+    _HAL_crash_init();
+
     _PTAD.Byte = 0x00;
     _PTADD.Byte = 0x28;
     _PTASE.Byte = 0xff;
@@ -67,7 +73,10 @@ _HAL_7H_init(void)
     _PTFPE.Byte = 0x00;
     _PTFDS.Byte = 0x00;
 
+    _HAL_eeprom_init();
+    _HAL_log_init();
     HAL_can_configure(MRS_can_bitrate(), HAL_CAN_FM_2x32, &_HAL_default_filters);
+    _HAL_crash_report();
     _HAL_adc_init(_HAL_7H_adc_state);
     _HAL_pwm_init();
     _HAL_timer_init();
@@ -76,14 +85,17 @@ _HAL_7H_init(void)
 }
 
 static _HAL_adc_channel_state_t _HAL_7L_adc_state[] = {
-    /* AI_KL15 */ { 14, _HAL_ADC_SCALE_KL15, 0, {0} },
-    /* AI_TEMP */ { 26, _HAL_ADC_SCALE_TEMP, 0, {0} },
-    /* END     */ { 0,  _HAL_ADC_SCALE_END,  0, {0} },
+    /* AI_KL15 */ { 14, _HAL_ADC_SCALE_KL15,  _HAL_ADC_SYNC_NONE },
+    /* AI_TEMP */ { 26, _HAL_ADC_SCALE_TEMP,  _HAL_ADC_SYNC_NONE },
+    /* END     */ { 0,  _HAL_ADC_SCALE_END,   _HAL_ADC_SYNC_NONE },
 };
 
 void
 _HAL_7L_init(void)
 {
+    /* before anything can overwrite the previous crash */
+    _HAL_crash_init();
+
     _PTAD.Byte = 0x00;
     _PTADD.Byte = 0x00;
     _PTASE.Byte = 0xff;
@@ -120,7 +132,10 @@ _HAL_7L_init(void)
     _PTFPE.Byte = 0x00;
     _PTFDS.Byte = 0x00;
 
+    _HAL_eeprom_init();
+    _HAL_log_init();
     HAL_can_configure(MRS_can_bitrate(), HAL_CAN_FM_2x32, &_HAL_default_filters);
+    _HAL_crash_report();
     _HAL_adc_init(_HAL_7L_adc_state);
     _HAL_pwm_init();
     _HAL_timer_init();
@@ -129,24 +144,27 @@ _HAL_7L_init(void)
 }
 
 static _HAL_adc_channel_state_t _HAL_7X_adc_state[] = {
-    /* AI_CS_1 */ { 10, _HAL_ADC_SCALE_DO_I, 0, {0} },
-    /* AI_CS_2 */ { 2,  _HAL_ADC_SCALE_DO_I, 0, {0} },
-    /* AI_CS_3 */ { 11, _HAL_ADC_SCALE_DO_I, 0, {0} },
-    /* AI_CS_4 */ { 12, _HAL_ADC_SCALE_DO_I, 0, {0} },
-    /* AI_OP_1 */ { 0,  _HAL_ADC_SCALE_DO_V, 0, {0} },
-    /* AI_OP_2 */ { 1,  _HAL_ADC_SCALE_DO_V, 0, {0} },
-    /* AI_OP_3 */ { 8,  _HAL_ADC_SCALE_DO_V, 0, {0} },
-    /* AI_OP_4 */ { 9,  _HAL_ADC_SCALE_DO_V, 0, {0} },
-    /* AI_1    */ { 13, _HAL_ADC_SCALE_30V,  0, {0} },
-    /* AI_2    */ { 6,  _HAL_ADC_SCALE_30V,  0, {0} },
-    /* AI_3    */ { 7,  _HAL_ADC_SCALE_30V,  0, {0} },
-    /* AI_KL15 */ { 14, _HAL_ADC_SCALE_KL15, 0, {0} },
-    /* AI_TEMP */ { 26, _HAL_ADC_SCALE_TEMP, 0, {0} },
-    /* END     */ { 0,  _HAL_ADC_SCALE_END,  0, {0} },
+    /* AI_CS_1 */ { 10, _HAL_ADC_SCALE_DO_I,  2 },
+    /* AI_CS_2 */ { 2,  _HAL_ADC_SCALE_DO_I,  5 },
+    /* AI_CS_3 */ { 11, _HAL_ADC_SCALE_DO_I,  3 },
+    /* AI_CS_4 */ { 12, _HAL_ADC_SCALE_DO_I,  4 },
+    /* AI_OP_1 */ { 0,  _HAL_ADC_SCALE_DO_V,  _HAL_ADC_SYNC_NONE },
+    /* AI_OP_2 */ { 1,  _HAL_ADC_SCALE_DO_V,  _HAL_ADC_SYNC_NONE },
+    /* AI_OP_3 */ { 8,  _HAL_ADC_SCALE_DO_V,  _HAL_ADC_SYNC_NONE },
+    /* AI_OP_4 */ { 9,  _HAL_ADC_SCALE_DO_V,  _HAL_ADC_SYNC_NONE },
+    /* AI_1    */ { 13, _HAL_ADC_SCALE_30V,   _HAL_ADC_SYNC_NONE },
+    /* AI_2    */ { 6,  _HAL_ADC_SCALE_30V,   _HAL_ADC_SYNC_NONE },
+    /* AI_3    */ { 7,  _HAL_ADC_SCALE_30V,   _HAL_ADC_SYNC_NONE },
+    /* AI_KL15 */ { 14, _HAL_ADC_SCALE_KL15,  _HAL_ADC_SYNC_NONE },
+    /* AI_TEMP */ { 26, _HAL_ADC_SCALE_TEMP,  _HAL_ADC_SYNC_NONE },
+    /* END     */ { 0,  _HAL_ADC_SCALE_END,   _HAL_ADC_SYNC_NONE },
 };
 void
 _HAL_7X_init(void)
 {
+    /* before anything can overwrite the previous crash */
+    _HAL_crash_init();
+
     _PTAD.Byte = 0x00;
     _PTADD.Byte = 0x38;
     _PTASE.Byte = 0xff;
@@ -183,7 +201,10 @@ _HAL_7X_init(void)
     _PTFPE.Byte = 0x00;
     _PTFDS.Byte = 0x00;
 
+    _HAL_eeprom_init();
+    _HAL_log_init();
     HAL_can_configure(MRS_can_bitrate(), HAL_CAN_FM_2x32, &_HAL_default_filters);
+    _HAL_crash_report();
     _HAL_adc_init(_HAL_7X_adc_state);
     _HAL_pwm_init();
     _HAL_timer_init();
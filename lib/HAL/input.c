@@ -0,0 +1,198 @@
+#include <stddef.h>
+#include <mc9s08dz60.h>
+#include <lib.h>
+#include <HAL/_adc.h>
+#include <HAL/_input.h>
+#include <HAL/_pin.h>
+#include <HAL/_timer.h>
+
+/* HAL_pin_t ADC indices are 4 bits */
+#define _ADC_INDICES        16
+#define _SLOT_NONE          0xff
+
+typedef struct {
+    const HAL_pin_t     *pin;       /* NULL if the slot is free */
+    bool                level;      /* debounced level */
+    bool                changing;   /* samples have read the other level since... */
+    HAL_microseconds    since;      /* ...this time */
+    uint32_t            debounce_us;
+    uint16_t            high;       /* thresholds in 10-bit sample counts */
+    uint16_t            low;
+} _input_t;
+
+static _input_t             _input[HAL_INPUT_MAX];
+static uint8_t              _adc_slot[_ADC_INDICES] = {
+    _SLOT_NONE, _SLOT_NONE, _SLOT_NONE, _SLOT_NONE,
+    _SLOT_NONE, _SLOT_NONE, _SLOT_NONE, _SLOT_NONE,
+    _SLOT_NONE, _SLOT_NONE, _SLOT_NONE, _SLOT_NONE,
+    _SLOT_NONE, _SLOT_NONE, _SLOT_NONE, _SLOT_NONE,
+};
+
+static HAL_input_callback_t _callback;
+static HAL_input_event_t    _queue[HAL_INPUT_QUEUE_DEPTH];
+static uint8_t              _queue_head;
+static uint8_t              _queue_count;
+
+/* deliver an event; called with interrupts disabled */
+static void
+_input_event(const _input_t *in, HAL_microseconds now)
+{
+    HAL_input_event_t *e;
+
+    if (_callback != NULL) {
+        HAL_input_event_t event;
+
+        event.pin = in->pin;
+        event.level = in->level;
+        event.time_us = now;
+        _callback(&event);
+        return;
+    }
+
+    /* full; drop the oldest */
+    if (_queue_count == HAL_INPUT_QUEUE_DEPTH) {
+        _queue_head = (_queue_head + 1) % HAL_INPUT_QUEUE_DEPTH;
+        _queue_count--;
+    }
+
+    e = &_queue[(_queue_head + _queue_count) % HAL_INPUT_QUEUE_DEPTH];
+    e->pin = in->pin;
+    e->level = in->level;
+    e->time_us = now;
+    _queue_count++;
+}
+
+void
+_HAL_input_sample(uint8_t index, uint16_t counts)
+{
+    const uint8_t slot = _adc_slot[index];
+    _input_t *in;
+    HAL_microseconds now;
+    bool level;
+
+    if (slot == _SLOT_NONE) {
+        return;
+    }
+
+    in = &_input[slot];
+
+    /* between the thresholds, the input stays where it was */
+    if (counts >= in->high) {
+        level = true;
+    } else if (counts <= in->low) {
+        level = false;
+    } else {
+        level = in->level;
+    }
+
+    if (level == in->level) {
+        in->changing = false;
+        return;
+    }
+
+    now = _HAL_timer_us_isr();
+
+    if (!in->changing) {
+        in->changing = true;
+        in->since = now;
+    }
+
+    if ((now - in->since) >= in->debounce_us) {
+        in->level = level;
+        in->changing = false;
+        _input_event(in, now);
+    }
+}
+
+void
+HAL_pin_set_input(const HAL_pin_t *pin, const HAL_input_config_t *config)
+{
+    const uint8_t index = pin->adc_v;
+    uint8_t slot = _adc_slot[index];
+    uint16_t high = 0;
+    uint16_t low = 0;
+    bool level = false;
+
+    REQUIRE(index != _HAL_PIN_AI_NONE);
+
+    if (config != NULL) {
+        REQUIRE(config->low_mV <= config->high_mV);
+
+        HAL_pin_set_pullup(pin, config->pullup);
+
+        /* thresholds are converted outside the critical section; they divide */
+        high = _HAL_adc_sample_threshold(index, config->high_mV);
+        low = _HAL_adc_sample_threshold(index, config->low_mV);
+        level = (HAL_pin_get_mV(pin) >= config->high_mV);
+
+        /* find a free slot */
+        if (slot == _SLOT_NONE) {
+            for (slot = 0; slot < HAL_INPUT_MAX; slot++) {
+                if (_input[slot].pin == NULL) {
+                    break;
+                }
+            }
+
+            REQUIRE(slot < HAL_INPUT_MAX);
+        }
+    }
+
+    ENTER_CRITICAL_SECTION;
+
+    if (config != NULL) {
+        _input_t *const in = &_input[slot];
+
+        in->pin = pin;
+        in->level = level;
+        in->changing = false;
+        in->debounce_us = (uint32_t)config->debounce_ms * 1000;
+        in->high = high;
+        in->low = low;
+        _adc_slot[index] = slot;
+        _HAL_adc_set_notify(index, _HAL_ADC_NOTIFY_INPUT);
+
+    } else if (slot != _SLOT_NONE) {
+        _HAL_adc_clear_notify(index, _HAL_ADC_NOTIFY_INPUT);
+        _input[slot].pin = NULL;
+        _adc_slot[index] = _SLOT_NONE;
+    }
+
+    EXIT_CRITICAL_SECTION;
+}
+
+bool
+HAL_pin_get_input(const HAL_pin_t *pin)
+{
+    const uint8_t slot = _adc_slot[pin->adc_v];
+
+    REQUIRE(slot != _SLOT_NONE);
+
+    return _input[slot].level;
+}
+
+void
+HAL_input_set_callback(HAL_input_callback_t callback)
+{
+    ENTER_CRITICAL_SECTION;
+    _callback = callback;
+    EXIT_CRITICAL_SECTION;
+}
+
+bool
+HAL_input_get_event(HAL_input_event_t *event)
+{
+    bool result = false;
+
+    ENTER_CRITICAL_SECTION;
+
+    if (_queue_count != 0) {
+        *event = _queue[_queue_head];
+        _queue_head = (_queue_head + 1) % HAL_INPUT_QUEUE_DEPTH;
+        _queue_count--;
+        result = true;
+    }
+
+    EXIT_CRITICAL_SECTION;
+
+    return result;
+}
@@ -0,0 +1,254 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <mc9s08dz60.h>
+#include <lib.h>
+#include <pt.h>
+#include <HAL/_eeprom.h>
+#include <HAL/_kv.h>
+
+#define _RECORD_SIZE        4
+#define _SECTOR_SIZE        8
+#define _HALF_SIZE          ((HAL_KV_END - HAL_KV_START) / 2)
+#define _KEY_HEADER         0xfe
+#define _KEY_ERASED         0xff
+#define _NO_ERASE           0xffffU
+
+typedef struct {
+    uint8_t     key;
+    uint16_t    value;
+    uint8_t     check;
+} _record_t;
+
+static const uint8_t    _erased[_SECTOR_SIZE] = {
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff
+};
+
+static bool             _ready;
+static uint16_t         _active;        /* start of the active half */
+static uint16_t         _tail;          /* next free record */
+static uint16_t         _generation;
+static uint16_t         _erase_start = _NO_ERASE;  /* stale half to erase */
+static uint16_t         _value[HAL_KV_KEYS];
+static uint8_t          _present[(HAL_KV_KEYS + 7) / 8];
+
+#define _kv_present(_k)     (_present[(_k) >> 3] & (1 << ((_k) & 7)))
+
+static uint8_t
+_record_check(const _record_t *r)
+{
+    return (uint8_t)crc16(0xffff, (const uint8_t *)r, _RECORD_SIZE - 1);
+}
+
+/* read a record, returning true if it is complete */
+static bool
+_record_read(uint16_t offset, _record_t *r)
+{
+    HAL_eeprom_read(offset, _RECORD_SIZE, (uint8_t *)r);
+    return (r->key != _KEY_ERASED) && (r->check == _record_check(r));
+}
+
+static void
+_record_write(uint16_t offset, uint8_t key, uint16_t value)
+{
+    _record_t r;
+
+    r.key = key;
+    r.value = value;
+    r.check = _record_check(&r);
+    (void)_HAL_eeprom_write_async(offset, _RECORD_SIZE, (const uint8_t *)&r);
+}
+
+static uint16_t
+_kv_other(uint16_t half)
+{
+    return (half == HAL_KV_START) ? (HAL_KV_START + _HALF_SIZE) : HAL_KV_START;
+}
+
+static bool
+_kv_half_erased(uint16_t start)
+{
+    uint16_t offset;
+
+    for (offset = start; offset < (start + _HALF_SIZE); offset++) {
+        if (HAL_eeprom_read8(offset) != 0xff) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* queue a half to be erased, header sector first */
+static void
+_kv_erase(uint16_t start)
+{
+    uint16_t offset;
+
+    for (offset = start; offset < (start + _HALF_SIZE); offset += _SECTOR_SIZE) {
+        (void)_HAL_eeprom_write_async(offset, _SECTOR_SIZE, _erased);
+    }
+}
+
+/* run the background erase to completion */
+static void
+_kv_wait_erased(void)
+{
+    while (_erase_start != _NO_ERASE) {
+        __RESET_WATCHDOG();
+        PT_RUN(_HAL_kv_service);
+        PT_RUN(_HAL_eeprom_service);
+    }
+}
+
+/* find the active half and replay its log into the index */
+static void
+_kv_init(void)
+{
+    _record_t header[2];
+    bool valid[2];
+    uint8_t use;
+    uint16_t offset;
+
+    REQUIRE(((HAL_KV_END - HAL_KV_START) % (2 * _SECTOR_SIZE)) == 0);
+    REQUIRE((_HALF_SIZE / _RECORD_SIZE) > (HAL_KV_KEYS + 1));
+
+    valid[0] = _record_read(HAL_KV_START, &header[0]) && (header[0].key == _KEY_HEADER);
+    valid[1] = _record_read(HAL_KV_START + _HALF_SIZE, &header[1]) && (header[1].key == _KEY_HEADER);
+
+    if (!valid[0] && !valid[1]) {
+        /* never used (or not ours); start afresh */
+        _kv_erase(HAL_KV_START);
+        _kv_erase(HAL_KV_START + _HALF_SIZE);
+        _record_write(HAL_KV_START, _KEY_HEADER, 0);
+        HAL_eeprom_flush();
+
+        valid[0] = true;
+        header[0].value = 0;
+    }
+
+    /* both valid means a reset before the old half was erased; the newer one wins */
+    if (valid[0] && valid[1]) {
+        use = ((int16_t)(header[1].value - header[0].value) > 0) ? 1 : 0;
+    } else {
+        use = valid[0] ? 0 : 1;
+    }
+
+    _active = use ? (HAL_KV_START + _HALF_SIZE) : HAL_KV_START;
+    _generation = header[use].value;
+
+    if (!_kv_half_erased(_kv_other(_active))) {
+        _erase_start = _kv_other(_active);
+    }
+
+    /* replay; records are written key first, so an erased key is the end of the log */
+    for (offset = _active + _RECORD_SIZE; offset < (_active + _HALF_SIZE); offset += _RECORD_SIZE) {
+        _record_t r;
+
+        if (_record_read(offset, &r)) {
+            if (r.key < HAL_KV_KEYS) {
+                _value[r.key] = r.value;
+                _present[r.key >> 3] |= (uint8_t)(1 << (r.key & 7));
+            }
+        } else if (r.key == _KEY_ERASED) {
+            break;
+        }
+    }
+
+    _tail = offset;
+    _ready = true;
+}
+
+/* copy the live values to the other half and switch to it */
+static void
+_kv_compact(void)
+{
+    const uint16_t old = _active;
+    const uint16_t spare = _kv_other(old);
+    uint8_t key;
+
+    _kv_wait_erased();
+
+    _tail = spare + _RECORD_SIZE;
+
+    for (key = 0; key < HAL_KV_KEYS; key++) {
+        if (_kv_present(key)) {
+            _record_write(_tail, key, _value[key]);
+            _tail += _RECORD_SIZE;
+        }
+    }
+
+    /* commit by writing the header, once every record is in place */
+    HAL_eeprom_flush();
+    _generation++;
+    _record_write(spare, _KEY_HEADER, _generation);
+    HAL_eeprom_flush();
+
+    _active = spare;
+    _erase_start = old;
+}
+
+bool
+HAL_kv_get(uint8_t key, uint16_t *value)
+{
+    REQUIRE(key < HAL_KV_KEYS);
+
+    if (!_ready) {
+        _kv_init();
+    }
+
+    if (!_kv_present(key)) {
+        return false;
+    }
+
+    *value = _value[key];
+    return true;
+}
+
+void
+HAL_kv_set(uint8_t key, uint16_t value)
+{
+    REQUIRE(key < HAL_KV_KEYS);
+
+    if (!_ready) {
+        _kv_init();
+    }
+
+    if (_kv_present(key) && (_value[key] == value)) {
+        return;
+    }
+
+    if (_tail >= (_active + _HALF_SIZE)) {
+        _kv_compact();
+    }
+
+    _record_write(_tail, key, value);
+    _tail += _RECORD_SIZE;
+
+    _value[key] = value;
+    _present[key >> 3] |= (uint8_t)(1 << (key & 7));
+}
+
+/*
+ * Erase a stale half in the background, one sector at a time so that
+ * other EEPROM writes aren't held up behind it.
+ */
+PT_DEFINE(_HAL_kv_service)
+{
+    static uint16_t             _offset;
+    static HAL_eeprom_token_t   _token;
+
+    pt_begin(pt);
+
+    for (;;) {
+        pt_wait(pt, _erase_start != _NO_ERASE);
+
+        for (_offset = _erase_start; _offset < (_erase_start + _HALF_SIZE); _offset += _SECTOR_SIZE) {
+            _token = _HAL_eeprom_write_async(_offset, _SECTOR_SIZE, _erased);
+            pt_wait(pt, HAL_eeprom_write_done(_token));
+        }
+
+        _erase_start = _NO_ERASE;
+    }
+
+    pt_end(pt);
+}
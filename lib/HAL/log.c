@@ -0,0 +1,229 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <lib.h>
+#include <pt.h>
+#include <HAL/_crash.h>
+#include <HAL/_eeprom.h>
+#include <HAL/_log.h>
+#include <HAL/_reset.h>
+#include <HAL/_timer.h>
+
+/* one sector; see the layout in _log.h */
+typedef struct {
+    uint32_t    stamp;          /* sequence << 24 | time_us >> 8 */
+    uint16_t    arg;
+    uint8_t     event;
+    uint8_t     check;
+} _record_t;
+
+#define _EVENT_ERASED       0xff
+#define _slot_offset(_s)    (_HAL_EEPROM_LOG + ((uint16_t)(_s) * HAL_LOG_RECORD_SIZE))
+#define _sequence_of(_r)    ((uint8_t)((_r)->stamp >> 24))
+
+static _record_t            _queue[HAL_LOG_QUEUE_DEPTH];
+static uint8_t              _queue_head;
+static uint8_t              _queue_count;
+
+static bool                 _ready;
+static uint8_t              _next;          /* slot for the next record */
+static uint8_t              _sequence;      /* sequence number of the next record */
+
+static uint8_t
+_log_check(const _record_t *r)
+{
+    return (uint8_t)crc16(0xffff, (const uint8_t *)r, HAL_LOG_RECORD_SIZE - 1);
+}
+
+static bool
+_log_read_slot(uint8_t slot, _record_t *r)
+{
+    HAL_eeprom_read(_slot_offset(slot), HAL_LOG_RECORD_SIZE, (uint8_t *)r);
+    return (r->event != _EVENT_ERASED) && (r->check == _log_check(r));
+}
+
+/* find the newest record: the one not followed by its successor */
+static void
+_log_scan(void)
+{
+    _record_t first;
+    _record_t cur;
+    _record_t next;
+    bool first_valid;
+    bool cur_valid;
+    bool next_valid;
+    uint8_t slot;
+
+    REQUIRE(sizeof(_record_t) == HAL_LOG_RECORD_SIZE);
+
+    _ready = true;
+    _next = 0;
+    _sequence = 0;
+
+    first_valid = _log_read_slot(0, &first);
+    cur = first;
+    cur_valid = first_valid;
+
+    for (slot = 0; slot < HAL_LOG_RECORDS; slot++) {
+        if ((slot + 1) < HAL_LOG_RECORDS) {
+            next_valid = _log_read_slot(slot + 1, &next);
+        } else {
+            next = first;
+            next_valid = first_valid;
+        }
+
+        if (cur_valid &&
+            (!next_valid || (_sequence_of(&next) != (uint8_t)(_sequence_of(&cur) + 1)))) {
+            _next = (slot + 1) % HAL_LOG_RECORDS;
+            _sequence = _sequence_of(&cur) + 1;
+            break;
+        }
+
+        cur = next;
+        cur_valid = next_valid;
+    }
+}
+
+/* stamp a record with the next sequence number and queue it for the next slot */
+static HAL_eeprom_token_t
+_log_write(_record_t *r)
+{
+    HAL_eeprom_token_t token;
+
+    if (!_ready) {
+        _log_scan();
+    }
+
+    r->stamp = ((uint32_t)_sequence << 24) | (r->stamp & 0x00ffffffUL);
+    r->check = _log_check(r);
+    token = _HAL_eeprom_write_async(_slot_offset(_next), HAL_LOG_RECORD_SIZE, (const uint8_t *)r);
+
+    _next = (_next + 1) % HAL_LOG_RECORDS;
+    _sequence++;
+
+    return token;
+}
+
+static bool
+_log_pop(_record_t *r)
+{
+    bool result = false;
+
+    ENTER_CRITICAL_SECTION;
+
+    if (_queue_count != 0) {
+        *r = _queue[_queue_head];
+        _queue_head = (_queue_head + 1) % HAL_LOG_QUEUE_DEPTH;
+        _queue_count--;
+        result = true;
+    }
+
+    EXIT_CRITICAL_SECTION;
+
+    return result;
+}
+
+/* called after _HAL_crash_init(), so an abort before the reset can be logged */
+void
+_HAL_log_init(void)
+{
+#ifdef HAL_LOG_ENABLE
+    HAL_crash_t crash;
+
+    if (HAL_crash_get(&crash)) {
+        HAL_log(HAL_LOG_ABORT, crash.line);
+    }
+
+    HAL_log(HAL_LOG_RESET, HAL_reset_reason());
+#endif
+}
+
+bool
+_HAL_log_record(uint8_t age, uint8_t *record)
+{
+#ifdef HAL_LOG_ENABLE
+    _record_t r;
+    uint8_t slot;
+
+    if (!_ready) {
+        _log_scan();
+    }
+
+    if (age >= HAL_LOG_RECORDS) {
+        return false;
+    }
+
+    slot = (uint8_t)((_next + (2 * HAL_LOG_RECORDS) - 1 - age) % HAL_LOG_RECORDS);
+
+    if (!_log_read_slot(slot, &r) ||
+        (_sequence_of(&r) != (uint8_t)(_sequence - 1 - age))) {
+        return false;
+    }
+
+    memcpy(record, &r, HAL_LOG_RECORD_SIZE);
+    return true;
+#else
+    (void)age;
+    (void)record;
+    return false;
+#endif
+}
+
+void
+HAL_log(uint8_t event, uint16_t arg)
+{
+    HAL_trace(event);
+
+#ifdef HAL_LOG_ENABLE
+    ENTER_CRITICAL_SECTION;
+
+    /* full; keep the older events, they're usually the cause */
+    if (_queue_count < HAL_LOG_QUEUE_DEPTH) {
+        _record_t *const r = &_queue[(_queue_head + _queue_count) % HAL_LOG_QUEUE_DEPTH];
+
+        r->stamp = _HAL_timer_us_isr() >> 8;
+        r->arg = arg;
+        r->event = event;
+        _queue_count++;
+    }
+
+    EXIT_CRITICAL_SECTION;
+#else
+    (void)arg;
+#endif
+}
+
+bool
+HAL_log_read(uint8_t age, HAL_log_entry_t *entry)
+{
+    _record_t r;
+
+    if (!_HAL_log_record(age, (uint8_t *)&r)) {
+        return false;
+    }
+
+    entry->time_us = (r.stamp & 0x00ffffffUL) << 8;
+    entry->arg = r.arg;
+    entry->event = r.event;
+    return true;
+}
+
+/*
+ * Write queued events one at a time, waiting for each so that the
+ * write-behind queue never fills with log records.
+ */
+PT_DEFINE(_HAL_log_service)
+{
+    static _record_t            _r;
+    static HAL_eeprom_token_t   _token;
+
+    pt_begin(pt);
+
+    for (;;) {
+        pt_wait(pt, _log_pop(&_r));
+        _token = _log_write(&_r);
+        pt_wait(pt, HAL_eeprom_write_done(_token));
+    }
+
+    pt_end(pt);
+}
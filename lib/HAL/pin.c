@@ -14,8 +14,8 @@ enum {
     _PORT_F,
 };
 
-#define _PWM_NONE   7
-#define _AI_NONE   15
+#define _PWM_NONE   _HAL_PIN_PWM_NONE
+#define _AI_NONE    _HAL_PIN_AI_NONE
 
 const HAL_pin_t _HAL_7H_pin[] = {
     /* OUT_1 */ { _AI_NONE,  0,       2         },
@@ -86,6 +86,42 @@ HAL_pin_set_duty(const HAL_pin_t *pin, uint8_t duty)
     HAL_pwm_set(pin->pwm, duty);
 }
 
+void
+HAL_pin_set_duty16(const HAL_pin_t *pin, uint16_t duty)
+{
+    HAL_pwm_set_duty16(pin->pwm, duty);
+}
+
+void
+HAL_pin_stage_duty(const HAL_pin_t *pin, uint8_t duty)
+{
+    HAL_pwm_stage(pin->pwm, duty);
+}
+
+void
+HAL_pin_stage_duty16(const HAL_pin_t *pin, uint16_t duty)
+{
+    HAL_pwm_stage_duty16(pin->pwm, duty);
+}
+
+void
+HAL_pin_ramp_duty(const HAL_pin_t *pin, uint8_t duty, uint16_t time_ms)
+{
+    HAL_pwm_ramp(pin->pwm, duty, time_ms);
+}
+
+void
+HAL_pin_ramp_duty_rate(const HAL_pin_t *pin, uint8_t duty, uint16_t rate)
+{
+    HAL_pwm_ramp_rate(pin->pwm, duty, rate);
+}
+
+void
+HAL_pin_set_pwm_group(const HAL_pin_t *pin, uint8_t group)
+{
+    HAL_pwm_set_group(pin->pwm, group);
+}
+
 void
 HAL_pin_set_range(const HAL_pin_t *pin, bool high_range)
 {
@@ -102,6 +138,14 @@ HAL_pin_set_pullup(const HAL_pin_t *pin, bool enable)
     _gpio_set(pin->pull, enable);
 }
 
+void
+HAL_pin_set_adc_mode(const HAL_pin_t *pin, HAL_adc_mode_t mode)
+{
+    if (pin->adc_v != _AI_NONE) {
+        HAL_adc_set_mode(pin->adc_v, mode);
+    }
+}
+
 uint16_t
 HAL_pin_get_mV(const HAL_pin_t *pin)
 {
@@ -113,7 +157,7 @@ HAL_pin_get_mV(const HAL_pin_t *pin)
 }
 
 uint16_t
-HAL_pin_get_mA(const HAL_pin_t *pin)
+HAL_pin_get_output_mA(const HAL_pin_t *pin)
 {
     if (pin->adc_i != _AI_NONE) {
         return HAL_adc_result(pin->adc_i);
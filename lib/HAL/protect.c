@@ -0,0 +1,513 @@
+#include <stddef.h>
+#include <mc9s08dz60.h>
+#include <lib.h>
+#include <HAL/_adc.h>
+#include <HAL/_log.h>
+#include <HAL/_pin.h>
+#include <HAL/_protect.h>
+#include <HAL/_pwm.h>
+#include <HAL/_timer.h>
+
+/* HAL_pin_t ADC indices are 4 bits */
+#define _ADC_INDICES        16
+
+/* _adc_owner flag for voltage feedback */
+#define _OWNER_V            0x80
+
+/* consecutive samples required to confirm open load / short to battery */
+#define _CONFIRM_SAMPLES    2
+
+/* I2t heat (integer part) for continuous operation at the trip current */
+#define _I2T_LIMIT          256
+#define _I2T_RESUME         (_I2T_LIMIT - (_I2T_LIMIT / 8))
+#define _I2T_INPUT_MAX      0x7fff
+#define _I2T_CAP_STEP       16
+
+typedef struct {
+    bool                enabled;
+    bool                tripped;
+    bool                logged;         /* a trip has been logged since the last reset */
+    uint8_t             fault;          /* HAL_protect_fault_t */
+    uint8_t             adc_i;          /* feedback ADC indices, or _HAL_PIN_AI_NONE */
+    uint8_t             adc_v;
+    uint16_t            overcurrent;    /* thresholds in 10-bit sample counts */
+    uint16_t            open_load;
+    uint16_t            short_v;
+    uint8_t             open_count;
+    uint8_t             short_count;
+    uint8_t             retry_limit;
+    uint8_t             retries;        /* remaining */
+    uint16_t            retry_ms;
+    uint16_t            backoff_ms;     /* next retry delay */
+    uint16_t            countdown_ms;   /* until the current retry, 0 if none */
+    HAL_microseconds    last_sample[2]; /* current, voltage */
+} _channel_t;
+
+typedef struct {
+    bool                enabled;
+    bool                derate;
+    uint8_t             adc_i;
+    uint16_t            sat_counts;     /* 16x the trip current in 10-bit accumulated counts */
+    uint32_t            trip_scale;     /* 2^24 / trip counts: counts to 8.8 of the trip current */
+    uint16_t            alpha;          /* 0.16 fixed-point, 1ms / tau */
+    uint16_t            input;          /* heating rate, _I2T_LIMIT at the trip current */
+    uint16_t            cap;            /* duty cap in 1/256ths, or _HAL_PWM_CAP_NONE */
+    int32_t             heat;           /* 16.16 fixed-point */
+} _i2t_t;
+
+static _channel_t       _channel[_HAL_PWM_CHANNELS];
+static _i2t_t           _i2t[_HAL_PWM_CHANNELS];
+static uint16_t         _i2t_sweep;
+static uint8_t          _i2t_stale;     /* channels yet to take their input from the sweep */
+static uint8_t          _adc_owner[_ADC_INDICES];
+static HAL_microseconds _worst_interval;
+static uint16_t         _worst_response;
+
+static void _protect_retry(void);
+static void _i2t_tick(void);
+
+static HAL_timer_call_t _retry_call = { _protect_retry };
+static HAL_timer_call_t _i2t_call = { _i2t_tick, 1, 1 };
+
+/* I2t heat above the resume level, so a retry would just trip again */
+#define _i2t_hot(_ch)                                                   \
+    (_i2t[_ch].enabled && ((int16_t)(_i2t[_ch].heat >> 16) >= _I2T_RESUME))
+
+static void
+_protect_trip(uint8_t channel, HAL_protect_fault_t fault)
+{
+    _channel_t *const c = &_channel[channel];
+
+    _HAL_pwm_inhibit(channel);
+    c->tripped = true;
+    c->fault = fault;
+
+    /* only the first trip; logging every retry would wear out the log */
+    if (!c->logged) {
+        c->logged = true;
+        HAL_log(HAL_LOG_OUTPUT_TRIP, ((uint16_t)channel << 8) | fault);
+    }
+
+    if (c->retries != 0) {
+        if (c->retries != HAL_PROTECT_RETRY_FOREVER) {
+            c->retries--;
+        }
+
+        c->countdown_ms = c->backoff_ms ? c->backoff_ms : 1;
+
+        if (c->backoff_ms < (HAL_PROTECT_BACKOFF_MAX_MS / 2)) {
+            c->backoff_ms <<= 1;
+        } else {
+            c->backoff_ms = HAL_PROTECT_BACKOFF_MAX_MS;
+        }
+
+        /* run the retry countdown every tick until it's done */
+        _retry_call.period_ms = 1;
+
+        if (_retry_call.delay_ms == 0) {
+            _retry_call.delay_ms = 1;
+        }
+    }
+}
+
+void
+_HAL_protect_sample(uint8_t index, uint16_t counts, bool synced)
+{
+    const uint8_t owner = _adc_owner[index];
+    const uint8_t channel = owner & ~_OWNER_V;
+    const uint8_t which = (owner & _OWNER_V) ? 1 : 0;
+    _channel_t *const c = &_channel[channel];
+    const HAL_microseconds now = _HAL_timer_us_isr();
+    HAL_protect_fault_t fault = HAL_PROTECT_OK;
+
+    /* track the worst-case interval between samples */
+    if (c->last_sample[which] != 0) {
+        const HAL_microseconds interval = now - c->last_sample[which];
+
+        if (interval > _worst_interval) {
+            _worst_interval = interval;
+        }
+    }
+
+    c->last_sample[which] = now;
+
+    if (c->tripped) {
+        return;
+    }
+
+    if (which) {
+        /* voltage high while commanded off */
+        if ((counts > c->short_v) && (_HAL_pwm_cycles(channel) == 0)) {
+            if (++c->short_count >= _CONFIRM_SAMPLES) {
+                fault = HAL_PROTECT_SHORT_TO_BATTERY;
+            }
+        } else {
+            c->short_count = 0;
+        }
+
+    } else if (counts > c->overcurrent) {
+        fault = HAL_PROTECT_OVERCURRENT;
+
+    } else {
+        /* current low while known to be on */
+        if ((counts < c->open_load) &&
+            (synced || (_HAL_pwm_cycles(channel) >= _HAL_pwm_period_cycles()))) {
+            if (++c->open_count >= _CONFIRM_SAMPLES) {
+                fault = HAL_PROTECT_OPEN_LOAD;
+            }
+        } else {
+            c->open_count = 0;
+        }
+    }
+
+    if (fault != HAL_PROTECT_OK) {
+        uint16_t response;
+
+        _protect_trip(channel, fault);
+
+        response = (uint16_t)(_HAL_timer_us_isr() - now);
+
+        if (response > _worst_response) {
+            _worst_response = response;
+        }
+    }
+}
+
+static void
+_protect_retry(void)
+{
+    uint8_t i;
+    bool pending = false;
+
+    for (i = 0; i < _HAL_PWM_CHANNELS; i++) {
+        _channel_t *const c = &_channel[i];
+
+        if (c->countdown_ms != 0) {
+            if (--c->countdown_ms == 0) {
+                if (_i2t_hot(i)) {
+                    /* wait for the output to cool */
+                    c->countdown_ms = 1;
+                    pending = true;
+                    continue;
+                }
+
+                c->tripped = false;
+                c->open_count = 0;
+                c->short_count = 0;
+                _HAL_pwm_release(i);
+            } else {
+                pending = true;
+            }
+        }
+    }
+
+    /* stop ticking once there is nothing left to retry */
+    if (!pending) {
+        _retry_call.period_ms = 0;
+    }
+}
+
+/* recompute a channel's heating rate from the latest ADC sweep; multiplies, no divide */
+static void
+_i2t_input(uint8_t channel)
+{
+    _i2t_t *const t = &_i2t[channel];
+    const uint16_t duty = _HAL_pwm_duty16(channel);
+    const uint16_t counts = _HAL_adc_counts(t->adc_i);
+    uint32_t u;
+
+    if ((duty == 0) || (counts == 0)) {
+        t->input = 0;
+        return;
+    }
+
+    /* current relative to the trip current, 8.8 fixed-point, saturating at 16x */
+    if (counts >= t->sat_counts) {
+        u = 0x0fff;
+    } else {
+        u = ((uint32_t)counts * t->trip_scale) >> 16;
+    }
+
+    /* squared, and weighted by duty cycle */
+    u = (u * u) >> 8;
+    u = (u * duty) >> 16;
+
+    t->input = (u > _I2T_INPUT_MAX) ? _I2T_INPUT_MAX : (uint16_t)u;
+}
+
+/* adjust the derating cap once per sweep */
+static void
+_i2t_derate(uint8_t channel, int16_t heat)
+{
+    _i2t_t *const t = &_i2t[channel];
+
+    if (heat >= _I2T_LIMIT) {
+        if (t->cap == _HAL_PWM_CAP_NONE) {
+            /* start from the current duty cycle so that the cap bites immediately */
+            t->cap = _HAL_pwm_duty16(channel) >> 8;
+        }
+
+        t->cap -= t->cap >> 3;
+        _HAL_pwm_set_cap(channel, t->cap);
+
+    } else if ((heat < _I2T_RESUME) && (t->cap != _HAL_PWM_CAP_NONE)) {
+        t->cap += _I2T_CAP_STEP;
+
+        if (t->cap >= _HAL_PWM_CAP_NONE) {
+            t->cap = _HAL_PWM_CAP_NONE;
+        }
+
+        _HAL_pwm_set_cap(channel, t->cap);
+    }
+}
+
+/* take the next channel due an input from the latest sweep, if any */
+static uint8_t
+_i2t_next_stale(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < _HAL_PWM_CHANNELS; i++) {
+        const uint8_t mask = 1 << i;
+
+        if (_i2t_stale & mask) {
+            _i2t_stale &= ~mask;
+
+            if (_i2t[i].enabled) {
+                return i;
+            }
+        }
+    }
+
+    return _HAL_PWM_CHANNELS;
+}
+
+static void
+_i2t_tick(void)
+{
+    const uint16_t sweep = _HAL_adc_sweep();
+    uint8_t stale;
+    uint8_t i;
+
+    /* one channel's input per tick, rather than all of them in the tick after a sweep */
+    if (sweep != _i2t_sweep) {
+        _i2t_sweep = sweep;
+        _i2t_stale = (1 << _HAL_PWM_CHANNELS) - 1;
+    }
+
+    stale = _i2t_next_stale();
+
+    for (i = 0; i < _HAL_PWM_CHANNELS; i++) {
+        _i2t_t *const t = &_i2t[i];
+        const bool update = (i == stale);
+        int16_t heat;
+
+        if (!t->enabled) {
+            continue;
+        }
+
+        if (update) {
+            _i2t_input(i);
+        }
+
+        /* first-order filter towards the heating rate */
+        heat = (int16_t)(t->heat >> 16);
+        t->heat += (int32_t)((int16_t)t->input - heat) * t->alpha;
+        heat = (int16_t)(t->heat >> 16);
+
+        if (t->derate) {
+            if (update) {
+                _i2t_derate(i, heat);
+            }
+        } else if ((heat >= _I2T_LIMIT) && !_channel[i].tripped) {
+            _protect_trip(i, HAL_PROTECT_OVERLOAD);
+        }
+    }
+}
+
+static void
+_protect_reset(_channel_t *c)
+{
+    c->tripped = false;
+    c->logged = false;
+    c->fault = HAL_PROTECT_OK;
+    c->open_count = 0;
+    c->short_count = 0;
+    c->retries = c->retry_limit;
+    c->backoff_ms = c->retry_ms;
+    c->countdown_ms = 0;
+}
+
+void
+HAL_pin_set_protection(const HAL_pin_t *pin, const HAL_protect_config_t *config)
+{
+    const uint8_t channel = pin->pwm;
+    _channel_t *const c = &_channel[channel];
+
+    REQUIRE(channel < _HAL_PWM_CHANNELS);
+
+    _HAL_timer_call_register(&_retry_call);
+
+    /* stop checking while we reconfigure */
+    if (c->enabled) {
+        if (c->adc_i != _HAL_PIN_AI_NONE) {
+            _HAL_adc_clear_notify(c->adc_i, _HAL_ADC_NOTIFY_PROTECT);
+        }
+
+        if (c->adc_v != _HAL_PIN_AI_NONE) {
+            _HAL_adc_clear_notify(c->adc_v, _HAL_ADC_NOTIFY_PROTECT);
+        }
+    }
+
+    ENTER_CRITICAL_SECTION;
+
+    c->enabled = (config != NULL);
+    c->adc_i = pin->adc_i;
+    c->adc_v = pin->adc_v;
+    c->overcurrent = 0xffff;
+    c->open_load = 0;
+    c->short_v = 0xffff;
+    c->last_sample[0] = 0;
+    c->last_sample[1] = 0;
+
+    if (config != NULL) {
+        c->retry_limit = config->retries;
+        c->retry_ms = config->retry_ms;
+    }
+
+    _protect_reset(c);
+
+    EXIT_CRITICAL_SECTION;
+
+    _HAL_pwm_release(channel);
+
+    if (config == NULL) {
+        return;
+    }
+
+    /* thresholds are converted outside the critical section; they divide */
+    if (c->adc_i != _HAL_PIN_AI_NONE) {
+        if (config->overcurrent_mA != 0) {
+            c->overcurrent = _HAL_adc_sample_threshold(c->adc_i, config->overcurrent_mA);
+        }
+
+        if (config->open_load_mA != 0) {
+            c->open_load = _HAL_adc_sample_threshold(c->adc_i, config->open_load_mA);
+        }
+
+        _adc_owner[c->adc_i] = channel;
+        _HAL_adc_set_notify(c->adc_i, _HAL_ADC_NOTIFY_PROTECT);
+    }
+
+    if (c->adc_v != _HAL_PIN_AI_NONE) {
+        if (config->short_mV != 0) {
+            c->short_v = _HAL_adc_sample_threshold(c->adc_v, config->short_mV);
+        }
+
+        _adc_owner[c->adc_v] = channel | _OWNER_V;
+        _HAL_adc_set_notify(c->adc_v, _HAL_ADC_NOTIFY_PROTECT);
+    }
+}
+
+HAL_protect_fault_t
+HAL_pin_get_fault(const HAL_pin_t *pin)
+{
+    REQUIRE(pin->pwm < _HAL_PWM_CHANNELS);
+    return (HAL_protect_fault_t)_channel[pin->pwm].fault;
+}
+
+bool
+HAL_pin_is_tripped(const HAL_pin_t *pin)
+{
+    REQUIRE(pin->pwm < _HAL_PWM_CHANNELS);
+    return _channel[pin->pwm].tripped;
+}
+
+void
+HAL_pin_clear_fault(const HAL_pin_t *pin)
+{
+    REQUIRE(pin->pwm < _HAL_PWM_CHANNELS);
+
+    ENTER_CRITICAL_SECTION;
+    _protect_reset(&_channel[pin->pwm]);
+    _HAL_pwm_release(pin->pwm);
+    EXIT_CRITICAL_SECTION;
+}
+
+void
+HAL_pin_set_i2t(const HAL_pin_t *pin, const HAL_i2t_config_t *config)
+{
+    const uint8_t channel = pin->pwm;
+    _i2t_t *const t = &_i2t[channel];
+    uint16_t trip_counts = 1;
+    uint32_t trip_scale = 0;
+
+    REQUIRE(channel < _HAL_PWM_CHANNELS);
+    REQUIRE(pin->adc_i != _HAL_PIN_AI_NONE);
+
+    if (config != NULL) {
+        REQUIRE(config->tau_ms >= 2);
+        trip_counts = _HAL_adc_value_counts(pin->adc_i, config->trip_mA);
+
+        if (trip_counts == 0) {
+            trip_counts = 1;
+        }
+
+        trip_scale = 0x1000000UL / trip_counts;
+    }
+
+    ENTER_CRITICAL_SECTION;
+
+    t->enabled = (config != NULL);
+    t->adc_i = pin->adc_i;
+    t->input = 0;
+    t->heat = 0;
+    t->cap = _HAL_PWM_CAP_NONE;
+
+    if (config != NULL) {
+        t->derate = config->derate;
+        t->sat_counts = (trip_counts < 0x1000) ? (trip_counts << 4) : 0xffff;
+        t->trip_scale = trip_scale;
+        t->alpha = (uint16_t)(0x10000UL / config->tau_ms);
+    }
+
+    EXIT_CRITICAL_SECTION;
+
+    _HAL_pwm_set_cap(channel, _HAL_PWM_CAP_NONE);
+    _HAL_timer_call_register(&_i2t_call);
+}
+
+uint8_t
+HAL_pin_get_i2t_headroom(const HAL_pin_t *pin)
+{
+    const _i2t_t *const t = &_i2t[pin->pwm];
+    int16_t heat;
+
+    REQUIRE(pin->pwm < _HAL_PWM_CHANNELS);
+
+    ENTER_CRITICAL_SECTION;
+    heat = (int16_t)(t->heat >> 16);
+    EXIT_CRITICAL_SECTION;
+
+    if (!t->enabled) {
+        return 100;
+    }
+
+    if ((heat >= _I2T_LIMIT) || (t->cap != _HAL_PWM_CAP_NONE) || _channel[pin->pwm].tripped) {
+        return 0;
+    }
+
+    return 100 - (uint8_t)(((uint16_t)heat * 100) >> 8);
+}
+
+HAL_microseconds
+HAL_protect_latency_us(void)
+{
+    HAL_microseconds latency;
+
+    ENTER_CRITICAL_SECTION;
+    latency = _worst_interval + _worst_response;
+    EXIT_CRITICAL_SECTION;
+
+    return latency;
+}
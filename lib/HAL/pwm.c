@@ -1,12 +1,124 @@
 #include <stdlib.h>
 #include <mc9s08dz60.h>
+#include <lib.h>
+#include <HAL/_adc.h>
+#include <HAL/_freq.h>
 #include <HAL/_pwm.h>
+#include <HAL/_timer.h>
 
 static uint16_t pwm_period_cycles;
+static uint8_t  pwm_period_ms;
+static uint32_t _duty16_scale;          /* cycles to a 16-bit duty fraction, 16.16 */
+static uint16_t _channel_cycles[_HAL_PWM_CHANNELS];
+static volatile uint8_t _overflow_requests;
+static uint8_t  _inhibit;
+static uint16_t _channel_cap[_HAL_PWM_CHANNELS];
+
+/* shortest pulse (high or low) that we will generate, 100us */
+#define _MIN_PULSE_CYCLES   25
+
+/*
+ * Staggered mode programs each edge from the previous edge's interrupt;
+ * an edge due within this many counts of the interrupt is taken at once.
+ */
+#define _STAGGER_MARGIN_CYCLES      2
+
+typedef struct {
+    int32_t     position;       /* current duty in 1/256 cycles */
+    int32_t     step;           /* per tick, in 1/256 cycles */
+    uint16_t    target;         /* cycles */
+    uint16_t    remaining_ms;
+} _pwm_ramp_t;
+
+static _pwm_ramp_t      _ramp[_HAL_PWM_CHANNELS];
+static uint8_t          _ramping;
+
+/*
+ * Channel mode register values; the bit layout is the same for all
+ * channels, so channel 0's masks are used throughout.
+ */
+#define _SC_EPWM        (TPM1C0SC_MS0B_MASK | TPM1C0SC_ELS0B_MASK)
+#define _SC_OC_SET      (TPM1C0SC_MS0A_MASK | TPM1C0SC_ELS0B_MASK | TPM1C0SC_ELS0A_MASK)
+#define _SC_OC_CLEAR    (TPM1C0SC_MS0A_MASK | TPM1C0SC_ELS0B_MASK)
+#define _SC_IE          TPM1C0SC_CH0IE_MASK
+#define _SC_CAPTURE     (TPM1C0SC_ELS0B_MASK | TPM1C0SC_ELS0A_MASK)
+
+/* last value written to each channel's mode register */
+static uint8_t          _channel_sc[_HAL_PWM_CHANNELS];
+
+/* batched updates */
+static uint16_t         _staged_cycles[_HAL_PWM_CHANNELS];
+static uint8_t          _staged;            /* channels staged since the last commit */
+static volatile uint8_t _committing;        /* channels to write at the next period start */
+
+/* TPM1C0 is capturing FREQ_IN rather than generating PWM */
+static bool             _capture;
+
+/* staggered mode state */
+static bool             _staggered;
+static uint8_t          _configured;        /* channels that have been set */
+static uint8_t          _stagger_active;    /* channels switching under interrupt control */
+static uint8_t          _stagger_high;      /* channels currently driven high */
+static uint16_t         _stagger_phase[_HAL_PWM_CHANNELS];
+static uint16_t         _stagger_on[_HAL_PWM_CHANNELS];
+static uint16_t         _stagger_due[_HAL_PWM_CHANNELS];   /* scheduled time of the pending edge */
+
+/* software PWM group */
+#define _SOFT_PIN_SHIFT     2           /* channel n is on PTD(n+2) */
+#define _SOFT_MIN_PULSE_US  100
+
+typedef struct {
+    uint16_t    off_us;                 /* from the start of the period */
+    uint8_t     pins;                   /* PTDD bits to clear */
+} _soft_edge_t;
+
+static uint8_t          _soft_group;        /* channels in the software group */
+static uint8_t          _soft_pins;         /* their PTDD bits */
+static uint16_t         _soft_period_us = 10000;
+static uint32_t         _soft_scale;        /* TPM1 cycles to microseconds, 16.16 */
+static uint16_t         _soft_on_us[_HAL_PWM_CHANNELS];
+
+/* schedule for the next period, rebuilt when a duty cycle changes */
+static _soft_edge_t     _soft_next[_HAL_PWM_CHANNELS];
+static uint8_t          _soft_next_edges;
+static uint8_t          _soft_next_on;
+static bool             _soft_pending;
+
+/* schedule for the current period */
+static _soft_edge_t     _soft_edges[_HAL_PWM_CHANNELS];
+static uint8_t          _soft_edge_count;
+static uint8_t          _soft_edge_index;
+static uint8_t          _soft_on;
+static uint16_t         _soft_start;
+
+static void     _soft_period(void);
+static void     _soft_edge(void);
+
+static _HAL_timer_alarm_t _soft_period_alarm = { _soft_period };
+static _HAL_timer_alarm_t _soft_edge_alarm = { _soft_edge };
+
+static uint16_t _pwm_duty16_cycles(uint16_t duty);
+static uint16_t _pwm_clamp(uint16_t channel_cycles);
+static uint16_t _pwm_effective(uint8_t channel);
+static void     _pwm_write(uint8_t channel, uint16_t channel_cycles);
+static void     _pwm_write_sc(uint8_t channel, uint8_t sc, uint16_t value);
+static void     _pwm_stagger_phases(void);
+static void     _pwm_ramp_tick(void);
+static void     _soft_rescale(void);
+static void     _soft_set(uint8_t channel, uint16_t channel_cycles);
+static void     _soft_schedule(void);
+
+static HAL_timer_call_t _ramp_call = { _pwm_ramp_tick };
 
 void
 _HAL_pwm_init(void)
 {
+    uint8_t i;
+
+    for (i = 0; i < _HAL_PWM_CHANNELS; i++) {
+        _channel_cap[i] = _HAL_PWM_CAP_NONE;
+    }
+
     TPM1SC = 0;
     TPM1SC_CLKSx = 2;           /* select 1MHz fixed clock */
     TPM1SC_PS = 2;              /* /4 prescaler */
@@ -16,75 +128,433 @@ _HAL_pwm_init(void)
 void
 HAL_pwm_set_period(uint8_t period_ms)
 {
-    pwm_period_cycles = (uint16_t)period_ms * (1000 / 4);
+    pwm_period_ms = period_ms;
+    pwm_period_cycles = (uint16_t)period_ms * (1000 / _HAL_PWM_QUANTUM_US);
+    _duty16_scale = 0xffffffffUL / pwm_period_cycles;
 
     TPM1MOD = pwm_period_cycles;/* set PWM period */
     TPM1CNT = 0;                /* reset the period */
+
+    if (_staggered) {
+        _pwm_stagger_phases();
+    }
+
+    _soft_rescale();
 }
 
 void
-HAL_pwm_set(uint8_t channel, uint8_t duty)
+HAL_pwm_set_soft_period(uint16_t period_us)
 {
-    uint16_t channel_cycles;
+    if ((period_us < HAL_PWM_SOFT_PERIOD_MIN_US) || (period_us > HAL_PWM_SOFT_PERIOD_MAX_US)) {
+        return;
+    }
+
+    ENTER_CRITICAL_SECTION;
+
+    _soft_period_us = period_us;
+    _soft_rescale();
+
+    EXIT_CRITICAL_SECTION;
+}
+
+void
+HAL_pwm_set_group(uint8_t channel, uint8_t group)
+{
+    uint8_t mask;
+
+    if ((channel >= _HAL_PWM_CHANNELS) || (group > HAL_PWM_GROUP_SOFT)) {
+        return;
+    }
+
+    mask = 1 << channel;
+
+    ENTER_CRITICAL_SECTION;
+
+    if ((group == HAL_PWM_GROUP_SOFT) && !(_soft_group & mask)) {
+        /* hand the pin to GPIO, driving low until the engine picks it up */
+        _stagger_active &= ~mask;
+        _stagger_high &= ~mask;
+        PTDD &= ~(uint8_t)(1 << (channel + _SOFT_PIN_SHIFT));
+        _pwm_write_sc(channel, 0, 0);
+
+        _soft_group |= mask;
+        _soft_pins |= (uint8_t)(1 << (channel + _SOFT_PIN_SHIFT));
+        _soft_on_us[channel] = 0;
+        _soft_schedule();
+
+        /* first channel in the group starts the engine */
+        if (_soft_group == mask) {
+            _soft_scale = ((uint32_t)_soft_period_us << 16) / pwm_period_cycles;
+            _HAL_timer_alarm_set(&_soft_period_alarm, 0);
+        }
+
+    } else if ((group == HAL_PWM_GROUP_TPM1) && (_soft_group & mask)) {
+        _soft_on_us[channel] = 0;
+        _soft_group &= ~mask;
+        _soft_pins &= ~(uint8_t)(1 << (channel + _SOFT_PIN_SHIFT));
+        _soft_schedule();
+
+        /* leave the GPIO low, for when the channel is next disconnected */
+        PTDD &= ~(uint8_t)(1 << (channel + _SOFT_PIN_SHIFT));
+
+        if (_soft_group == 0) {
+            _HAL_timer_alarm_cancel(&_soft_period_alarm);
+            _HAL_timer_alarm_cancel(&_soft_edge_alarm);
+        }
+
+    } else {
+        /* already in the group */
+        mask = 0;
+    }
+
+    if ((_configured & mask) && !(_inhibit & mask)) {
+        _pwm_write(channel, _pwm_effective(channel));
+    }
 
+    EXIT_CRITICAL_SECTION;
+}
+
+void
+HAL_pwm_set_staggered(bool enable)
+{
+    uint8_t i;
+
+    ENTER_CRITICAL_SECTION;
+
+    if (enable != _staggered) {
+        _staggered = enable;
+        _stagger_active = 0;
+        _stagger_high = 0;
+        _pwm_stagger_phases();
+
+        /* switch configured channels over to the new mode */
+        for (i = 0; i < _HAL_PWM_CHANNELS; i++) {
+            if ((_configured & (1 << i)) && !(_inhibit & (1 << i))) {
+                _pwm_write(i, _pwm_effective(i));
+            }
+        }
+    }
+
+    EXIT_CRITICAL_SECTION;
+}
+
+/* convert a duty cycle in percent to cycles, avoiding runt pulses */
+static uint16_t
+_pwm_duty_cycles(uint8_t duty)
+{
+    if (duty >= 100) {
+        /* on means on */
+        return pwm_period_cycles;
+    }
+
+    /* 65536 / 100 = 655.36 ~= 10486 / 16 */
+    return _pwm_duty16_cycles((uint16_t)(((uint32_t)duty * 10486U) >> 4));
+}
+
+/* convert a 16-bit fractional duty cycle to cycles, avoiding runt pulses */
+static uint16_t
+_pwm_duty16_cycles(uint16_t duty)
+{
     if (duty == 0) {
         /* off means off */
-        channel_cycles = 0;
+        return 0;
 
-    } else if (duty >= 100) {
+    } else if (duty == HAL_PWM_DUTY_FULL) {
         /* on means on */
-        channel_cycles = pwm_period_cycles;
+        return pwm_period_cycles;
 
     } else {
-        /* calcuate a reasonable approximation of what's been requested */
-        channel_cycles = (uint16_t)(((uint32_t)pwm_period_cycles * duty) / 100);
+        /* scale by the period; multiply and shift, no divide */
+        return _pwm_clamp((uint16_t)(((uint32_t)duty * pwm_period_cycles) >> 16));
+    }
+}
+
+static uint16_t
+_pwm_clamp(uint16_t channel_cycles)
+{
+    if (channel_cycles < _MIN_PULSE_CYCLES) {
+        /* less than 100us on = off */
+        return 0;
+
+    } else if ((channel_cycles + _MIN_PULSE_CYCLES) > pwm_period_cycles) {
+        /* less than 100us off = on */
+        return pwm_period_cycles;
+    }
+
+    return channel_cycles;
+}
+
+/* record the requested cycles for a channel and update the hardware */
+static void
+_pwm_request(uint8_t channel, uint16_t channel_cycles)
+{
+    ENTER_CRITICAL_SECTION;
+
+    _channel_cycles[channel] = channel_cycles;
+    _configured |= (1 << channel);
+
+    /* an inhibited channel stays off, but remembers the request */
+    if (!(_inhibit & (1 << channel))) {
+        _pwm_write(channel, _pwm_effective(channel));
+    }
+
+    EXIT_CRITICAL_SECTION;
+}
+
+void
+HAL_pwm_set(uint8_t channel, uint8_t duty)
+{
+    if (channel < _HAL_PWM_CHANNELS) {
+        ENTER_CRITICAL_SECTION;
+
+        /* an explicit setting overrides any ramp in progress */
+        _ramping &= ~(1 << channel);
+        _pwm_request(channel, _pwm_duty_cycles(duty));
+
+        EXIT_CRITICAL_SECTION;
+    }
+}
+
+void
+HAL_pwm_set_duty16(uint8_t channel, uint16_t duty)
+{
+    if (channel < _HAL_PWM_CHANNELS) {
+        ENTER_CRITICAL_SECTION;
+
+        _ramping &= ~(1 << channel);
+        _pwm_request(channel, _pwm_duty16_cycles(duty));
+
+        EXIT_CRITICAL_SECTION;
+    }
+}
 
-        if (channel_cycles < 25) {
-            /* less than 100us on = off */
-            channel_cycles = 0;
+static void
+_pwm_stage(uint8_t channel, uint16_t channel_cycles)
+{
+    if (channel < _HAL_PWM_CHANNELS) {
+        ENTER_CRITICAL_SECTION;
+
+        _staged_cycles[channel] = channel_cycles;
+        _staged |= (1 << channel);
+
+        EXIT_CRITICAL_SECTION;
+    }
+}
+
+void
+HAL_pwm_stage(uint8_t channel, uint8_t duty)
+{
+    _pwm_stage(channel, _pwm_duty_cycles(duty));
+}
+
+void
+HAL_pwm_stage_duty16(uint8_t channel, uint16_t duty)
+{
+    _pwm_stage(channel, _pwm_duty16_cycles(duty));
+}
+
+void
+HAL_pwm_commit(void)
+{
+    ENTER_CRITICAL_SECTION;
+
+    _committing |= _staged;
+    _staged = 0;
+
+    EXIT_CRITICAL_SECTION;
+
+    _HAL_pwm_overflow_request(_HAL_PWM_OVF_COMMIT);
+}
+
+bool
+HAL_pwm_commit_pending(void)
+{
+    return _committing != 0;
+}
+
+/* apply committed channels; called at the start of a period */
+static void
+_pwm_commit(void)
+{
+    const uint8_t committing = _committing;
+    uint8_t i;
 
-        } else if ((channel_cycles + 25) > pwm_period_cycles) {
-            /* less than 100us off = on */
-            channel_cycles = pwm_period_cycles;
+    _committing = 0;
+
+    /* staged values override any ramp in progress */
+    _ramping &= ~committing;
+
+    for (i = 0; i < _HAL_PWM_CHANNELS; i++) {
+        if (committing & (1 << i)) {
+            _pwm_request(i, _staged_cycles[i]);
         }
     }
+}
+
+void
+HAL_pwm_ramp(uint8_t channel, uint8_t duty, uint16_t time_ms)
+{
+    _pwm_ramp_t *const r = &_ramp[channel];
+    uint16_t start;
+    uint16_t target;
+    int32_t step;
+
+    if (channel >= _HAL_PWM_CHANNELS) {
+        return;
+    }
+
+    ENTER_CRITICAL_SECTION;
+    _ramping &= ~(1 << channel);
+    start = _channel_cycles[channel];
+    target = _pwm_duty_cycles(duty);
+    EXIT_CRITICAL_SECTION;
+
+    if ((time_ms == 0) || (start == target)) {
+        _pwm_request(channel, target);
+        return;
+    }
+
+    /* per-tick step in 1/256 cycles, computed here so the tick doesn't divide */
+    step = (((int32_t)target - (int32_t)start) << 8) / (int32_t)time_ms;
+
+    _HAL_timer_call_register(&_ramp_call);
+
+    ENTER_CRITICAL_SECTION;
+
+    r->position = (int32_t)start << 8;
+    r->step = step;
+    r->target = target;
+    r->remaining_ms = time_ms;
+    _ramping |= (1 << channel);
+
+    /* start ticking */
+    _ramp_call.period_ms = 1;
+
+    if (_ramp_call.delay_ms == 0) {
+        _ramp_call.delay_ms = 1;
+    }
+
+    EXIT_CRITICAL_SECTION;
+}
+
+void
+HAL_pwm_ramp_rate(uint8_t channel, uint8_t duty, uint16_t rate)
+{
+    uint16_t start;
+    uint16_t target;
+    uint32_t delta;
+
+    if ((channel >= _HAL_PWM_CHANNELS) || (rate == 0)) {
+        HAL_pwm_set(channel, duty);
+        return;
+    }
+
+    ENTER_CRITICAL_SECTION;
+    start = _channel_cycles[channel];
+    EXIT_CRITICAL_SECTION;
+
+    target = _pwm_duty_cycles(duty);
+    delta = (target > start) ? (target - start) : (start - target);
+
+    /* ms = (delta / period) * 100% / (rate / 1000ms), via permille to stay in 32 bits */
+    delta = (((delta * 1000UL) / pwm_period_cycles) * 100UL) / rate;
+
+    HAL_pwm_ramp(channel, duty, (delta > 0xffff) ? 0xffff : (uint16_t)delta);
+}
+
+static void
+_pwm_ramp_tick(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < _HAL_PWM_CHANNELS; i++) {
+        if (_ramping & (1 << i)) {
+            _pwm_ramp_t *const r = &_ramp[i];
+
+            if (--r->remaining_ms == 0) {
+                /* land exactly on the target */
+                _ramping &= ~(1 << i);
+                _pwm_request(i, r->target);
+            } else {
+                r->position += r->step;
+                _pwm_request(i, _pwm_clamp((uint16_t)(r->position >> 8)));
+            }
+        }
+    }
+
+    /* stop ticking once all ramps are done */
+    if (_ramping == 0) {
+        _ramp_call.period_ms = 0;
+    }
+}
+
+/* requested cycles for a channel, limited by any cap */
+static uint16_t
+_pwm_effective(uint8_t channel)
+{
+    uint16_t channel_cycles = _channel_cycles[channel];
+
+    if (_channel_cap[channel] < _HAL_PWM_CAP_NONE) {
+        const uint16_t limit = (uint16_t)(((uint32_t)pwm_period_cycles * _channel_cap[channel]) >> 8);
+
+        if (channel_cycles > limit) {
+            /* avoid runt cycles here too */
+            channel_cycles = (limit < _MIN_PULSE_CYCLES) ? 0 : limit;
+        }
+    }
+
+    return channel_cycles;
+}
+
+/* write a channel's mode and value registers, skipping the mode if unchanged */
+static void
+_pwm_write_sc(uint8_t channel, uint8_t sc, uint16_t value)
+{
+    const bool sc_changed = (sc != _channel_sc[channel]);
+
+    _channel_sc[channel] = sc;
 
-    /*
-     * Configure the channel and load the new period.
-     * Note that the hardware manages the period reload to avoid
-     * glitches, so we don't have to.
-     *
-     * Always edge-aligned PWM, high for assigned duty cycle
-     */
     switch (channel) {
     case 0:
-        TPM1C0SC = TPM1C0SC_MS0B_MASK | TPM1C0SC_ELS0B_MASK;
-        TPM1C0V = channel_cycles;
+        if (sc_changed) {
+            TPM1C0SC = sc;
+        }
+        TPM1C0V = value;
         break;
 
     case 1:
-        TPM1C1SC = TPM1C1SC_MS1B_MASK | TPM1C1SC_ELS1B_MASK;
-        TPM1C1V = channel_cycles;
+        if (sc_changed) {
+            TPM1C1SC = sc;
+        }
+        TPM1C1V = value;
         break;
 
     case 2:
-        TPM1C2SC = TPM1C2SC_MS2B_MASK | TPM1C2SC_ELS2B_MASK;
-        TPM1C2V = channel_cycles;
+        if (sc_changed) {
+            TPM1C2SC = sc;
+        }
+        TPM1C2V = value;
         break;
 
     case 3:
-        TPM1C3SC = TPM1C3SC_MS3B_MASK | TPM1C3SC_ELS3B_MASK;
-        TPM1C3V = channel_cycles;
+        if (sc_changed) {
+            TPM1C3SC = sc;
+        }
+        TPM1C3V = value;
         break;
 
     case 4:
-        TPM1C4SC = TPM1C4SC_MS4B_MASK | TPM1C4SC_ELS4B_MASK;
-        TPM1C4V = channel_cycles;
+        if (sc_changed) {
+            TPM1C4SC = sc;
+        }
+        TPM1C4V = value;
         break;
 
     case 5:
-        TPM1C5SC = TPM1C5SC_MS5B_MASK | TPM1C5SC_ELS5B_MASK;
-        TPM1C5V = channel_cycles;
+        if (sc_changed) {
+            TPM1C5SC = sc;
+        }
+        TPM1C5V = value;
         break;
 
     default:
@@ -92,3 +562,548 @@ HAL_pwm_set(uint8_t channel, uint8_t duty)
         break;
     }
 }
+
+/* counts from one point in the period until the counter next reaches another */
+static uint16_t
+_pwm_counts_between(uint16_t from, uint16_t to)
+{
+    /* the counter runs 0..MOD inclusive */
+    if (to < from) {
+        to += pwm_period_cycles + 1;
+    }
+
+    return to - from;
+}
+
+/* compare value at which a staggered channel turns off */
+static uint16_t
+_pwm_stagger_off(uint8_t channel)
+{
+    uint16_t off = _stagger_phase[channel] + _stagger_on[channel];
+
+    /* the counter runs 0..MOD inclusive */
+    if (off > pwm_period_cycles) {
+        off -= pwm_period_cycles + 1;
+    }
+
+    return off;
+}
+
+static void
+_pwm_write(uint8_t channel, uint16_t channel_cycles)
+{
+    const uint8_t mask = 1 << channel;
+
+    if ((channel == _HAL_PWM_CAPTURE_CHANNEL) && _capture) {
+        return;
+    }
+
+    if (_soft_group & mask) {
+        _soft_set(channel, channel_cycles);
+        return;
+    }
+
+    if (!_staggered) {
+        /*
+         * Configure the channel and load the new period.
+         * Note that the hardware manages the period reload to avoid
+         * glitches, so we don't have to.
+         *
+         * Edge-aligned PWM, high for assigned duty cycle
+         */
+        _pwm_write_sc(channel, _SC_EPWM, channel_cycles);
+        return;
+    }
+
+    /*
+     * Staggered mode; the channel is driven by output compares that
+     * set and clear the pin, with the next edge programmed from the
+     * channel interrupt. Steady states don't need the interrupt.
+     */
+    _stagger_on[channel] = channel_cycles;
+
+    if (channel_cycles == 0) {
+        _stagger_active &= ~mask;
+        _stagger_high &= ~mask;
+        _pwm_write_sc(channel, _SC_OC_CLEAR, _stagger_phase[channel]);
+
+    } else if (channel_cycles >= pwm_period_cycles) {
+        _stagger_active &= ~mask;
+        _stagger_high |= mask;
+        _pwm_write_sc(channel, _SC_OC_SET, _stagger_phase[channel]);
+
+    } else if (!(_stagger_active & mask)) {
+        /* start switching from the current steady state */
+        _stagger_active |= mask;
+
+        if (_stagger_high & mask) {
+            _stagger_due[channel] = _pwm_stagger_off(channel);
+            _pwm_write_sc(channel, _SC_OC_CLEAR | _SC_IE, _stagger_due[channel]);
+        } else {
+            _stagger_due[channel] = _stagger_phase[channel];
+            _pwm_write_sc(channel, _SC_OC_SET | _SC_IE, _stagger_due[channel]);
+        }
+    }
+
+    /* otherwise already switching; the new on-time applies from the next turn-on */
+}
+
+/* program the next edge for a staggered channel; called from the compare interrupt */
+static void
+_pwm_stagger_edge(uint8_t channel)
+{
+    const uint8_t mask = 1 << channel;
+    const uint16_t was_due = _stagger_due[channel];
+    uint16_t due;
+    uint16_t now;
+    uint8_t sc;
+
+    if (!(_stagger_active & mask)) {
+        return;
+    }
+
+    if (_stagger_high & mask) {
+        /* just turned off, next turn on at our phase */
+        _stagger_high &= ~mask;
+        sc = _SC_OC_SET | _SC_IE;
+        due = _stagger_phase[channel];
+    } else {
+        /* just turned on */
+        _stagger_high |= mask;
+        sc = _SC_OC_CLEAR | _SC_IE;
+        due = _pwm_stagger_off(channel);
+    }
+
+    _stagger_due[channel] = due;
+    now = TPM1CNT;
+
+    /*
+     * Held off until the next edge is (nearly) due, it would be taken a
+     * period late; take it now instead. The schedule is kept, so the
+     * pulse after this one is shortened by as much as this one stretched.
+     */
+    if ((_pwm_counts_between(was_due, now) + _STAGGER_MARGIN_CYCLES) >=
+        _pwm_counts_between(was_due, due)) {
+        due = now + _STAGGER_MARGIN_CYCLES;
+
+        if (due > pwm_period_cycles) {
+            due -= pwm_period_cycles + 1;
+        }
+    }
+
+    _pwm_write_sc(channel, sc, due);
+}
+
+/* spread channel turn-on points evenly across the period */
+static void
+_pwm_stagger_phases(void)
+{
+    const uint16_t step = (pwm_period_cycles + 1) / _HAL_PWM_CHANNELS;
+    uint16_t phase = 0;
+    uint8_t i;
+
+    for (i = 0; i < _HAL_PWM_CHANNELS; i++) {
+        _stagger_phase[i] = phase;
+        phase += step;
+    }
+}
+
+/*
+ * Software PWM group.
+ *
+ * Duty cycles arrive in TPM1 cycles, like every other channel, and are
+ * scaled to microseconds of the software period. Each change rebuilds
+ * a schedule of turn-off edges sorted by time, which the period alarm
+ * picks up at the start of the next period; the alarms themselves only
+ * walk the schedule.
+ */
+static void
+_soft_schedule(void)
+{
+    uint8_t i;
+    uint8_t j;
+    uint8_t k;
+    uint8_t edges = 0;
+    uint8_t on = 0;
+
+    for (i = 0; i < _HAL_PWM_CHANNELS; i++) {
+        const uint16_t on_us = _soft_on_us[i];
+        const uint8_t pin = (uint8_t)(1 << (i + _SOFT_PIN_SHIFT));
+
+        if (!(_soft_group & (1 << i)) || (on_us == 0)) {
+            continue;
+        }
+
+        on |= pin;
+
+        /* steady on, no edge */
+        if (on_us >= _soft_period_us) {
+            continue;
+        }
+
+        /* insert in time order, sharing an edge with any channel that turns off together */
+        for (j = 0; (j < edges) && (_soft_next[j].off_us < on_us); j++) {
+        }
+
+        if ((j < edges) && (_soft_next[j].off_us == on_us)) {
+            _soft_next[j].pins |= pin;
+
+        } else {
+            for (k = edges; k > j; k--) {
+                _soft_next[k] = _soft_next[k - 1];
+            }
+
+            _soft_next[j].off_us = on_us;
+            _soft_next[j].pins = pin;
+            edges++;
+        }
+    }
+
+    _soft_next_edges = edges;
+    _soft_next_on = on;
+    _soft_pending = true;
+}
+
+/* set a software channel's on-time; must be called with interrupts disabled */
+static void
+_soft_set(uint8_t channel, uint16_t channel_cycles)
+{
+    uint16_t on_us;
+
+    if (channel_cycles >= pwm_period_cycles) {
+        on_us = _soft_period_us;
+
+    } else {
+        /* multiply and shift, no divide */
+        on_us = (uint16_t)(((uint32_t)channel_cycles * _soft_scale) >> 16);
+
+        /* avoid runt pulses at the software period too */
+        if (on_us < _SOFT_MIN_PULSE_US) {
+            on_us = 0;
+
+        } else if ((on_us + _SOFT_MIN_PULSE_US) > _soft_period_us) {
+            on_us = _soft_period_us;
+        }
+    }
+
+    if (on_us != _soft_on_us[channel]) {
+        _soft_on_us[channel] = on_us;
+        _soft_schedule();
+    }
+}
+
+/* recompute the cycle scaling after either period changes */
+static void
+_soft_rescale(void)
+{
+    uint8_t i;
+
+    if (_soft_group == 0) {
+        return;
+    }
+
+    ENTER_CRITICAL_SECTION;
+
+    _soft_scale = ((uint32_t)_soft_period_us << 16) / pwm_period_cycles;
+
+    for (i = 0; i < _HAL_PWM_CHANNELS; i++) {
+        if ((_soft_group & (1 << i)) && (_configured & (1 << i)) && !(_inhibit & (1 << i))) {
+            _soft_set(i, _pwm_effective(i));
+        }
+    }
+
+    EXIT_CRITICAL_SECTION;
+}
+
+/* start of a software period; alarm callback */
+static void
+_soft_period(void)
+{
+    uint8_t i;
+
+    /* schedule from the deadline rather than now, so the period doesn't drift */
+    _soft_start = _soft_period_alarm._when;
+    _HAL_timer_alarm_set_at(&_soft_period_alarm, _soft_start + _soft_period_us);
+
+    if (_soft_pending) {
+        _soft_pending = false;
+        _soft_on = _soft_next_on;
+        _soft_edge_count = _soft_next_edges;
+
+        for (i = 0; i < _soft_edge_count; i++) {
+            _soft_edges[i] = _soft_next[i];
+        }
+    }
+
+    /* turn on, and off any channel that was on but no longer is */
+    PTDD = (uint8_t)((PTDD & ~_soft_pins) | (_soft_on & _soft_pins));
+
+    _soft_edge_index = 0;
+
+    if (_soft_edge_count != 0) {
+        _HAL_timer_alarm_set_at(&_soft_edge_alarm, _soft_start + _soft_edges[0].off_us);
+    }
+}
+
+/* turn-off edge; alarm callback */
+static void
+_soft_edge(void)
+{
+    PTDD &= ~_soft_edges[_soft_edge_index].pins;
+
+    if (++_soft_edge_index < _soft_edge_count) {
+        _HAL_timer_alarm_set_at(&_soft_edge_alarm, _soft_start + _soft_edges[_soft_edge_index].off_us);
+    }
+}
+
+void
+_HAL_pwm_inhibit(uint8_t channel)
+{
+    ENTER_CRITICAL_SECTION;
+
+    _inhibit |= (1 << channel);
+    _stagger_active &= ~(1 << channel);
+    _stagger_high &= ~(1 << channel);
+
+    /*
+     * Disconnect the channel from the pin, which reverts to a GPIO
+     * output driving low. Unlike a CnV update this takes effect
+     * immediately rather than at the end of the current period.
+     */
+    _pwm_write_sc(channel, 0, 0);
+
+    /* a software channel is already GPIO; drive it low now */
+    if (_soft_group & (1 << channel)) {
+        PTDD &= ~(uint8_t)(1 << (channel + _SOFT_PIN_SHIFT));
+        _soft_set(channel, 0);
+    }
+
+    EXIT_CRITICAL_SECTION;
+}
+
+void
+_HAL_pwm_release(uint8_t channel)
+{
+    ENTER_CRITICAL_SECTION;
+
+    if (_inhibit & (1 << channel)) {
+        _inhibit &= ~(1 << channel);
+        _pwm_write(channel, _pwm_effective(channel));
+    }
+
+    EXIT_CRITICAL_SECTION;
+}
+
+void
+_HAL_pwm_set_cap(uint8_t channel, uint16_t cap)
+{
+    ENTER_CRITICAL_SECTION;
+
+    if (_channel_cap[channel] != cap) {
+        _channel_cap[channel] = cap;
+
+        if (!(_inhibit & (1 << channel))) {
+            _pwm_write(channel, _pwm_effective(channel));
+        }
+    }
+
+    EXIT_CRITICAL_SECTION;
+}
+
+void
+_HAL_pwm_set_capture(bool enable)
+{
+    const uint8_t mask = 1 << _HAL_PWM_CAPTURE_CHANNEL;
+
+    ENTER_CRITICAL_SECTION;
+
+    _capture = enable;
+    _configured &= ~mask;
+    _stagger_active &= ~mask;
+    _stagger_high &= ~mask;
+
+    /* capture both edges, or leave the channel disconnected */
+    _pwm_write_sc(_HAL_PWM_CAPTURE_CHANNEL, enable ? (_SC_CAPTURE | _SC_IE) : 0, 0);
+
+    EXIT_CRITICAL_SECTION;
+}
+
+void
+_HAL_pwm_capture_enable(bool enable)
+{
+    ENTER_CRITICAL_SECTION;
+
+    if (_capture) {
+        if (enable) {
+            /* discard any capture taken while we weren't listening */
+#pragma MESSAGE DISABLE C2705
+            TPM1C0SC &= ~TPM1C0SC_CH0F_MASK;
+#pragma MESSAGE DEFAULT C2705
+            _channel_sc[_HAL_PWM_CAPTURE_CHANNEL] = _SC_CAPTURE | _SC_IE;
+        } else {
+            _channel_sc[_HAL_PWM_CAPTURE_CHANNEL] = _SC_CAPTURE;
+        }
+
+        TPM1C0SC = _channel_sc[_HAL_PWM_CAPTURE_CHANNEL];
+    }
+
+    EXIT_CRITICAL_SECTION;
+}
+
+uint16_t
+_HAL_pwm_cycles(uint8_t channel)
+{
+    /* inhibited channels are off regardless of the request */
+    if (_inhibit & (1 << channel)) {
+        return 0;
+    }
+
+    return _pwm_effective(channel);
+}
+
+bool
+_HAL_pwm_is_inhibited(uint8_t channel)
+{
+    return (_inhibit & (1 << channel)) != 0;
+}
+
+bool
+_HAL_pwm_is_soft(uint8_t channel)
+{
+    return (_soft_group & (1 << channel)) != 0;
+}
+
+uint16_t
+_HAL_pwm_phase_cycles(uint8_t channel)
+{
+    return _staggered ? _stagger_phase[channel] : 0;
+}
+
+uint16_t
+_HAL_pwm_duty16(uint8_t channel)
+{
+    /* duty as a fraction of the period; multiply and shift, no divide */
+    return (uint16_t)(((uint32_t)_HAL_pwm_cycles(channel) * _duty16_scale) >> 16);
+}
+
+uint16_t
+_HAL_pwm_period_cycles(void)
+{
+    return pwm_period_cycles;
+}
+
+uint8_t
+_HAL_pwm_period_ms(void)
+{
+    return pwm_period_ms;
+}
+
+void
+_HAL_pwm_overflow_request(uint8_t request)
+{
+    ENTER_CRITICAL_SECTION;
+
+    _overflow_requests |= request;
+
+    if (!TPM1SC_TOIE) {
+        /* discard any stale overflow so that we get the next period start */
+        TPM1SC_TOF = 0;
+        TPM1SC_TOIE = 1;
+    }
+
+    EXIT_CRITICAL_SECTION;
+}
+
+VECTOR_HANDLER void
+__interrupt VECTOR(Vtpm1ovf)
+Vtpm1ovf_handler(void)
+{
+    const uint8_t requests = _overflow_requests;
+
+    TPM1SC_TOF = 0;
+
+    /* requests are one-shot */
+    _overflow_requests = 0;
+    TPM1SC_TOIE = 0;
+
+    /* first, so that the writes land well inside this period */
+    if (requests & _HAL_PWM_OVF_COMMIT) {
+        _pwm_commit();
+    }
+
+    if (requests & _HAL_PWM_OVF_ADC_SYNC) {
+        _HAL_adc_pwm_sync();
+    }
+}
+
+/*
+ * Channel compare interrupts, only enabled in staggered mode; channel 0
+ * may instead be capturing FREQ_IN.
+ */
+VECTOR_HANDLER void
+__interrupt VECTOR(Vtpm1ch0)
+Vtpm1ch0_handler(void)
+{
+    /* read the capture before clearing the flag, so a following edge isn't lost */
+    const uint16_t capture = TPM1C0V;
+
+#pragma MESSAGE DISABLE C2705
+    TPM1C0SC &= ~TPM1C0SC_CH0F_MASK;
+#pragma MESSAGE DEFAULT C2705
+
+    if (_capture) {
+        _HAL_freq_edge(capture);
+    } else {
+        _pwm_stagger_edge(0);
+    }
+}
+
+VECTOR_HANDLER void
+__interrupt VECTOR(Vtpm1ch1)
+Vtpm1ch1_handler(void)
+{
+#pragma MESSAGE DISABLE C2705
+    TPM1C1SC &= ~TPM1C1SC_CH1F_MASK;
+#pragma MESSAGE DEFAULT C2705
+    _pwm_stagger_edge(1);
+}
+
+VECTOR_HANDLER void
+__interrupt VECTOR(Vtpm1ch2)
+Vtpm1ch2_handler(void)
+{
+#pragma MESSAGE DISABLE C2705
+    TPM1C2SC &= ~TPM1C2SC_CH2F_MASK;
+#pragma MESSAGE DEFAULT C2705
+    _pwm_stagger_edge(2);
+}
+
+VECTOR_HANDLER void
+__interrupt VECTOR(Vtpm1ch3)
+Vtpm1ch3_handler(void)
+{
+#pragma MESSAGE DISABLE C2705
+    TPM1C3SC &= ~TPM1C3SC_CH3F_MASK;
+#pragma MESSAGE DEFAULT C2705
+    _pwm_stagger_edge(3);
+}
+
+VECTOR_HANDLER void
+__interrupt VECTOR(Vtpm1ch4)
+Vtpm1ch4_handler(void)
+{
+#pragma MESSAGE DISABLE C2705
+    TPM1C4SC &= ~TPM1C4SC_CH4F_MASK;
+#pragma MESSAGE DEFAULT C2705
+    _pwm_stagger_edge(4);
+}
+
+VECTOR_HANDLER void
+__interrupt VECTOR(Vtpm1ch5)
+Vtpm1ch5_handler(void)
+{
+#pragma MESSAGE DISABLE C2705
+    TPM1C5SC &= ~TPM1C5SC_CH5F_MASK;
+#pragma MESSAGE DEFAULT C2705
+    _pwm_stagger_edge(5);
+}
@@ -7,9 +7,15 @@
 
 #define _TIMER_LIST_END      (HAL_timer_t *)4
 #define _TIMER_CALL_LIST_END (HAL_timer_call_t *)8
+#define _ALARM_LIST_END      (_HAL_timer_alarm_t *)12
+
+/* a tick deadline closer than this is treated as passed */
+#define _TICK_MARGIN_US      20
 
 static HAL_timer_t      *_timer_list = _TIMER_LIST_END;
 static HAL_timer_call_t *_timer_call_list = _TIMER_CALL_LIST_END;
+static _HAL_timer_alarm_t *_alarm_list = _ALARM_LIST_END;
+static bool _alarm_running;
 static volatile uint16_t _timebase_high_word;
 
 void
@@ -24,8 +30,11 @@ _HAL_timer_init(void)
 
     TPM2C1SC = 0;
     TPM2C1SC_MS1A = 1;  /* output compare */
-    TPM2C0V = 1000;     /* set initial deadline */
+    TPM2C1V = 1000;     /* set initial deadline */
     TPM2C1SC_CH1IE = 1; /* enable interrupt */
+
+    TPM2C0SC = 0;
+    TPM2C0SC_MS0A = 1;  /* output compare, interrupt enabled when alarms are set */
 }
 
 HAL_microseconds
@@ -54,6 +63,22 @@ HAL_timer_us(void)
     return tv;
 }
 
+HAL_microseconds
+_HAL_timer_us_isr(void)
+{
+    uint16_t        high = _timebase_high_word;
+    uint16_t        low = TPM2CNT;
+
+    /*
+     * The overflow handler can't run while we are in interrupt context,
+     * so account for a pending overflow here rather than waiting for it.
+     */
+    if ((TPM2SC & TPM2SC_TOF_MASK) && (low < 0x8000U)) {
+        high++;
+    }
+
+    return ((uint32_t)high << 16) + low;
+}
 
 bool
 HAL_timer_elapsed_us(HAL_microseconds since_us, uint16_t interval_us)
@@ -70,8 +95,8 @@ HAL_timer_wait_us(uint16_t delay_us)
     }
 }
 
-static void
-__interrupt VectorNumber_Vtpm2ovf
+VECTOR_HANDLER void
+__interrupt VECTOR(Vtpm2ovf)
 Vtpm2ovf_handler(void)
 {
     _timebase_high_word++;
@@ -112,8 +137,133 @@ _HAL_timer_call_register(HAL_timer_call_t *call)
     EXIT_CRITICAL_SECTION;
 }
 
+/*
+ * Run any alarms that are due and program the compare for the next one.
+ * Must be called with interrupts disabled.
+ */
 static void
-__interrupt VectorNumber_Vtpm2ch1
+_alarm_update(void)
+{
+    _HAL_timer_alarm_t *a;
+
+    _alarm_running = true;
+
+    while ((a = _alarm_list) != _ALARM_LIST_END) {
+        /* not due yet? */
+        if ((int16_t)(a->_when - TPM2CNT) > 0) {
+            TPM2C0V = a->_when;
+
+            /* re-check in case the counter passed the deadline while we programmed it */
+            if ((int16_t)(a->_when - TPM2CNT) > 0) {
+                TPM2C0SC_CH0IE = 1;
+                _alarm_running = false;
+                return;
+            }
+        }
+
+        /* unlink and fire */
+        _alarm_list = a->_next;
+        a->_next = NULL;
+        a->callback();
+    }
+
+    TPM2C0SC_CH0IE = 0;
+    _alarm_running = false;
+}
+
+/* insert an alarm for an absolute deadline; must be called with interrupts disabled */
+static void
+_alarm_insert(_HAL_timer_alarm_t *alarm, uint16_t when)
+{
+    _HAL_timer_alarm_t **pp;
+    const uint16_t now = TPM2CNT;
+    uint16_t delay_us;
+
+    /* deadline already passed, make it due now */
+    if ((int16_t)(when - now) < 0) {
+        when = now;
+    }
+
+    alarm->_when = when;
+    delay_us = when - now;
+
+    /* sorted insertion, relative to now so that counter wrap is harmless */
+    for (pp = &_alarm_list;
+         (*pp != _ALARM_LIST_END) && ((uint16_t)((*pp)->_when - now) <= delay_us);
+         pp = &(*pp)->_next) {
+    }
+
+    alarm->_next = *pp;
+    *pp = alarm;
+
+    /* an alarm re-armed from its callback is picked up by the running update */
+    if (!_alarm_running) {
+        _alarm_update();
+    }
+}
+
+void
+_HAL_timer_alarm_set(_HAL_timer_alarm_t *alarm, uint16_t delay_us)
+{
+    ENTER_CRITICAL_SECTION;
+
+    REQUIRE(alarm != NULL);
+    REQUIRE(alarm->callback != NULL);
+    REQUIRE(delay_us < 0x8000U);
+
+    _HAL_timer_alarm_cancel(alarm);
+    _alarm_insert(alarm, TPM2CNT + delay_us);
+
+    EXIT_CRITICAL_SECTION;
+}
+
+void
+_HAL_timer_alarm_set_at(_HAL_timer_alarm_t *alarm, uint16_t when)
+{
+    ENTER_CRITICAL_SECTION;
+
+    REQUIRE(alarm != NULL);
+    REQUIRE(alarm->callback != NULL);
+
+    _HAL_timer_alarm_cancel(alarm);
+    _alarm_insert(alarm, when);
+
+    EXIT_CRITICAL_SECTION;
+}
+
+void
+_HAL_timer_alarm_cancel(_HAL_timer_alarm_t *alarm)
+{
+    _HAL_timer_alarm_t **pp;
+
+    ENTER_CRITICAL_SECTION;
+
+    if (_timer_registered(*alarm)) {
+        for (pp = &_alarm_list; *pp != _ALARM_LIST_END; pp = &(*pp)->_next) {
+            if (*pp == alarm) {
+                *pp = alarm->_next;
+                break;
+            }
+        }
+
+        alarm->_next = NULL;
+    }
+
+    EXIT_CRITICAL_SECTION;
+}
+
+VECTOR_HANDLER void
+__interrupt VECTOR(Vtpm2ch0)
+Vtpm2ch0_handler(void)
+{
+#pragma MESSAGE DISABLE C2705
+    TPM2C0SC &= ~TPM2C0SC_CH0F_MASK;
+#pragma MESSAGE DEFAULT C2705
+    _alarm_update();
+}
+
+VECTOR_HANDLER void
+__interrupt VECTOR(Vtpm2ch1)
 Vtpm2ch1_handler(void)
 {
     HAL_timer_t *t;
@@ -126,6 +276,16 @@ Vtpm2ch1_handler(void)
     /* must update TPM2C1V *after* clearing the interrupt */
     TPM2C1V += 1000;
 
+    /*
+     * If interrupts were held off past the next deadline too (e.g. while
+     * erasing flash) the counter won't meet it again until TPM2 wraps,
+     * stopping the tick for up to 65ms; restart from now instead. Timers
+     * lose the time interrupts were off.
+     */
+    if ((int16_t)(TPM2CNT - TPM2C1V) > -_TICK_MARGIN_US) {
+        TPM2C1V = TPM2CNT + 1000;
+    }
+
     /* update timers */
     for (t = _timer_list;
          t != _TIMER_LIST_END;
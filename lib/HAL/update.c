@@ -0,0 +1,212 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <mc9s08dz60.h>
+#include <lib.h>
+#include <HAL/_eeprom.h>
+#include <HAL/_update.h>
+
+#ifdef HAL_UPDATE_ENABLE
+
+/* reads of the flash; the host test puts a flash model behind them */
+#ifndef _UPDATE_READ
+# define _UPDATE_READ(_address)             ((const volatile uint8_t *)(_address))
+#endif
+
+#define _CMD_BYTE_PROG      0x20
+#define _CMD_SECTOR_ERASE   0x40
+
+#define _OPCODE_JMP         0xcc    /* every image starts with jmp _Startup */
+
+/* image being received */
+static struct {
+    bool        receiving;
+    bool        failed;
+    uint8_t     erased;         /* staging sectors erased */
+    uint16_t    length;
+    uint16_t    crc;
+} _rx;
+
+static bool
+_update_blank(uint16_t address)
+{
+    uint16_t i;
+
+    for (i = 0; i < _HAL_UPDATE_SECTOR_SIZE; i++) {
+        if (*_UPDATE_READ(address + i) != 0xff) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void
+_update_set_state(HAL_update_state_t state)
+{
+    _HAL_update_journal_t j;
+    uint8_t copy;
+
+    (void)_HAL_update_journal_read(&j, &copy);
+    j.state = state;
+    j.sector = 0;
+    j.step = 0;
+    j.boots = 0;
+    _HAL_update_journal_write(&j);
+}
+
+bool
+_HAL_update_begin(uint16_t length, uint16_t crc, uint16_t resident_crc)
+{
+    const HAL_update_state_t state = HAL_update_state();
+
+    _rx.receiving = false;
+
+    /* the staging area holds the old image until a trial is confirmed */
+    if ((length < 3) ||
+        (length > HAL_UPDATE_IMAGE_SIZE) ||
+        (state == HAL_UPDATE_TRIAL) ||
+        (resident_crc != crc16(0xffff, (const uint8_t *)_UPDATE_READ(_HAL_UPDATE_RESIDENT), _HAL_UPDATE_RESIDENT_SIZE))) {
+        return false;
+    }
+
+    /* anything staged is about to be erased */
+    if (state != HAL_UPDATE_NONE) {
+        _update_set_state(HAL_UPDATE_NONE);
+    }
+
+    _rx.receiving = true;
+    _rx.failed = false;
+    _rx.erased = 0;
+    _rx.length = length;
+    _rx.crc = crc;
+    return true;
+}
+
+bool
+_HAL_update_erase_next(void)
+{
+    if (_rx.receiving && (_rx.erased < _HAL_UPDATE_SECTORS)) {
+        const uint16_t address = _HAL_UPDATE_STAGE + (_rx.erased * _HAL_UPDATE_SECTOR_SIZE);
+
+        /* an erase stops everything for ~20ms, so skip it if we can */
+        if (!_update_blank(address) && !_HAL_update_flash(address, 0, _CMD_SECTOR_ERASE)) {
+            _rx.failed = true;
+        }
+
+        _rx.erased++;
+    }
+
+    return !_rx.receiving || (_rx.erased == _HAL_UPDATE_SECTORS);
+}
+
+bool
+_HAL_update_ready(void)
+{
+    return _rx.receiving && !_rx.failed && (_rx.erased == _HAL_UPDATE_SECTORS);
+}
+
+bool
+_HAL_update_write(uint16_t offset, uint8_t len, const uint8_t *data)
+{
+    uint8_t i;
+
+    if (!_HAL_update_ready() ||
+        (len > _rx.length) ||
+        (offset > (_rx.length - len))) {
+        return false;
+    }
+
+    for (i = 0; i < len; i++) {
+        const uint16_t address = _HAL_UPDATE_STAGE + offset + i;
+        const uint8_t current = *_UPDATE_READ(address);
+
+        /* a resend is fine, but a byte can't be changed without an erase */
+        if (current == data[i]) {
+            continue;
+        }
+
+        if ((current != 0xff) || !_HAL_update_flash(address, data[i], _CMD_BYTE_PROG)) {
+            _rx.failed = true;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool
+_HAL_update_finish(void)
+{
+    const uint8_t *image = (const uint8_t *)_UPDATE_READ(_HAL_UPDATE_STAGE);
+    uint16_t crc = 0xffff;
+    uint16_t done;
+
+    if (!_HAL_update_ready() || (image[0] != _OPCODE_JMP)) {
+        return false;
+    }
+
+    /* a sector at a time, so the watchdog doesn't notice */
+    for (done = 0; done < _rx.length; done += _HAL_UPDATE_SECTOR_SIZE) {
+        const uint16_t len = ((_rx.length - done) < _HAL_UPDATE_SECTOR_SIZE) ? (_rx.length - done) : _HAL_UPDATE_SECTOR_SIZE;
+
+        __RESET_WATCHDOG();
+        crc = crc16(crc, image + done, len);
+    }
+
+    if (crc != _rx.crc) {
+        return false;
+    }
+
+    _update_set_state(HAL_UPDATE_STAGED);
+    _rx.receiving = false;
+    return true;
+}
+
+bool
+_HAL_update_activate(void)
+{
+    if (HAL_update_state() != HAL_UPDATE_STAGED) {
+        return false;
+    }
+
+    /* the caller resets next */
+    HAL_eeprom_flush();
+    return true;
+}
+
+HAL_update_state_t
+HAL_update_state(void)
+{
+    _HAL_update_journal_t j;
+    uint8_t copy;
+
+    /* the swap states are only ever seen by the resident code */
+    if (!_HAL_update_journal_read(&j, &copy) || (j.state > HAL_UPDATE_ROLLED_BACK)) {
+        return HAL_UPDATE_NONE;
+    }
+
+    return (HAL_update_state_t)j.state;
+}
+
+void
+HAL_update_confirm(void)
+{
+    if (HAL_update_state() == HAL_UPDATE_TRIAL) {
+        _update_set_state(HAL_UPDATE_CONFIRMED);
+    }
+}
+
+#else
+
+HAL_update_state_t
+HAL_update_state(void)
+{
+    return HAL_UPDATE_NONE;
+}
+
+void
+HAL_update_confirm(void)
+{
+}
+
+#endif
@@ -0,0 +1,346 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <mc9s08dz60.h>
+#include <lib.h>
+#include <HAL/_eeprom.h>
+#include <HAL/_update.h>
+
+#ifdef HAL_UPDATE_ENABLE
+
+#define _EEPROM_BASE        0x1400U
+#define _EEPROM_BANK_SIZE   (HAL_EEPROM_SIZE / 2)
+
+/*
+ * Reads of the memory map, the address latch of a command (a write to
+ * the array), and running the launch code copied to the stack; the
+ * host test puts a flash model behind them.
+ */
+#ifndef _UPDATE_READ
+# define _UPDATE_READ(_address)             ((const volatile uint8_t *)(_address))
+# define _UPDATE_LATCH(_address, _value)    (*(volatile uint8_t *)(_address) = (_value))
+# define _UPDATE_RUN(_code)                 ((void (*)(void))(_code))()
+#endif
+
+#define _CMD_BYTE_PROG      0x20
+#define _CMD_SECTOR_ERASE   0x40
+#define _FLASH_ERRORS       (FSTAT_FPVIOL_MASK | FSTAT_FACCERR_MASK)
+
+#define _TRIAL_BOOTS        1       /* boots allowed before HAL_update_confirm() */
+
+/* journal states beyond HAL_update_state_t: swaps in progress */
+#define _STATE_SWAP         0x10    /* swapping in the staged image */
+#define _STATE_ROLLBACK     0x11    /* swapping the old image back */
+
+/* copies in the swap of one sector */
+#define _STEP_SAVE          0       /* active to spare */
+#define _STEP_INSTALL       1       /* staging to active */
+#define _STEP_KEEP          2       /* spare to staging */
+#define _STEPS              3
+
+#define _JOURNAL_SIZE       8
+#define _CHECK_LEN          offsetof(_HAL_update_journal_t, check)
+
+/*
+ * Resident code.
+ *
+ * This whole file runs while the active image is being rewritten, so
+ * it must not call anything outside it: no lib.c, no REQUIRE(), no
+ * memcpy(), and nothing that the compiler might turn into a runtime
+ * library call (multiplies, struct copies). It must not use static RAM
+ * either, since the image that owns the RAM layout changes. The host
+ * tests check its object for outside references.
+ */
+#pragma CODE_SEG HAL_UPDATE
+#pragma CONST_SEG HAL_UPDATE_CONST
+
+/*
+ * Launch the flash command that has been set up and wait for it. The
+ * flash can't be read while a command runs, so this is copied to the
+ * stack and run there; the FSTAT addresses are filled in by the copy.
+ */
+static const uint8_t _launch[] = {
+    0xa6, FSTAT_FCBEF_MASK,     /* lda  #FCBEF */
+    0xc7, 0x00, 0x00,           /* sta  FSTAT */
+    0x9d,                       /* nop; FCCF is valid 4 cycles after launch */
+    0xc6, 0x00, 0x00,           /* lda  FSTAT */
+    0xa5, FSTAT_FCCF_MASK,      /* bit  #FCCF */
+    0x27, 0xf9,                 /* beq  lda */
+    0x81                        /* rts */
+};
+
+#define _LAUNCH_STA_FSTAT   3
+#define _LAUNCH_LDA_FSTAT   7
+
+#pragma NO_EXIT
+#pragma NO_RETURN
+#pragma NO_FRAME
+static void
+_update_reset(void)
+{
+    /* as HAL_reset(), which isn't resident */
+    __asm DCW 0x9e00;
+}
+
+static uint16_t
+_update_crc(const _HAL_update_journal_t *j)
+{
+    const uint8_t *data = (const uint8_t *)j;
+    uint16_t crc = 0xffff;
+    uint8_t len = _CHECK_LEN;
+
+    /* as crc16() */
+    while (len--) {
+        uint8_t i;
+
+        crc ^= (uint16_t)*data++ << 8;
+
+        for (i = 0; i < 8; i++) {
+            if (crc & 0x8000) {
+                crc = (crc << 1) ^ 0x1021;
+            } else {
+                crc <<= 1;
+            }
+        }
+    }
+
+    return crc;
+}
+
+/* run a command on the flash array, from the stack */
+bool
+_HAL_update_flash(uint16_t address, uint8_t value, uint8_t command)
+{
+    uint8_t code[sizeof(_launch)];
+    const uint16_t fstat = (uint16_t)&FSTAT;
+    uint8_t i;
+
+    for (i = 0; i < sizeof(code); i++) {
+        code[i] = _launch[i];
+    }
+
+    code[_LAUNCH_STA_FSTAT] = fstat >> 8;
+    code[_LAUNCH_STA_FSTAT + 1] = fstat & 0xff;
+    code[_LAUNCH_LDA_FSTAT] = fstat >> 8;
+    code[_LAUNCH_LDA_FSTAT + 1] = fstat & 0xff;
+
+    /* the write-behind engine may have an EEPROM command running */
+    while (FSTAT_FCCF == 0) {
+    }
+
+    FSTAT = _FLASH_ERRORS;
+
+    /* no interrupt handler can run while the flash is busy */
+    ENTER_CRITICAL_SECTION;
+    _UPDATE_LATCH(address, value);
+    FCMD = command;
+    _UPDATE_RUN(&code[0]);
+    EXIT_CRITICAL_SECTION;
+
+    return (FSTAT & _FLASH_ERRORS) == 0;
+}
+
+/* run a command on the EEPROM; unlike the flash, it can be waited for from here */
+static bool
+_update_eeprom(uint16_t offset, uint8_t value, uint8_t command)
+{
+    while (FSTAT_FCCF == 0) {
+    }
+
+    FSTAT = _FLASH_ERRORS;
+    FCNFG_EPGSEL = (offset < _EEPROM_BANK_SIZE) ? 0 : 1;
+
+    ENTER_CRITICAL_SECTION;
+    _UPDATE_LATCH(_EEPROM_BASE + (offset % _EEPROM_BANK_SIZE), value);
+    FCMD = command;
+    FSTAT_FCBEF = 1;
+    EXIT_CRITICAL_SECTION;
+
+    while (FSTAT_FCCF == 0) {
+        __RESET_WATCHDOG();
+    }
+
+    return (FSTAT & _FLASH_ERRORS) == 0;
+}
+
+static bool
+_journal_read_copy(uint8_t copy, _HAL_update_journal_t *j)
+{
+    const uint16_t offset = _HAL_EEPROM_UPDATE + (copy ? _JOURNAL_SIZE : 0);
+    const volatile uint8_t *src;
+    uint8_t *dst = (uint8_t *)j;
+    uint8_t i;
+
+    /* the array can't be read, nor the page changed, while a command is running */
+    while (FSTAT_FCCF == 0) {
+    }
+
+    FCNFG_EPGSEL = (offset < _EEPROM_BANK_SIZE) ? 0 : 1;
+    src = _UPDATE_READ(_EEPROM_BASE + (offset % _EEPROM_BANK_SIZE));
+
+    for (i = 0; i < _JOURNAL_SIZE; i++) {
+        dst[i] = src[i];
+    }
+
+    return j->check == _update_crc(j);
+}
+
+/* read the current journal, returning the copy it's in */
+bool
+_HAL_update_journal_read(_HAL_update_journal_t *j, uint8_t *copy)
+{
+    _HAL_update_journal_t other;
+    const bool first_valid = _journal_read_copy(0, j);
+    const bool second_valid = _journal_read_copy(1, &other);
+
+    *copy = 0;
+
+    if (second_valid &&
+        (!first_valid || ((int8_t)(other.sequence - j->sequence) > 0))) {
+        *copy = 1;
+        return _journal_read_copy(1, j);
+    }
+
+    return first_valid;
+}
+
+/* write the journal over the older copy, so a torn write leaves the current one */
+void
+_HAL_update_journal_write(_HAL_update_journal_t *j)
+{
+    _HAL_update_journal_t current;
+    uint8_t copy;
+    uint16_t offset = _HAL_EEPROM_UPDATE;
+    const uint8_t *src = (const uint8_t *)j;
+    uint8_t i;
+
+    if (_HAL_update_journal_read(&current, &copy)) {
+        j->sequence = current.sequence + 1;
+
+        if (copy == 0) {
+            offset += _JOURNAL_SIZE;
+        }
+    } else {
+        j->sequence = 0;
+    }
+
+    j->_reserved = 0xff;
+    j->check = _update_crc(j);
+
+    (void)_update_eeprom(offset, 0, _CMD_SECTOR_ERASE);
+
+    for (i = 0; i < _JOURNAL_SIZE; i++) {
+        if (src[i] != 0xff) {
+            (void)_update_eeprom(offset + i, src[i], _CMD_BYTE_PROG);
+        }
+    }
+}
+
+/* erase a flash sector and copy another into it */
+static bool
+_update_copy(uint16_t to, uint16_t from)
+{
+    uint16_t i;
+
+    if (!_HAL_update_flash(to, 0, _CMD_SECTOR_ERASE)) {
+        return false;
+    }
+
+    for (i = 0; i < _HAL_UPDATE_SECTOR_SIZE; i++) {
+        const uint8_t value = *_UPDATE_READ(from + i);
+
+        __RESET_WATCHDOG();
+
+        if ((value != 0xff) && !_HAL_update_flash(to + i, value, _CMD_BYTE_PROG)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* one copy of a sector swap; each depends only on sectors it doesn't write */
+static bool
+_update_swap_step(uint8_t sector, uint8_t step)
+{
+    uint16_t offset = 0;
+    uint8_t i;
+
+    for (i = 0; i < sector; i++) {
+        offset += _HAL_UPDATE_SECTOR_SIZE;
+    }
+
+    if (step == _STEP_SAVE) {
+        return _update_copy(_HAL_UPDATE_SPARE, _HAL_UPDATE_ACTIVE + offset);
+    }
+
+    if (step == _STEP_INSTALL) {
+        return _update_copy(_HAL_UPDATE_ACTIVE + offset, _HAL_UPDATE_STAGE + offset);
+    }
+
+    return _update_copy(_HAL_UPDATE_STAGE + offset, _HAL_UPDATE_SPARE);
+}
+
+/*
+ * Called from __start, before the startup code, with interrupts
+ * disabled and the stack wherever the reset left it.
+ */
+void
+_HAL_update_boot(void)
+{
+    _HAL_update_journal_t j;
+    uint8_t copy;
+
+    if (!_HAL_update_journal_read(&j, &copy)) {
+        return;
+    }
+
+    if (j.state == HAL_UPDATE_STAGED) {
+        j.state = _STATE_SWAP;
+        j.sector = 0;
+        j.step = 0;
+        _HAL_update_journal_write(&j);
+
+    } else if (j.state == HAL_UPDATE_TRIAL) {
+        if (j.boots < _TRIAL_BOOTS) {
+            j.boots++;
+            _HAL_update_journal_write(&j);
+            return;
+        }
+
+        /* never confirmed; swap the old image back */
+        j.state = _STATE_ROLLBACK;
+        j.sector = 0;
+        j.step = 0;
+        _HAL_update_journal_write(&j);
+
+    } else if ((j.state != _STATE_SWAP) && (j.state != _STATE_ROLLBACK)) {
+        return;
+    }
+
+    /* the journal names the copy about to run, so a reset repeats it */
+    while (j.sector < _HAL_UPDATE_SECTORS) {
+        if (!_update_swap_step(j.sector, j.step)) {
+            _update_reset();
+        }
+
+        if (++j.step == _STEPS) {
+            j.step = 0;
+            j.sector++;
+        }
+
+        _HAL_update_journal_write(&j);
+    }
+
+    j.state = (j.state == _STATE_SWAP) ? HAL_UPDATE_TRIAL : HAL_UPDATE_ROLLED_BACK;
+    j.boots = 0;
+    _HAL_update_journal_write(&j);
+
+    /* the image we were called from is gone */
+    _update_reset();
+}
+
+#pragma CONST_SEG DEFAULT
+#pragma CODE_SEG DEFAULT
+
+#endif
@@ -2,6 +2,7 @@
 #include <mc9s08dz60.h>
 #include <lib.h>
 #include <HAL/_can.h>
+#include <HAL/_crash.h>
 
 void
 print(const char *format, ...)
@@ -43,14 +44,66 @@ hexdump(uint8_t *addr, unsigned int count)
     }
 }
 
+uint16_t
+crc16(uint16_t crc, const uint8_t *data, uint16_t len)
+{
+    while (len--) {
+        uint8_t i;
+
+        crc ^= (uint16_t)*data++ << 8;
+
+        for (i = 0; i < 8; i++) {
+            if (crc & 0x8000) {
+                crc = (crc << 1) ^ 0x1021;
+            } else {
+                crc <<= 1;
+            }
+        }
+    }
+
+    return crc;
+}
+
+/* __require_abort()'s arguments and stack pointer, captured on entry */
+static uint16_t _abort_line;
+static uint16_t _abort_sp;
+
+static void
+_require_abort(void)
+{
+    /* the return address, then file as the caller pushed it */
+    const uint8_t *const frame = (const uint8_t *)_abort_sp;
+    const char *const file = *(const char *const *)(frame + 2);
+
+    /* capture first, it doesn't need CAN; the caller's SP was just above file */
+    _HAL_crash_capture(file, _abort_line, *(const uint16_t *)frame, _abort_sp + 3);
+
+    print("ABORT: %s:%d", file, (int)_abort_line);
+
+    for (;;);
+}
+
+/*
+ * Assumes the CodeWarrior HCS08 calling convention: the caller pushes
+ * file, passes line (the last argument) in H:X, and JSRs here. With no
+ * entry code, TSX then gives the address of the return address, with
+ * file above it, whatever frame the compiler would otherwise have built.
+ */
+#pragma NO_ENTRY
+#pragma NO_EXIT
+#pragma NO_FRAME
+#pragma NO_RETURN
 void
 __require_abort(const char *file, int line)
 {
+    (void)file;
+    (void)line;
+
     /* turn off interrupts, we are dead here */
     __asm SEI;
-
-    print("ABORT: %s:%d", file, line);
-
-    for (;;);
+    __asm STHX _abort_line;
+    __asm TSX;
+    __asm STHX _abort_sp;
+    __asm JMP _require_abort;
 }
 
@@ -9,13 +9,176 @@
 #include <mc9s08dz60.h>
 #include <app.h>
 #include <pt.h>
+#include <HAL/_bootrom.h>
 #include <HAL/_can.h>
+#include <HAL/_eeprom.h>
+#include <HAL/_kv.h>
+#include <HAL/_log.h>
+#include <HAL/_update.h>
 
 /*
  * Startup trampoline.
+ *
+ * With firmware update enabled, the reset vector lands in the resident
+ * code, which finishes any update swap (see _update.h) and then enters
+ * the active image through the jump at its start, so that neither the
+ * vector nor the resident code depends on where _Startup is linked.
  */
 extern void _Startup(void);     /* from start08.c in MCU library code */
 
+#ifdef HAL_UPDATE_ENABLE
+#pragma CODE_SEG HAL_UPDATE_ENTRY
+#pragma NO_FRAME
+#pragma NO_EXIT
+static void
+_image_entry(void)
+{
+    __asm   jmp _Startup;
+}
+
+/*
+ * Vector trampolines.
+ *
+ * The vectors are patched into the MRS ROM's jump table by the flash
+ * tool and are never updated, so they point here, at fixed addresses
+ * just after _image_entry, and each one jumps on to its handler
+ * wherever this image linked it. The table ends with the default
+ * vector. Every image must have the same table, so changing it, like
+ * changing the resident code, needs the MRS flash tool.
+ */
+extern void __interrupt Vtpm1ovf_handler(void);
+extern void __interrupt Vtpm1ch0_handler(void);
+extern void __interrupt Vtpm1ch1_handler(void);
+extern void __interrupt Vtpm1ch2_handler(void);
+extern void __interrupt Vtpm1ch3_handler(void);
+extern void __interrupt Vtpm1ch4_handler(void);
+extern void __interrupt Vtpm1ch5_handler(void);
+extern void __interrupt Vtpm2ovf_handler(void);
+extern void __interrupt Vtpm2ch0_handler(void);
+extern void __interrupt Vtpm2ch1_handler(void);
+extern void __interrupt Vcanrx_handler(void);
+
+#pragma NO_ENTRY
+#pragma NO_EXIT
+#pragma NO_FRAME
+static void
+__interrupt VectorNumber_Vtpm1ovf
+_Vtpm1ovf_vector(void)
+{
+    __asm   jmp Vtpm1ovf_handler;
+}
+
+#pragma NO_ENTRY
+#pragma NO_EXIT
+#pragma NO_FRAME
+static void
+__interrupt VectorNumber_Vtpm1ch0
+_Vtpm1ch0_vector(void)
+{
+    __asm   jmp Vtpm1ch0_handler;
+}
+
+#pragma NO_ENTRY
+#pragma NO_EXIT
+#pragma NO_FRAME
+static void
+__interrupt VectorNumber_Vtpm1ch1
+_Vtpm1ch1_vector(void)
+{
+    __asm   jmp Vtpm1ch1_handler;
+}
+
+#pragma NO_ENTRY
+#pragma NO_EXIT
+#pragma NO_FRAME
+static void
+__interrupt VectorNumber_Vtpm1ch2
+_Vtpm1ch2_vector(void)
+{
+    __asm   jmp Vtpm1ch2_handler;
+}
+
+#pragma NO_ENTRY
+#pragma NO_EXIT
+#pragma NO_FRAME
+static void
+__interrupt VectorNumber_Vtpm1ch3
+_Vtpm1ch3_vector(void)
+{
+    __asm   jmp Vtpm1ch3_handler;
+}
+
+#pragma NO_ENTRY
+#pragma NO_EXIT
+#pragma NO_FRAME
+static void
+__interrupt VectorNumber_Vtpm1ch4
+_Vtpm1ch4_vector(void)
+{
+    __asm   jmp Vtpm1ch4_handler;
+}
+
+#pragma NO_ENTRY
+#pragma NO_EXIT
+#pragma NO_FRAME
+static void
+__interrupt VectorNumber_Vtpm1ch5
+_Vtpm1ch5_vector(void)
+{
+    __asm   jmp Vtpm1ch5_handler;
+}
+
+#pragma NO_ENTRY
+#pragma NO_EXIT
+#pragma NO_FRAME
+static void
+__interrupt VectorNumber_Vtpm2ovf
+_Vtpm2ovf_vector(void)
+{
+    __asm   jmp Vtpm2ovf_handler;
+}
+
+#pragma NO_ENTRY
+#pragma NO_EXIT
+#pragma NO_FRAME
+static void
+__interrupt VectorNumber_Vtpm2ch0
+_Vtpm2ch0_vector(void)
+{
+    __asm   jmp Vtpm2ch0_handler;
+}
+
+#pragma NO_ENTRY
+#pragma NO_EXIT
+#pragma NO_FRAME
+static void
+__interrupt VectorNumber_Vtpm2ch1
+_Vtpm2ch1_vector(void)
+{
+    __asm   jmp Vtpm2ch1_handler;
+}
+
+#pragma NO_ENTRY
+#pragma NO_EXIT
+#pragma NO_FRAME
+static void
+__interrupt VectorNumber_Vcanrx
+_Vcanrx_vector(void)
+{
+    __asm   jmp Vcanrx_handler;
+}
+
+#pragma CODE_SEG HAL_UPDATE
+#pragma NO_FRAME
+#pragma NO_EXIT
+void
+__interrupt VectorNumber_Vreset
+__start(void)
+{
+    _HAL_update_boot();
+    __asm   jmp _image_entry;
+}
+#else
 #pragma CODE_SEG .init
 #pragma NO_FRAME
 #pragma NO_EXIT
@@ -25,13 +188,19 @@ __start(void)
 {
     __asm   jmp _Startup;
 }
+#endif
 
 /*
  * Supply a 'default' vector for the s-record patcher.
  * It will patch this value into any jump table slot that doesn't have
- * a vector explicitly set.
+ * a vector explicitly set. With firmware update enabled it ends the
+ * trampoline table, so that it doesn't move either.
  */
+#ifdef HAL_UPDATE_ENABLE
+#pragma CODE_SEG HAL_UPDATE_ENTRY
+#else
 #pragma CODE_SEG DEFAULT
+#endif
 static void
 __interrupt 32
 __default_vector(void)
@@ -52,8 +221,18 @@ main(void)
     for (;;) {
         __RESET_WATCHDOG();
 
-        /* run the CAN listener thread */
+        /* run the CAN listener thread, send bootrom scan responses and stream reads, prepare updates */
         PT_RUN(_HAL_can_listen);
+        PT_RUN(_HAL_bootrom_scan);
+        PT_RUN(_HAL_bootrom_stream);
+#ifdef HAL_UPDATE_ENABLE
+        PT_RUN(_HAL_bootrom_update);
+#endif
+
+        /* program any queued EEPROM writes, compact the key/value store and write the log */
+        PT_RUN(_HAL_eeprom_service);
+        PT_RUN(_HAL_kv_service);
+        PT_RUN(_HAL_log_service);
 
         /* run app thread(s) */
         PT_RUN(app_main);
@@ -0,0 +1,43 @@
+/*
+ * Host test support.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "host.h"
+
+#define REG8(_r)    volatile uint8_t _r;
+#define REG16(_r)   volatile uint16_t _r;
+#include "registers.h"
+#undef REG8
+#undef REG16
+
+volatile unsigned char host_interrupts;
+unsigned            host_failures;
+
+void __attribute__((weak))
+host_reset(void)
+{
+    printf("unexpected reset\n");
+    exit(1);
+}
+
+void __attribute__((weak))
+__require_abort(const char *file, int line)
+{
+    printf("%s:%d: REQUIRE failed\n", file, line);
+    exit(1);
+}
+
+int
+host_result(const char *name)
+{
+    if (host_failures != 0) {
+        printf("%s: %u checks failed\n", name, host_failures);
+        return 1;
+    }
+
+    printf("%s: ok\n", name);
+    return 0;
+}
@@ -0,0 +1,25 @@
+/*
+ * Host test support.
+ *
+ * Each test is a single program that includes the module under test
+ * (so that it can see the module's statics) and runs it against a
+ * model of the hardware it touches. See the Makefile.
+ */
+
+#pragma once
+
+#include <stdio.h>
+
+extern unsigned     host_failures;
+
+/* count and report a failed check, carrying on with the test */
+#define CHECK(_cond)                                                        \
+    do {                                                                    \
+        if (!(_cond)) {                                                     \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #_cond);\
+            host_failures++;                                                \
+        }                                                                   \
+    } while (0)
+
+/* print the outcome; returns the exit status */
+extern int          host_result(const char *name);
@@ -0,0 +1,21 @@
+/*
+ * Host stand-in for the CodeWarrior HC08 intrinsics.
+ */
+
+#pragma once
+
+/* interrupt enable (the inverse of the I bit) */
+extern volatile unsigned char host_interrupts;
+
+/* reached through HAL_reset() and friends */
+extern void host_reset(void);
+
+#define __isflag_int_enabled()  (host_interrupts)
+#define __RESET_WATCHDOG()      do { } while (0)
+
+/* the inline assembly the sources use */
+#define __asm
+#define SEI                     host_interrupts = 0
+#define CLI                     host_interrupts = 1
+#define NOP
+#define DCW                     host_reset(); (void)
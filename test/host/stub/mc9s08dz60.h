@@ -0,0 +1,62 @@
+/*
+ * Host stand-in for the CodeWarrior MC9S08DZ60 header.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#define REG8(_r)    extern volatile uint8_t _r;
+#define REG16(_r)   extern volatile uint16_t _r;
+#include "registers.h"
+#undef REG8
+#undef REG16
+
+/* interrupt handlers are ordinary functions */
+#define __interrupt
+
+#define VectorNumber_Vtpm1ovf
+#define VectorNumber_Vtpm1ch0
+#define VectorNumber_Vtpm1ch1
+#define VectorNumber_Vtpm1ch2
+#define VectorNumber_Vtpm1ch3
+#define VectorNumber_Vtpm1ch4
+#define VectorNumber_Vtpm1ch5
+#define VectorNumber_Vtpm2ovf
+#define VectorNumber_Vtpm2ch0
+#define VectorNumber_Vtpm2ch1
+#define VectorNumber_Vcanrx
+
+/* channel register bits; the same for every channel */
+#define TPM1C0SC_CH0F_MASK      0x80U
+#define TPM1C0SC_CH0IE_MASK     0x40U
+#define TPM1C0SC_MS0B_MASK      0x20U
+#define TPM1C0SC_MS0A_MASK      0x10U
+#define TPM1C0SC_ELS0B_MASK     0x08U
+#define TPM1C0SC_ELS0A_MASK     0x04U
+#define TPM1C1SC_CH1F_MASK      0x80U
+#define TPM1C2SC_CH2F_MASK      0x80U
+#define TPM1C3SC_CH3F_MASK      0x80U
+#define TPM1C4SC_CH4F_MASK      0x80U
+#define TPM1C5SC_CH5F_MASK      0x80U
+#define TPM2SC_TOF_MASK         0x80U
+#define TPM2C0SC_CH0F_MASK      0x80U
+#define TPM2C1SC_CH1F_MASK      0x80U
+
+#define FSTAT_FCBEF_MASK        0x80U
+#define FSTAT_FCCF_MASK         0x40U
+#define FSTAT_FPVIOL_MASK       0x20U
+#define FSTAT_FACCERR_MASK      0x10U
+
+/*
+ * Flash status and page select, which a test that uses them backs with
+ * a model (see test_eeprom.c): a write to FSTAT_FCBEF launches a
+ * command, and FSTAT_FCCF is read to see it through.
+ */
+extern volatile uint8_t *host_flash_epgsel(void);
+extern volatile uint8_t *host_flash_fcbef(void);
+extern uint8_t host_flash_fccf(void);
+
+#define FCNFG_EPGSEL            (*host_flash_epgsel())
+#define FSTAT_FCBEF             (*host_flash_fcbef())
+#define FSTAT_FCCF              host_flash_fccf()
@@ -0,0 +1,52 @@
+/*
+ * MC9S08DZ60 registers used by the modules under test, as plain
+ * variables; bit fields are separate variables. Add to this list as
+ * tests need them.
+ */
+
+/* TPM1 */
+REG8(TPM1SC)
+REG8(TPM1SC_CLKSx)
+REG8(TPM1SC_PS)
+REG8(TPM1SC_TOF)
+REG8(TPM1SC_TOIE)
+REG16(TPM1MOD)
+REG16(TPM1CNT)
+REG8(TPM1C0SC)
+REG8(TPM1C1SC)
+REG8(TPM1C2SC)
+REG8(TPM1C3SC)
+REG8(TPM1C4SC)
+REG8(TPM1C5SC)
+REG16(TPM1C0V)
+REG16(TPM1C1V)
+REG16(TPM1C2V)
+REG16(TPM1C3V)
+REG16(TPM1C4V)
+REG16(TPM1C5V)
+
+/* TPM2 */
+REG8(TPM2SC)
+REG8(TPM2SC_CLKSx)
+REG8(TPM2SC_PS)
+REG8(TPM2SC_TOF)
+REG8(TPM2SC_TOIE)
+REG16(TPM2MOD)
+REG16(TPM2CNT)
+REG8(TPM2C0SC)
+REG8(TPM2C0SC_MS0A)
+REG8(TPM2C0SC_CH0IE)
+REG16(TPM2C0V)
+REG8(TPM2C1SC)
+REG8(TPM2C1SC_MS1A)
+REG8(TPM2C1SC_CH1IE)
+REG8(TPM2C1SC_CH1F)
+REG16(TPM2C1V)
+
+/* ports */
+REG8(PTDD)
+
+/* flash; FCNFG_EPGSEL, FSTAT_FCCF and FSTAT_FCBEF are in mc9s08dz60.h */
+REG8(FCMD)
+REG8(FSTAT)
+REG8(FSTAT_FACCERR)
@@ -0,0 +1,329 @@
+/*
+ * EEPROM span reads and write-behind, against a model of the flash
+ * controller and the two-page EEPROM array.
+ *
+ * The model holds the 2KB array, selects a 1KB page with FCNFG_EPGSEL,
+ * and runs a byte program or sector erase launched through the address
+ * latch and FSTAT_FCBEF; a command completes after a number of
+ * FSTAT_FCCF polls. It checks that the array and page select are left
+ * alone while a command runs, and that a byte is only programmed once
+ * between erases.
+ *
+ * Checks that reads and writes land where they should, and counts page
+ * selects, array accesses, status polls and commands for span reads and
+ * record writes against the per-byte read that span reads replaced.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "host.h"
+
+static const uint8_t *model_page(void);
+static void model_latch(uint16_t bofs, uint8_t value);
+
+#define _EEPROM_PAGE                    model_page()
+#define _EEPROM_LATCH(_bofs, _value)    model_latch(_bofs, _value)
+#include "lib/HAL/eeprom.c"
+
+#define PAGE_SIZE       0x400U
+#define PROGRAM_POLLS   4
+#define ERASE_POLLS     100
+
+typedef struct {
+    uint32_t    selects;        /* FCNFG_EPGSEL accesses */
+    uint32_t    accesses;       /* page lookups, i.e. array reads */
+    uint32_t    polls;          /* FSTAT_FCCF reads */
+    uint32_t    programs;
+    uint32_t    erases;
+} counts_t;
+
+static struct {
+    uint8_t     array[HAL_EEPROM_SIZE];
+    uint8_t     epgsel;
+    uint8_t     fcbef;
+    bool        latched;
+    uint16_t    address;        /* latched by the last array write */
+    uint8_t     value;
+    uint8_t     command;        /* running */
+    uint8_t     busy;           /* polls until it completes */
+    counts_t    n;
+} _f;
+
+/* what the EEPROM should hold, once everything queued is written */
+static uint8_t  _expect[HAL_EEPROM_SIZE];
+
+volatile uint8_t *
+host_flash_epgsel(void)
+{
+    CHECK(_f.busy == 0);
+    _f.n.selects++;
+    return &_f.epgsel;
+}
+
+volatile uint8_t *
+host_flash_fcbef(void)
+{
+    /* written after the latch and FCMD, to launch */
+    if (_f.latched && (FCMD != 0)) {
+        CHECK((FCMD == _CMD_BYTE_PROG) || (FCMD == _CMD_SECTOR_ERASE));
+        _f.command = FCMD;
+        _f.busy = (FCMD == _CMD_SECTOR_ERASE) ? ERASE_POLLS : PROGRAM_POLLS;
+        _f.latched = false;
+        FCMD = 0;
+    }
+
+    _f.fcbef = 1;
+    return &_f.fcbef;
+}
+
+uint8_t
+host_flash_fccf(void)
+{
+    _f.n.polls++;
+
+    if ((_f.busy != 0) && (--_f.busy == 0)) {
+        if (_f.command == _CMD_SECTOR_ERASE) {
+            memset(&_f.array[_f.address & _SECTOR_MASK], 0xff, _EEPROM_SECTOR_SIZE);
+            _f.n.erases++;
+        } else {
+            CHECK(_f.array[_f.address] == 0xff);
+            _f.array[_f.address] &= _f.value;
+            _f.n.programs++;
+        }
+    }
+
+    return _f.busy == 0;
+}
+
+static const uint8_t *
+model_page(void)
+{
+    CHECK(_f.busy == 0);
+    _f.n.accesses++;
+    return &_f.array[_f.epgsel ? PAGE_SIZE : 0];
+}
+
+static void
+model_latch(uint16_t bofs, uint8_t value)
+{
+    CHECK(_f.busy == 0);
+    CHECK(bofs < PAGE_SIZE);
+    _f.latched = true;
+    _f.address = (_f.epgsel ? PAGE_SIZE : 0) + bofs;
+    _f.value = value;
+}
+
+/* the per-byte read that span reads replaced, for comparison */
+static void
+per_byte_read(uint16_t offset, uint8_t len, uint8_t *data)
+{
+    while (len-- > 0) {
+        const _sector_t *const e = _eeprom_pending(offset & _SECTOR_MASK, false);
+
+        if (e != NULL) {
+            *data = e->image[offset % _EEPROM_SECTOR_SIZE];
+        } else {
+            uint16_t bofs;
+
+            _eeprom_idle();
+            bofs = _eeprom_pagesel(offset);
+            *data = _EEPROM_PAGE[bofs];
+        }
+
+        offset++;
+        data++;
+    }
+}
+
+static void
+write_async(uint16_t offset, uint8_t len, const uint8_t *data)
+{
+    (void)_HAL_eeprom_write_async(offset, len, data);
+    memcpy(&_expect[offset], data, len);
+}
+
+static void
+fill(uint8_t *data, uint16_t len, uint8_t seed)
+{
+    while (len-- > 0) {
+        seed = (uint8_t)(seed * 13 + 7);
+        *data++ = seed;
+    }
+}
+
+static void
+check_read(uint16_t offset, uint8_t len)
+{
+    uint8_t data[256];
+
+    HAL_eeprom_read(offset, len, data);
+    CHECK(memcmp(data, &_expect[offset], len) == 0);
+}
+
+/* writes merge, reads see them at once, and the array ends up right */
+static void
+test_write_behind(void)
+{
+    static const uint16_t offsets[] = {
+        0x200, 0x203, 0x20e, 0x3f9, 0x3fc, 0x404, 0x5a1, 0x205, 0x3ff, 0x6d0
+    };
+    uint8_t data[40];
+    uint8_t i;
+    uint16_t steps;
+
+    for (i = 0; i < (sizeof(offsets) / sizeof(offsets[0])); i++) {
+        const uint8_t len = 5 + (i * 3);
+
+        fill(data, len, i);
+        write_async(offsets[i], len, data);
+    }
+
+    /* read everything while the engine works through the queue */
+    for (steps = 0; !HAL_eeprom_write_done(_token); steps++) {
+        PT_RUN(_HAL_eeprom_service);
+
+        if ((steps % 7) == 0) {
+            check_read(0x1f8, 0x40);
+            check_read(0x3e0, 0x40);
+            check_read(0x598, 0x20);
+            check_read(0x6c8, 0x18);
+        }
+    }
+
+    CHECK(memcmp(_f.array, _expect, sizeof(_expect)) == 0);
+
+    /* two writes to the same erased sector before the engine runs are one sector write */
+    memset(&_f.n, 0, sizeof(_f.n));
+    fill(data, 8, 0x55);
+    write_async(0x680, 4, &data[0]);
+    write_async(0x684, 4, &data[4]);
+    CHECK(_queue_count == 1);
+    HAL_eeprom_flush();
+    CHECK(_f.n.erases == 0);
+    CHECK(_f.n.programs == 8);
+
+    /* rewriting it a byte at a time still costs one erase */
+    memset(&_f.n, 0, sizeof(_f.n));
+
+    for (i = 0; i < 8; i++) {
+        data[i] ^= 0xa5;
+        write_async(0x680 + i, 1, &data[i]);
+    }
+
+    CHECK(_queue_count == 1);
+    HAL_eeprom_flush();
+    CHECK(_f.n.erases == 1);
+    CHECK(_f.n.programs <= 8);
+
+    CHECK(memcmp(_f.array, _expect, sizeof(_expect)) == 0);
+}
+
+/* span reads against per-byte reads */
+static void
+test_read_cost(void)
+{
+    uint8_t span[256];
+    uint8_t bytes[256];
+    counts_t s;
+    counts_t b;
+
+    /* a log-sized record in one page */
+    memset(&_f.n, 0, sizeof(_f.n));
+    HAL_eeprom_read(0x500, 255, span);
+    s = _f.n;
+
+    memset(&_f.n, 0, sizeof(_f.n));
+    per_byte_read(0x500, 255, bytes);
+    b = _f.n;
+
+    printf("eeprom: 255B read: %lu/%lu selects, %lu/%lu array reads, %lu/%lu polls (span/per byte)\n",
+           (unsigned long)s.selects, (unsigned long)b.selects,
+           (unsigned long)s.accesses, (unsigned long)b.accesses,
+           (unsigned long)s.polls, (unsigned long)b.polls);
+
+    CHECK(memcmp(span, bytes, 255) == 0);
+    CHECK(memcmp(span, &_expect[0x500], 255) == 0);
+    CHECK(s.selects == 1);
+    CHECK(s.accesses == 1);
+    CHECK(s.polls == 32);
+    CHECK(b.selects == 255);
+    CHECK(b.polls == 255);
+
+    /* across the page boundary: one select per page */
+    memset(&_f.n, 0, sizeof(_f.n));
+    HAL_eeprom_read(0x3c0, 0x80, span);
+    CHECK(memcmp(span, &_expect[0x3c0], 0x80) == 0);
+    CHECK(_f.n.selects == 2);
+    CHECK(_f.n.accesses == 2);
+
+    /* queued sectors come from the queue, not the array */
+    span[0] = (uint8_t)~_expect[0x3c4];
+    write_async(0x3c4, 1, &span[0]);
+    memset(&_f.n, 0, sizeof(_f.n));
+    HAL_eeprom_read(0x3c0, 8, span);
+    CHECK(memcmp(span, &_expect[0x3c0], 8) == 0);
+    CHECK(_f.n.selects == 0);
+    CHECK(_f.n.polls == 0);
+    HAL_eeprom_flush();
+}
+
+/* writing a record, to erased and to written sectors */
+static void
+test_write_cost(void)
+{
+    uint8_t data[256];
+    counts_t erased;
+    counts_t rewrite;
+
+    /* the 0x480 record is erased: program only */
+    memset(&_f.array[0x480], 0xff, 0x80);
+    memset(&_expect[0x480], 0xff, 0x80);
+
+    fill(data, 0x80, 0x21);
+    memset(&_f.n, 0, sizeof(_f.n));
+    _HAL_eeprom_write(0x480, 0x80, data);
+    memcpy(&_expect[0x480], data, 0x80);
+    erased = _f.n;
+
+    fill(data, 0x80, 0x42);
+    memset(&_f.n, 0, sizeof(_f.n));
+    _HAL_eeprom_write(0x480, 0x80, data);
+    memcpy(&_expect[0x480], data, 0x80);
+    rewrite = _f.n;
+
+    printf("eeprom: 128B write: %lu erases, %lu programs, %lu selects erased; "
+           "%lu erases, %lu programs, %lu selects rewritten\n",
+           (unsigned long)erased.erases, (unsigned long)erased.programs, (unsigned long)erased.selects,
+           (unsigned long)rewrite.erases, (unsigned long)rewrite.programs, (unsigned long)rewrite.selects);
+
+    CHECK(memcmp(_f.array, _expect, sizeof(_expect)) == 0);
+    CHECK(erased.erases == 0);
+    CHECK(erased.programs <= 0x80);
+
+    /* a select to fill each image, one to compare it, and one per command */
+    CHECK(erased.selects <= ((0x80 / _EEPROM_SECTOR_SIZE) * 2 + erased.programs));
+    CHECK(rewrite.erases == (0x80 / _EEPROM_SECTOR_SIZE));
+    CHECK(rewrite.selects <= ((0x80 / _EEPROM_SECTOR_SIZE) * 2 + rewrite.erases + rewrite.programs));
+
+    /* an unchanged record isn't rewritten */
+    memset(&_f.n, 0, sizeof(_f.n));
+    _HAL_eeprom_write(0x480, 0x80, data);
+    CHECK(_f.n.erases == 0);
+    CHECK(_f.n.programs == 0);
+}
+
+int
+main(void)
+{
+    memset(_f.array, 0xff, sizeof(_f.array));
+    memset(_expect, 0xff, sizeof(_expect));
+    _f.fcbef = 1;
+    host_interrupts = 1;
+
+    test_write_behind();
+    test_read_cost();
+    test_write_cost();
+
+    return host_result("eeprom");
+}
@@ -0,0 +1,383 @@
+/*
+ * Staggered PWM waveforms against a model of TPM1.
+ *
+ * The model counts TPM1 at the 4us quantum, applies each channel's
+ * output compare action and raises its interrupt. The CPU runs one
+ * interrupt at a time, TPM1 channels before the TPM2 tick (as the
+ * vector priorities do), and calls a channel's handler at the end of
+ * its interrupt so that the next edge is programmed as late as it can
+ * be. The tick runs for 400us every 1ms, longer than the shortest
+ * pulses, so that edges are regularly due before they are programmed.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "host.h"
+#include "lib/HAL/pwm.c"
+
+/* interrupt costs, in TPM1 counts */
+#define COMPARE_ISR     5       /* 20us */
+#define TICK_PERIOD     250     /* 1ms */
+#define TICK_WORST      100     /* 400us */
+
+/* the most an edge can be late: the tick, then every other channel's interrupt, then its own */
+#define LATENCY_MAX     (TICK_WORST + (_HAL_PWM_CHANNELS * COMPARE_ISR) + _STAGGER_MARGIN_CYCLES)
+
+#define IDLE            -2
+#define TICK            -1
+#define UNKNOWN         0xffffffffUL
+
+/* pwm.c's neighbours */
+void _HAL_adc_pwm_sync(void) { }
+void _HAL_freq_edge(uint16_t capture) { (void)capture; }
+void _HAL_timer_alarm_set(_HAL_timer_alarm_t *alarm, uint16_t delay_us) { (void)alarm; (void)delay_us; }
+void _HAL_timer_alarm_set_at(_HAL_timer_alarm_t *alarm, uint16_t when) { (void)alarm; (void)when; }
+void _HAL_timer_alarm_cancel(_HAL_timer_alarm_t *alarm) { (void)alarm; }
+void _HAL_timer_call_register(HAL_timer_call_t *call) { (void)call; }
+
+static volatile uint8_t *const _sc[] = {
+    &TPM1C0SC, &TPM1C1SC, &TPM1C2SC, &TPM1C3SC, &TPM1C4SC, &TPM1C5SC
+};
+static volatile uint16_t *const _v[] = {
+    &TPM1C0V, &TPM1C1V, &TPM1C2V, &TPM1C3V, &TPM1C4V, &TPM1C5V
+};
+static void (*const _handler[])(void) = {
+    Vtpm1ch0_handler, Vtpm1ch1_handler, Vtpm1ch2_handler,
+    Vtpm1ch3_handler, Vtpm1ch4_handler, Vtpm1ch5_handler
+};
+
+typedef struct {
+    uint32_t    now;                /* counts since the start */
+    uint16_t    tick_phase;         /* now % TICK_PERIOD at which the tick falls due */
+    uint16_t    tick_cost;
+    bool        tick_pending;
+    uint8_t     pending;            /* channel interrupts */
+    int8_t      running;            /* channel, TICK or IDLE */
+    uint16_t    busy;               /* counts left in the running interrupt */
+    uint8_t     pins;
+    uint32_t    rise[_HAL_PWM_CHANNELS];
+    uint32_t    fall[_HAL_PWM_CHANNELS];
+    uint32_t    pulses;             /* high and low pulses measured */
+    uint32_t    stretched;          /* ... that weren't the programmed width */
+    uint32_t    worst_error;        /* counts, either way */
+    uint32_t    rises[_HAL_PWM_CHANNELS];
+    uint8_t     peak;               /* most outputs on at once */
+    uint8_t     peak_rises;         /* most outputs turned on in one count */
+} model_t;
+
+static model_t  _m;
+
+static void
+model_reset(uint16_t tick_phase, uint16_t tick_cost)
+{
+    uint8_t ch;
+
+    memset(&_m, 0, sizeof(_m));
+    _m.tick_phase = tick_phase;
+    _m.tick_cost = tick_cost;
+    _m.running = IDLE;
+
+    for (ch = 0; ch < _HAL_PWM_CHANNELS; ch++) {
+        _m.rise[ch] = UNKNOWN;
+        _m.fall[ch] = UNKNOWN;
+        *_sc[ch] = 0;
+        *_v[ch] = 0;
+    }
+
+    TPM1CNT = 0;
+}
+
+static uint8_t
+count_bits(uint8_t v)
+{
+    uint8_t n = 0;
+
+    for (; v != 0; v >>= 1) {
+        n += v & 1;
+    }
+
+    return n;
+}
+
+/* check a pulse that has just ended against the programmed on-time */
+static void
+model_pulse(uint8_t ch, uint32_t started, bool high)
+{
+    const uint16_t on = _stagger_on[ch];
+    const uint32_t expected = high ? on : (uint32_t)(TPM1MOD + 1) - on;
+
+    if (started == UNKNOWN) {
+        return;
+    }
+
+    _m.pulses++;
+
+    if ((_m.now - started) != expected) {
+        const uint32_t width = _m.now - started;
+        const uint32_t error = (width > expected) ? (width - expected) : (expected - width);
+
+        _m.stretched++;
+
+        if (error > _m.worst_error) {
+            _m.worst_error = error;
+        }
+    }
+}
+
+static void
+model_step(void)
+{
+    uint8_t rises = 0;
+    uint8_t ch;
+
+    /* the counter runs 0..MOD inclusive */
+    TPM1CNT = (TPM1CNT >= TPM1MOD) ? 0 : (uint16_t)(TPM1CNT + 1);
+    _m.now++;
+
+    for (ch = 0; ch < _HAL_PWM_CHANNELS; ch++) {
+        const uint8_t sc = *_sc[ch];
+        const uint8_t mask = 1 << ch;
+        const uint8_t was = _m.pins;
+
+        if (((sc & (TPM1C0SC_MS0B_MASK | TPM1C0SC_MS0A_MASK)) != TPM1C0SC_MS0A_MASK) ||
+            (TPM1CNT != *_v[ch])) {
+            continue;
+        }
+
+        /* output compare match */
+        switch (sc & (TPM1C0SC_ELS0B_MASK | TPM1C0SC_ELS0A_MASK)) {
+        case TPM1C0SC_ELS0B_MASK | TPM1C0SC_ELS0A_MASK:
+            _m.pins |= mask;
+            break;
+
+        case TPM1C0SC_ELS0B_MASK:
+            _m.pins &= ~mask;
+            break;
+
+        case TPM1C0SC_ELS0A_MASK:
+            _m.pins ^= mask;
+            break;
+
+        default:
+            break;
+        }
+
+        *_sc[ch] |= TPM1C0SC_CH0F_MASK;
+
+        if (sc & TPM1C0SC_CH0IE_MASK) {
+            _m.pending |= mask;
+        }
+
+        if (!(was & mask) && (_m.pins & mask)) {
+            model_pulse(ch, _m.fall[ch], false);
+            _m.rise[ch] = _m.now;
+            _m.rises[ch]++;
+            rises++;
+        } else if ((was & mask) && !(_m.pins & mask)) {
+            model_pulse(ch, _m.rise[ch], true);
+            _m.fall[ch] = _m.now;
+        }
+    }
+
+    if (count_bits(_m.pins) > _m.peak) {
+        _m.peak = count_bits(_m.pins);
+    }
+
+    if (rises > _m.peak_rises) {
+        _m.peak_rises = rises;
+    }
+
+    if ((_m.now % TICK_PERIOD) == _m.tick_phase) {
+        _m.tick_pending = true;
+    }
+
+    /* finish the running interrupt */
+    if ((_m.busy != 0) && (--_m.busy == 0)) {
+        if (_m.running >= 0) {
+            _handler[_m.running]();
+        }
+
+        _m.running = IDLE;
+    }
+
+    /* take the next one */
+    if (_m.busy == 0) {
+        if (_m.pending != 0) {
+            for (ch = 0; !(_m.pending & (1 << ch)); ch++) {
+            }
+
+            _m.pending &= ~(1 << ch);
+            _m.running = ch;
+            _m.busy = COMPARE_ISR;
+
+        } else if (_m.tick_pending && (_m.tick_cost != 0)) {
+            _m.tick_pending = false;
+            _m.running = TICK;
+            _m.busy = _m.tick_cost;
+        }
+    }
+}
+
+static void
+model_run(uint16_t periods)
+{
+    uint32_t steps = (uint32_t)periods * (TPM1MOD + 1);
+
+    while (steps-- != 0) {
+        model_step();
+    }
+}
+
+/* restart staggered mode with every channel at the given duty cycles */
+static void
+stagger(uint8_t period_ms, const uint16_t *duty)
+{
+    uint8_t ch;
+
+    HAL_pwm_set_staggered(false);
+    HAL_pwm_set_period(period_ms);
+
+    for (ch = 0; ch < _HAL_PWM_CHANNELS; ch++) {
+        HAL_pwm_set_duty16(ch, 0);
+        _channel_sc[ch] = 0xff;
+        *_sc[ch] = 0;
+    }
+
+    TPM1CNT = 0;
+    HAL_pwm_set_staggered(true);
+
+    for (ch = 0; ch < _HAL_PWM_CHANNELS; ch++) {
+        HAL_pwm_set_duty16(ch, duty[ch]);
+    }
+}
+
+/* the outputs-on-at-once table in _pwm.h */
+static void
+test_peak(void)
+{
+    static const struct {
+        uint8_t duty;
+        uint8_t peak;
+    } table[] = {
+        { 10, 1 }, { 25, 2 }, { 50, 4 }, { 75, 5 },
+    };
+    uint16_t duty[_HAL_PWM_CHANNELS];
+    uint8_t i;
+    uint8_t ch;
+
+    for (i = 0; i < (sizeof(table) / sizeof(table[0])); i++) {
+        for (ch = 0; ch < _HAL_PWM_CHANNELS; ch++) {
+            duty[ch] = (uint16_t)(((uint32_t)table[i].duty * 10486U) >> 4);
+        }
+
+        model_reset(0, 0);
+        stagger(8, duty);
+        model_run(1);
+        _m.peak = 0;
+        _m.peak_rises = 0;
+        model_run(2);
+
+        CHECK(_m.peak == table[i].peak);
+        CHECK(_m.peak_rises == 1);
+        CHECK(_m.stretched == 0);
+    }
+}
+
+/*
+ * With the tick holding off the compare interrupts for longer than the
+ * shortest pulses, over a sweep of duty cycles (including the shortest
+ * pulses allowed) and with the tick moving across the period: no edge
+ * is more than the latency late, and every period has its pulse.
+ */
+static void
+test_latency(void)
+{
+    static const uint8_t periods[] = { 8, 1, 3, 20 };
+    uint16_t duty[_HAL_PWM_CHANNELS];
+    uint32_t pulses = 0;
+    uint32_t stretched = 0;
+    uint32_t base;
+    uint8_t p;
+    uint8_t ch;
+
+    for (p = 0; p < sizeof(periods); p++) {
+        for (base = 0; base <= 0xffff; base += 257) {
+            for (ch = 0; ch < _HAL_PWM_CHANNELS; ch++) {
+                duty[ch] = (uint16_t)(base + ((uint32_t)ch * 0x2aaa));
+            }
+
+            model_reset((uint16_t)(base % TICK_PERIOD), TICK_WORST);
+            stagger(periods[p], duty);
+            model_run(6);
+
+            for (ch = 0; ch < _HAL_PWM_CHANNELS; ch++) {
+                const uint16_t on = _stagger_on[ch];
+
+                /* only pulses shorter than 100us were converted to steady states */
+                CHECK((on == 0) || (on == pwm_period_cycles) ||
+                      ((on >= _MIN_PULSE_CYCLES) &&
+                       ((on + _MIN_PULSE_CYCLES) <= pwm_period_cycles)));
+
+                /* the first period may start before the channel's phase, so 5 or 6 */
+                if ((on != 0) && (on != pwm_period_cycles)) {
+                    CHECK((_m.rises[ch] >= 5) && (_m.rises[ch] <= 6));
+                }
+            }
+
+            CHECK(_m.worst_error <= LATENCY_MAX);
+            pulses += _m.pulses;
+            stretched += _m.stretched;
+        }
+    }
+
+    /* at the limits, with the tick visiting every offset in the period */
+    for (ch = 0; ch < _HAL_PWM_CHANNELS; ch++) {
+        duty[ch] = (ch & 1) ? 64717U : 820U;        /* 1975 and 25 counts */
+    }
+
+    model_reset(0, TICK_WORST);
+    stagger(8, duty);
+    CHECK(_stagger_on[0] == _MIN_PULSE_CYCLES);
+    CHECK(_stagger_on[1] == (pwm_period_cycles - _MIN_PULSE_CYCLES));
+    model_run(TICK_PERIOD + 1);
+    CHECK(_m.worst_error <= LATENCY_MAX);
+
+    for (ch = 0; ch < _HAL_PWM_CHANNELS; ch++) {
+        CHECK(_m.rises[ch] >= TICK_PERIOD);
+    }
+
+    pulses += _m.pulses;
+    stretched += _m.stretched;
+
+    printf("pwm: %lu pulses, %lu moved by a late edge, by at most %u counts\n",
+           (unsigned long)pulses, (unsigned long)stretched, LATENCY_MAX);
+    CHECK(pulses > 40000UL);
+}
+
+/* the model does see a late edge, and without the catch-up would lose a period */
+static void
+test_model(void)
+{
+    static const uint16_t duty[_HAL_PWM_CHANNELS];
+
+    model_reset(0, TICK_WORST);
+    stagger(8, duty);
+    _pwm_write(0, _MIN_PULSE_CYCLES);
+    model_run(TICK_PERIOD + 1);
+    CHECK(_m.stretched != 0);
+    CHECK(_m.worst_error <= LATENCY_MAX);
+}
+
+int
+main(void)
+{
+    host_interrupts = 1;
+    _HAL_pwm_init();
+
+    test_peak();
+    test_latency();
+    test_model();
+
+    return host_result("pwm");
+}
@@ -0,0 +1,544 @@
+/*
+ * Bootrom scan responses from a network of modules, against a model of
+ * a 125kbps CAN bus.
+ *
+ * Every node runs bootrom.c: its statics are swapped in while it runs.
+ * Nodes tick their 1ms timers and run their main loops at their own
+ * phase and rate, and see the scan at the first main loop pass after it
+ * arrives. The bus is simulated a bit time at a time. Frames are timed
+ * with their stuff bits. Nodes waiting for the bus start together when
+ * it goes idle. A node sees the bus busy a couple of bits after a frame
+ * starts. Responses all have the same ID, so frames that start together
+ * collide at their first differing data bit. Error-active nodes destroy
+ * the frame with an error frame and all retry, unless their frame has
+ * been aborted. Error-passive nodes (TEC >= 128) let the frame with the
+ * dominant bit through, and wait 8 more bits before they start.
+ *
+ * Measures the time from the scan until the last response is received,
+ * counts collisions, and checks that every node answers once.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "host.h"
+#include "lib/HAL/bootrom.c"
+
+#define NODES_MAX       64
+#define BIT_US          8                   /* 125kbps */
+#define TICK_BITS       (1000 / BIT_US)     /* 1ms timer tick */
+#define IFS_BITS        3
+#define ERROR_BITS      (6 + 6 + 8)         /* flag, other nodes' flags, delimiter */
+#define SUSPEND_BITS    8
+#define PASSIVE_TEC     128
+#define DETECT_BITS     2                   /* from SOF until the bus reads busy */
+#define RUN_BITS        (200000 / BIT_US)   /* 200ms */
+
+/* bootrom.c's state and the model's, per node */
+typedef struct {
+    /* swapped into bootrom.c */
+    bool            selected;
+    bool            write_enable;
+    bool            pending;
+    HAL_timer_t     timer;
+    uint8_t         data[8];
+    uint16_t        random;
+    uint8_t         buffer;
+    struct pt       pt;
+    uint8_t         serial[4];          /* as stored, big-endian */
+
+    /* model */
+    uint8_t         tick_phase;         /* bits */
+    uint8_t         loop_bits;          /* main loop pass */
+    uint8_t         loop_phase;
+    bool            scan_seen;
+    bool            tx;                 /* frame waiting for the bus */
+    bool            aborted;
+    uint8_t         tx_data[8];
+    uint16_t        tec;
+    uint32_t        done;               /* bit time the response was received, 0 until then */
+} node_t;
+
+static node_t   _nodes[NODES_MAX];
+static uint8_t  _node_count;
+static node_t   *_current;
+
+static struct {
+    uint32_t    now;                    /* bits since the scan */
+    uint32_t    start_at;               /* last frame started at this bit */
+    uint32_t    idle_at;                /* bus idle from this bit */
+    uint32_t    frames;
+    uint32_t    collisions;
+    uint32_t    retries;                /* responses that found the bus busy, or were aborted */
+    uint32_t    last_done;
+} _bus;
+
+/* bootrom.c's neighbours; only the scan is used */
+uint8_t _HAL_mrs_image[_HAL_MRS_IMAGE_SIZE];
+void _HAL_timer_register(HAL_timer_t *timer) { (void)timer; }
+bool HAL_can_tx_idle(void) { return true; }
+void HAL_can_send_blocking(uint32_t id, uint8_t dlc, const uint8_t *data) { (void)id; (void)dlc; (void)data; }
+void HAL_eeprom_read(uint16_t offset, uint8_t len, uint8_t *data) { (void)offset; memset(data, 0xff, len); }
+HAL_eeprom_token_t HAL_eeprom_write_async(uint16_t offset, uint8_t len, const uint8_t *data) { (void)offset; (void)len; (void)data; return 0; }
+HAL_eeprom_token_t _HAL_eeprom_write_async(uint16_t offset, uint8_t len, const uint8_t *data) { (void)offset; (void)len; (void)data; return 0; }
+bool _HAL_log_record(uint8_t age, uint8_t *record) { (void)age; (void)record; return false; }
+bool HAL_crash_get(HAL_crash_t *crash) { (void)crash; return false; }
+bool _HAL_adc_cal_zero(uint8_t index) { (void)index; return false; }
+bool _HAL_adc_cal_span(uint8_t index, uint16_t reference) { (void)index; (void)reference; return false; }
+bool _HAL_adc_cal_reset(uint8_t index) { (void)index; return false; }
+bool _HAL_adc_cal_save(void) { return false; }
+uint16_t crc16(uint16_t crc, const uint8_t *data, uint16_t len) { (void)data; (void)len; return crc; }
+void HAL_reset(void) { host_reset(); }
+
+bool HAL_can_send(uint32_t id, uint8_t dlc, const uint8_t *data) { (void)id; (void)dlc; (void)data; return false; }
+
+bool
+_HAL_can_bus_idle(void)
+{
+    if (_current->tx ||
+        ((_bus.now >= (_bus.start_at + DETECT_BITS)) && (_bus.now < _bus.idle_at))) {
+        _bus.retries++;
+        return false;
+    }
+
+    return true;
+}
+
+uint8_t
+_HAL_can_send_once(uint32_t id, uint8_t dlc, const uint8_t *data)
+{
+    CHECK(id == _SCAN_RSP_ID);
+    CHECK(dlc == 8);
+
+    if (_current->tx) {
+        return 0;
+    }
+
+    memcpy(_current->tx_data, data, 8);
+    _current->tx = true;
+    _current->aborted = false;
+    return 1;
+}
+
+/* frames are resolved as they start, so one still waiting hasn't gone */
+void
+_HAL_can_abort(uint8_t buffer)
+{
+    CHECK(buffer == 1);
+
+    if (_current->tx) {
+        _current->tx = false;
+        _current->aborted = true;
+        _bus.retries++;
+    }
+}
+
+bool
+_HAL_can_tx_done(uint8_t buffer)
+{
+    CHECK(buffer == 1);
+    return !_current->tx;
+}
+
+bool
+_HAL_can_tx_aborted(uint8_t buffer)
+{
+    CHECK(buffer == 1);
+    return _current->aborted;
+}
+
+static void
+node_enter(node_t *n)
+{
+    _current = n;
+    _module_selected = n->selected;
+    _eeprom_write_enable = n->write_enable;
+    _scan_pending = n->pending;
+    _scan_timer = n->timer;
+    memcpy(_scan_data, n->data, sizeof(_scan_data));
+    _scan_random = n->random;
+    _scan_buffer = n->buffer;
+    __pt__HAL_bootrom_scan = n->pt;
+    memcpy(&_HAL_mrs_image[MRS_PARAM_OFFSET(SerialNumber)], n->serial, sizeof(n->serial));
+}
+
+static void
+node_leave(node_t *n)
+{
+    n->selected = _module_selected;
+    n->write_enable = _eeprom_write_enable;
+    n->pending = _scan_pending;
+    n->timer = _scan_timer;
+    memcpy(n->data, _scan_data, sizeof(_scan_data));
+    n->random = _scan_random;
+    n->buffer = _scan_buffer;
+    n->pt = __pt__HAL_bootrom_scan;
+    _current = NULL;
+}
+
+/* bits in an extended data frame, with its stuff bits, through the inter-frame space */
+static uint16_t
+frame_bits(uint32_t id, const uint8_t *data)
+{
+    uint8_t bits[128];
+    uint8_t n = 0;
+    uint16_t crc = 0;
+    uint8_t run = 0;
+    uint8_t last = 2;
+    uint8_t stuff = 0;
+    uint8_t i;
+
+#define PUT(_v, _w)                                             \
+    do {                                                        \
+        int8_t _b;                                              \
+        for (_b = (_w) - 1; _b >= 0; _b--) {                    \
+            bits[n++] = (uint8_t)(((_v) >> _b) & 1);            \
+        }                                                       \
+    } while (0)
+
+    PUT(0, 1);                          /* SOF */
+    PUT((id >> 18) & 0x7ff, 11);        /* base ID */
+    PUT(3, 2);                          /* SRR, IDE */
+    PUT(id & 0x3ffff, 18);              /* extended ID */
+    PUT(0, 3);                          /* RTR, r1, r0 */
+    PUT(8, 4);                          /* DLC */
+
+    for (i = 0; i < 8; i++) {
+        PUT(data[i], 8);
+    }
+
+    for (i = 0; i < n; i++) {
+        const uint8_t next = (uint8_t)(bits[i] ^ ((crc >> 14) & 1));
+
+        crc = (uint16_t)((crc << 1) & 0x7fff);
+
+        if (next) {
+            crc ^= 0x4599;
+        }
+    }
+
+    PUT(crc, 15);
+
+    /* a bit of the opposite value after five the same, SOF to CRC */
+    for (i = 0; i < n; i++) {
+        if (bits[i] == last) {
+            if (++run == 5) {
+                stuff++;
+                last = (uint8_t)!bits[i];
+                run = 1;
+            }
+        } else {
+            last = bits[i];
+            run = 1;
+        }
+    }
+
+#undef PUT
+
+    /* CRC delimiter, ACK slot and delimiter, EOF */
+    return n + stuff + 1 + 2 + 7 + IFS_BITS;
+}
+
+/* the bit at which frames with the same ID first differ, unstuffed */
+static uint16_t
+first_difference(const uint8_t *a, const uint8_t *b)
+{
+    uint8_t i;
+
+    for (i = 0; i < 64; i++) {
+        const uint8_t mask = 0x80 >> (i % 8);
+
+        if ((a[i / 8] & mask) != (b[i / 8] & mask)) {
+            return 39 + i;
+        }
+    }
+
+    return 39 + 64;
+}
+
+static bool
+passive(const node_t *n)
+{
+    return n->tec >= PASSIVE_TEC;
+}
+
+/* start whatever is waiting once the bus is idle */
+static void
+bus_step(void)
+{
+    node_t *starting[NODES_MAX];
+    uint8_t count = 0;
+    bool any_active = false;
+    node_t *winner;
+    uint16_t diff = 0xffff;
+    uint8_t i;
+
+    for (i = 0; i < _node_count; i++) {
+        node_t *const n = &_nodes[i];
+
+        if (n->tx && (_bus.now >= (_bus.idle_at + (passive(n) ? SUSPEND_BITS : 0)))) {
+            starting[count++] = n;
+            any_active |= !passive(n);
+        }
+    }
+
+    if (count == 0) {
+        return;
+    }
+
+    /* the dominant (0) bit at the first difference wins, if it isn't destroyed */
+    winner = starting[0];
+
+    for (i = 1; i < count; i++) {
+        const uint16_t d = first_difference(winner->tx_data, starting[i]->tx_data);
+
+        if (d < diff) {
+            diff = d;
+        }
+
+        if (memcmp(starting[i]->tx_data, winner->tx_data, 8) < 0) {
+            winner = starting[i];
+        }
+    }
+
+    _bus.start_at = _bus.now;
+
+    if ((count > 1) && any_active) {
+        _bus.collisions++;
+        _bus.idle_at = _bus.now + diff + ERROR_BITS + IFS_BITS;
+
+        for (i = 0; i < count; i++) {
+            starting[i]->tec += 8;
+        }
+
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (starting[i] != winner) {
+            starting[i]->tec += 8;
+        }
+    }
+
+    _bus.frames++;
+    _bus.idle_at = _bus.now + frame_bits(_SCAN_RSP_ID & ~HAL_CAN_ID_EXT, winner->tx_data);
+    winner->tx = false;
+    winner->tec -= (winner->tec != 0) ? 1 : 0;
+
+    /* the response is for this node, and was sent once */
+    CHECK(memcmp(&winner->tx_data[1], winner->serial, 4) == 0);
+    CHECK(winner->done == 0);
+    winner->done = _bus.idle_at - IFS_BITS;
+
+    if (winner->done > _bus.last_done) {
+        _bus.last_done = winner->done;
+    }
+}
+
+static uint32_t _seed;
+
+static uint32_t
+rand32(void)
+{
+    _seed = (_seed * 1103515245UL) + 12345UL;
+    return _seed >> 8;
+}
+
+static const HAL_can_message_t _scan_msg = { _COMMAND_ID, { 0x00, 0x00 }, 2 };
+
+/* the slot bootrom.c picks for a serial number */
+static uint8_t
+slot_of(uint32_t serial)
+{
+    node_t n;
+
+    memset(&n, 0, sizeof(n));
+    n.serial[0] = (uint8_t)(serial >> 24);
+    n.serial[1] = (uint8_t)(serial >> 16);
+    n.serial[2] = (uint8_t)(serial >> 8);
+    n.serial[3] = (uint8_t)serial;
+
+    node_enter(&n);
+    CHECK(MRS_bootrom_rx(&_scan_msg));
+    node_leave(&n);
+
+    return (uint8_t)(n.timer.delay_ms / _SCAN_SLOT_MS);
+}
+
+/* scan a network of count nodes with the given serial numbers; returns the completion time in us */
+static uint32_t
+scan(uint8_t count, const uint32_t *serials)
+{
+    uint8_t i;
+
+    memset(_nodes, 0, sizeof(_nodes));
+    memset(&_bus, 0, sizeof(_bus));
+    _node_count = count;
+
+    for (i = 0; i < count; i++) {
+        node_t *const n = &_nodes[i];
+
+        n->serial[0] = (uint8_t)(serials[i] >> 24);
+        n->serial[1] = (uint8_t)(serials[i] >> 16);
+        n->serial[2] = (uint8_t)(serials[i] >> 8);
+        n->serial[3] = (uint8_t)serials[i];
+        n->tick_phase = (uint8_t)(rand32() % TICK_BITS);
+        n->loop_bits = (uint8_t)(25 + (rand32() % 100));   /* 200-1000us */
+        n->loop_phase = (uint8_t)(rand32() % n->loop_bits);
+    }
+
+    for (_bus.now = 0; _bus.now < RUN_BITS; _bus.now++) {
+        for (i = 0; i < count; i++) {
+            node_t *const n = &_nodes[i];
+
+            if (((_bus.now % TICK_BITS) == n->tick_phase) && (n->timer.delay_ms != 0)) {
+                n->timer.delay_ms--;
+            }
+
+            if ((_bus.now % n->loop_bits) == n->loop_phase) {
+                node_enter(n);
+
+                if (!n->scan_seen) {
+                    n->scan_seen = true;
+                    CHECK(MRS_bootrom_rx(&_scan_msg));
+                }
+
+                PT_RUN(_HAL_bootrom_scan);
+                node_leave(n);
+            }
+        }
+
+        bus_step();
+    }
+
+    for (i = 0; i < count; i++) {
+        CHECK(_nodes[i].done != 0);
+        CHECK(!_nodes[i].tx);
+    }
+
+    return _bus.last_done * BIT_US;
+}
+
+/* a full set of slots answers without a collision */
+static void
+test_slots(void)
+{
+    uint32_t serials[_SCAN_SLOTS];
+    uint32_t worst = 0;
+    uint32_t collisions = 0;
+    uint32_t retries = 0;
+    uint8_t round;
+    uint8_t i;
+
+    for (round = 0; round < 20; round++) {
+        uint32_t us;
+
+        for (i = 0; i < _SCAN_SLOTS; i++) {
+            uint8_t j;
+
+            do {
+                serials[i] = rand32();
+
+                for (j = 0; (j < i) && (slot_of(serials[j]) != slot_of(serials[i])); j++) {
+                }
+            } while (j < i);
+        }
+
+        us = scan(_SCAN_SLOTS, serials);
+        CHECK(_bus.frames == _SCAN_SLOTS);
+        collisions += _bus.collisions;
+        retries += _bus.retries;
+
+        if (us > worst) {
+            worst = us;
+        }
+    }
+
+    printf("scan: %u nodes, one per slot: done in up to %lu.%lums, %lu.%lu collisions, %lu.%lu retries per scan\n",
+           _SCAN_SLOTS, (unsigned long)(worst / 1000), (unsigned long)((worst / 100) % 10),
+           (unsigned long)(collisions / 20), (unsigned long)((collisions * 10 / 20) % 10),
+           (unsigned long)(retries / 20), (unsigned long)((retries * 10 / 20) % 10));
+
+    /* only nodes that try the bus within a bit of each other collide */
+    CHECK((collisions * 32) <= (_SCAN_SLOTS * 20UL));
+
+    /* frames are a little longer than slots, so some retry past the last */
+    CHECK(worst <= ((_SCAN_SLOTS * _SCAN_SLOT_MS * 1000UL) + (_SCAN_SLOTS * 600UL) + 5000));
+}
+
+/* serial numbers that hash to the same slot are spread out by their retries */
+static void
+test_one_slot(void)
+{
+    uint32_t serials[20];
+    uint32_t us;
+    uint8_t i;
+
+    serials[0] = rand32();
+
+    for (i = 1; i < 20; i++) {
+        do {
+            serials[i] = rand32();
+        } while (slot_of(serials[i]) != slot_of(serials[0]));
+    }
+
+    us = scan(20, serials);
+
+    printf("scan: 20 nodes, one slot: done in %lu.%lums, %lu collisions\n",
+           (unsigned long)(us / 1000), (unsigned long)((us / 100) % 10),
+           (unsigned long)_bus.collisions);
+    CHECK(_bus.collisions <= 1);
+    CHECK(_bus.frames == 20);
+}
+
+/* serial numbers as they come, some sharing slots */
+static void
+test_random(void)
+{
+    static const uint8_t sizes[] = { 8, 20, 40, 64 };
+    uint32_t serials[NODES_MAX];
+    uint8_t s;
+    uint8_t i;
+
+    for (s = 0; s < sizeof(sizes); s++) {
+        uint32_t worst = 0;
+        uint32_t collisions = 0;
+        uint8_t round;
+
+        for (round = 0; round < 20; round++) {
+            uint32_t us;
+
+            for (i = 0; i < sizes[s]; i++) {
+                serials[i] = rand32();
+            }
+
+            us = scan(sizes[s], serials);
+            collisions += _bus.collisions;
+            CHECK(_bus.frames == sizes[s]);
+
+            if (us > worst) {
+                worst = us;
+            }
+        }
+
+        printf("scan: %u nodes, random serials: done in up to %lu.%lums, %lu.%lu collisions per scan\n",
+               sizes[s], (unsigned long)(worst / 1000), (unsigned long)((worst / 100) % 10),
+               (unsigned long)(collisions / 20), (unsigned long)((collisions * 10 / 20) % 10));
+
+        /* under one collision per scan for each 32 nodes, and a little past the slots */
+        CHECK((collisions * 32) <= (sizes[s] * 20UL));
+        CHECK(worst <= ((_SCAN_SLOTS * _SCAN_SLOT_MS * 1000UL) + (sizes[s] * 600UL) + 5000));
+    }
+}
+
+int
+main(void)
+{
+    _seed = 49;
+
+    test_slots();
+    test_one_slot();
+    test_random();
+
+    return host_result("scan");
+}
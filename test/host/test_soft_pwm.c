@@ -0,0 +1,274 @@
+/*
+ * Software PWM group cost and jitter, against a model of TPM2.
+ *
+ * The model counts TPM2 at 1us and raises the alarm (TPM2C0) and tick
+ * (TPM2C1) compare interrupts; the CPU runs one interrupt at a time,
+ * the alarm before the tick. Alarm callbacks run when their interrupt
+ * is taken, and keep the CPU busy for the per-period and per-edge
+ * costs estimated in _pwm.h; the tick keeps it busy for TICK_COST.
+ *
+ * Checks the interrupt and _HAL_timer_alarm_set_at() rates, that the
+ * period doesn't drift, and that every edge is no later than the tick
+ * plus one alarm interrupt. The CPU load printed follows from the
+ * estimated costs, so it isn't checked.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "host.h"
+#include "lib/HAL/timer.c"
+
+/* count pwm.c's alarm calls */
+static uint32_t _set_at_calls;
+
+static void
+counted_set_at(_HAL_timer_alarm_t *alarm, uint16_t when)
+{
+    _set_at_calls++;
+    _HAL_timer_alarm_set_at(alarm, when);
+}
+
+#define _HAL_timer_alarm_set_at counted_set_at
+#include "lib/HAL/pwm.c"
+#undef _HAL_timer_alarm_set_at
+
+/* estimated interrupt costs, us */
+#define PERIOD_COST     40
+#define EDGE_COST       20
+#define TICK_COST       60
+
+#define SECOND          1000000UL
+
+/* pwm.c's neighbours */
+void _HAL_adc_pwm_sync(void) { }
+void _HAL_freq_edge(uint16_t capture) { (void)capture; }
+
+typedef struct {
+    uint32_t    now;
+    uint16_t    busy;               /* us left in the running interrupt */
+    uint32_t    busy_alarm;         /* us spent in alarm interrupts */
+    uint32_t    interrupts;         /* alarm interrupts */
+    uint32_t    periods;
+    uint32_t    edges;
+    uint16_t    late_max;           /* latest callback, us */
+    uint16_t    drift;              /* period deadlines not one period apart */
+    uint16_t    last_start;
+    bool        started;
+    uint8_t     pins;
+    uint32_t    rise[_HAL_PWM_CHANNELS];    /* 0 until seen */
+    uint16_t    on_error_max;       /* worst on-time error, us */
+    uint32_t    pulses;
+} model_t;
+
+static model_t  _m;
+static uint16_t _cost;
+
+static void
+counted_period(void)
+{
+    const uint16_t late = TPM2CNT - _soft_period_alarm._when;
+
+    if (late > _m.late_max) {
+        _m.late_max = late;
+    }
+
+    if (_m.started && ((uint16_t)(_soft_period_alarm._when - _m.last_start) != _soft_period_us)) {
+        _m.drift++;
+    }
+
+    _m.started = true;
+    _m.last_start = _soft_period_alarm._when;
+    _m.periods++;
+    _cost += PERIOD_COST;
+    _soft_period();
+}
+
+static void
+counted_edge(void)
+{
+    const uint16_t late = TPM2CNT - _soft_edge_alarm._when;
+
+    if (late > _m.late_max) {
+        _m.late_max = late;
+    }
+
+    _m.edges++;
+    _cost += EDGE_COST;
+    _soft_edge();
+}
+
+static void
+model_pins(void)
+{
+    const uint8_t pins = PTDD >> _SOFT_PIN_SHIFT;
+    uint8_t ch;
+
+    for (ch = 0; ch < _HAL_PWM_CHANNELS; ch++) {
+        const uint8_t mask = 1 << ch;
+
+        if (!(_m.pins & mask) && (pins & mask)) {
+            _m.rise[ch] = _m.now;
+
+        } else if ((_m.pins & mask) && !(pins & mask) && (_m.rise[ch] != 0)) {
+            const uint32_t on = _m.now - _m.rise[ch];
+            const uint16_t error = (on > _soft_on_us[ch]) ? (on - _soft_on_us[ch])
+                                                          : (_soft_on_us[ch] - on);
+
+            if (error > _m.on_error_max) {
+                _m.on_error_max = error;
+            }
+
+            _m.pulses++;
+        }
+    }
+
+    _m.pins = pins;
+}
+
+static void
+model_run(uint32_t us)
+{
+    while (us-- != 0) {
+        TPM2CNT++;
+        _m.now++;
+
+        if (TPM2CNT == TPM2C0V) {
+            TPM2C0SC |= TPM2C0SC_CH0F_MASK;
+        }
+
+        if (TPM2CNT == TPM2C1V) {
+            TPM2C1SC |= TPM2C1SC_CH1F_MASK;
+        }
+
+        if ((_m.busy != 0) && (--_m.busy != 0)) {
+            continue;
+        }
+
+        if ((TPM2C0SC & TPM2C0SC_CH0F_MASK) && TPM2C0SC_CH0IE) {
+            _cost = 0;
+            Vtpm2ch0_handler();
+            model_pins();
+            _m.busy = (_cost != 0) ? _cost : EDGE_COST;
+            _m.busy_alarm += _m.busy;
+            _m.interrupts++;
+
+        } else if (TPM2C1SC & TPM2C1SC_CH1F_MASK) {
+            Vtpm2ch1_handler();
+            _m.busy = TICK_COST;
+        }
+    }
+}
+
+static void
+setup(const uint16_t *duty)
+{
+    uint8_t ch;
+
+    _HAL_timer_init();
+    _HAL_pwm_init();
+    HAL_pwm_set_soft_period(10000);
+
+    for (ch = 0; ch < _HAL_PWM_CHANNELS; ch++) {
+        HAL_pwm_set_group(ch, HAL_PWM_GROUP_SOFT);
+        HAL_pwm_set_duty16(ch, duty[ch]);
+    }
+
+    /* settle, then measure from here */
+    model_run(50000);
+    memset(&_m, 0, sizeof(_m));
+    _m.pins = PTDD >> _SOFT_PIN_SHIFT;
+    _set_at_calls = 0;
+}
+
+/* the six-channel example in _pwm.h */
+static void
+test_cost(void)
+{
+    static const uint16_t duty[_HAL_PWM_CHANNELS] = {
+        0x1000, 0x3000, 0x5000, 0x7000, 0x9000, 0xb000
+    };
+
+    setup(duty);
+    model_run(SECOND);
+
+    printf("soft pwm: %lu interrupts/s, %lu alarm sets/s, %lu.%02lu%% CPU (estimated), "
+           "edges up to %uus late, on-time within %uus\n",
+           (unsigned long)_m.interrupts,
+           (unsigned long)_set_at_calls,
+           (unsigned long)(_m.busy_alarm / 10000),
+           (unsigned long)((_m.busy_alarm / 100) % 100),
+           _m.late_max,
+           _m.on_error_max);
+
+    CHECK(_m.periods == 100);
+    CHECK(_m.edges == 600);
+    CHECK(_m.interrupts == 700);
+    CHECK(_set_at_calls == 700);
+    CHECK(_m.drift == 0);
+    CHECK(_m.late_max <= (TICK_COST + PERIOD_COST));
+    CHECK(_m.on_error_max <= (TICK_COST + PERIOD_COST));
+    CHECK(_m.pulses >= (600 - _HAL_PWM_CHANNELS));    /* less any in progress at the start */
+}
+
+/* channels with the same on-time share an edge */
+static void
+test_shared_edge(void)
+{
+    static const uint16_t duty[_HAL_PWM_CHANNELS] = {
+        0x4000, 0x4000, 0x4000, 0x8000, 0x8000, 0xffff
+    };
+
+    setup(duty);
+    model_run(SECOND);
+
+    CHECK(_m.periods == 100);
+    CHECK(_m.edges == 200);
+    CHECK(_m.interrupts == 300);
+    CHECK(_m.drift == 0);
+    CHECK(_m.pulses >= (500 - _HAL_PWM_CHANNELS));
+}
+
+/* edges swept across the 1ms tick, one channel at a time */
+static void
+test_jitter(void)
+{
+    uint16_t duty[_HAL_PWM_CHANNELS];
+    uint16_t late_max = 0;
+    uint16_t cycles;
+
+    memset(duty, 0, sizeof(duty));
+
+    /* on-times 1000us..2000us in 5us steps (one TPM1 cycle) */
+    for (cycles = 200; cycles <= 400; cycles++) {
+        duty[cycles % _HAL_PWM_CHANNELS] = (uint16_t)((((uint32_t)cycles << 16) + 1999) / 2000);
+        setup(duty);
+        model_run(30000);
+        duty[cycles % _HAL_PWM_CHANNELS] = 0;
+
+        CHECK(_m.drift == 0);
+        CHECK(_m.on_error_max <= (TICK_COST + PERIOD_COST));
+
+        if (_m.late_max > late_max) {
+            late_max = _m.late_max;
+        }
+    }
+
+    printf("soft pwm: edges swept across the tick up to %uus late\n", late_max);
+    CHECK(late_max <= (TICK_COST + PERIOD_COST));
+    CHECK(late_max >= (TICK_COST / 2));
+}
+
+int
+main(void)
+{
+    host_interrupts = 1;
+    _soft_period_alarm.callback = counted_period;
+    _soft_edge_alarm.callback = counted_edge;
+
+    test_cost();
+    test_shared_edge();
+    test_jitter();
+
+    return host_result("soft_pwm");
+}
@@ -0,0 +1,526 @@
+/*
+ * Firmware update swap, against a model of the flash controller with
+ * resets injected part-way through its commands.
+ *
+ * The model holds the memory map and the two-page EEPROM array. A
+ * flash command is launched by interpreting the code that the resident
+ * code copies to the stack, and an EEPROM command through FSTAT_FCBEF;
+ * either completes after a number of FSTAT polls. It checks that
+ * nothing reads the arrays or changes the page while a command runs,
+ * that a byte is only programmed once between erases, and that nothing
+ * outside the active, staging and spare areas is written. A reset
+ * leaves the sector or byte being written with only some of its bits
+ * changed.
+ *
+ * An image is received through update.c, then swapped in, rolled back
+ * and confirmed by the resident code, with resets injected at a spread
+ * of commands (and a second one while recovering from the first); each
+ * must end with the active and staging areas swapped and the journal
+ * in the right state.
+ */
+
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "host.h"
+
+static const volatile uint8_t *model_read(uint16_t address);
+static void model_latch(uint16_t address, uint8_t value);
+static void model_run(const uint8_t *code);
+
+#define HAL_UPDATE_ENABLE
+#define _UPDATE_READ(_address)              model_read(_address)
+#define _UPDATE_LATCH(_address, _value)     model_latch(_address, _value)
+#define _UPDATE_RUN(_code)                  model_run(_code)
+#include "lib/HAL/update_boot.c"
+#include "lib/HAL/update.c"
+
+#define PROGRAM_POLLS   2
+#define ERASE_POLLS     10
+#define MAX_COMMANDS    0x10000UL
+
+#define FLASH_START     0x1900U   /* sectors are aligned from here */
+#define EEPROM_PAGE     0x400U
+#define EEPROM_SECTOR   8U
+#define AREA_SIZE       ((uint16_t)(_HAL_UPDATE_SECTORS * _HAL_UPDATE_SECTOR_SIZE))
+#define WRITABLE_END    (_HAL_UPDATE_SPARE + _HAL_UPDATE_SECTOR_SIZE)
+
+/* kinds of command, as counted */
+enum { FLASH_PROGRAM, FLASH_ERASE, EEPROM_PROGRAM, EEPROM_ERASE, KINDS };
+
+typedef struct {
+    uint8_t     memory[0x10000];
+    uint8_t     eeprom[HAL_EEPROM_SIZE];
+} state_t;
+
+static struct {
+    state_t     s;
+    uint8_t     epgsel;
+    uint8_t     fcbef;
+    bool        latched;
+    uint16_t    address;        /* latched by the last array write */
+    uint8_t     value;
+    uint8_t     command;        /* running ... */
+    uint8_t     *target;        /* ... on this byte or sector ... */
+    uint16_t    size;           /* ... of this many bytes */
+    uint8_t     busy;           /* polls until it completes */
+    uint32_t    commands;       /* launched */
+    uint32_t    n[KINDS];
+    uint8_t     kind[MAX_COMMANDS]; /* of each command launched */
+    uint32_t    reset_at;       /* reset while this command runs; 0 for never */
+    uint32_t    again;          /* then again this many commands later */
+    uint32_t    resets;
+    uint32_t    injected;
+    jmp_buf     reset;
+} _f;
+
+static uint32_t _seed = 1;
+
+/* update.c's neighbours */
+uint16_t
+crc16(uint16_t crc, const uint8_t *data, uint16_t len)
+{
+    while (len--) {
+        uint8_t i;
+
+        crc ^= (uint16_t)*data++ << 8;
+
+        for (i = 0; i < 8; i++) {
+            crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+        }
+    }
+
+    return crc;
+}
+
+void HAL_eeprom_flush(void) { }
+
+static uint8_t
+random8(void)
+{
+    _seed = (_seed * 1103515245UL) + 12345UL;
+    return (uint8_t)(_seed >> 16);
+}
+
+static void
+fill(uint8_t *data, uint16_t len, uint8_t seed)
+{
+    while (len-- > 0) {
+        seed = (uint8_t)(seed * 13 + 7);
+        *data++ = seed;
+    }
+}
+
+/* the reset line: from the resident code, or injected */
+void
+host_reset(void)
+{
+    _f.resets++;
+    longjmp(_f.reset, 1);
+}
+
+/* leave the running command with only some of its bits changed */
+static void
+model_tear(void)
+{
+    uint16_t i;
+
+    if (_f.command == _CMD_BYTE_PROG) {
+        *_f.target &= _f.value | random8();
+    } else {
+        for (i = 0; i < _f.size; i++) {
+            _f.target[i] |= random8();
+        }
+    }
+}
+
+static void
+model_launch(bool flash)
+{
+    const bool in_eeprom = (_f.address >= _EEPROM_BASE) && (_f.address < (_EEPROM_BASE + EEPROM_PAGE));
+    const bool erase = (FCMD == _CMD_SECTOR_ERASE);
+    uint8_t kind;
+
+    CHECK(_f.latched);
+    CHECK(_f.busy == 0);
+    CHECK((FCMD == _CMD_BYTE_PROG) || erase);
+    CHECK(host_interrupts == 0);
+
+    /* the errors were cleared (written with 1s) before the launch */
+    CHECK(FSTAT == _FLASH_ERRORS);
+    FSTAT = 0;
+
+    /* the flash can't be read while it's being written, so it is launched from the stack */
+    CHECK(flash != in_eeprom);
+
+    if (in_eeprom) {
+        const uint16_t offset = (_f.epgsel ? EEPROM_PAGE : 0) + (_f.address - _EEPROM_BASE);
+
+        _f.target = &_f.s.eeprom[erase ? (offset & ~(EEPROM_SECTOR - 1)) : offset];
+        _f.size = erase ? EEPROM_SECTOR : 1;
+        kind = erase ? EEPROM_ERASE : EEPROM_PROGRAM;
+
+    } else {
+        const uint16_t sector = _f.address - ((_f.address - FLASH_START) % _HAL_UPDATE_SECTOR_SIZE);
+
+        if ((_f.address < _HAL_UPDATE_ACTIVE) || (_f.address >= WRITABLE_END)) {
+            CHECK(!"flash written outside the update areas");
+            FSTAT = FSTAT_FPVIOL_MASK;
+            _f.latched = false;
+            return;
+        }
+
+        _f.target = &_f.s.memory[erase ? sector : _f.address];
+        _f.size = erase ? _HAL_UPDATE_SECTOR_SIZE : 1;
+        kind = erase ? FLASH_ERASE : FLASH_PROGRAM;
+    }
+
+    if (!erase) {
+        CHECK(*_f.target == 0xff);
+    }
+
+    _f.command = FCMD;
+    _f.busy = erase ? ERASE_POLLS : PROGRAM_POLLS;
+    _f.latched = false;
+    FCMD = 0;
+
+    CHECK(++_f.commands < MAX_COMMANDS);
+    _f.kind[_f.commands] = kind;
+    _f.n[kind]++;
+
+    if (_f.commands == _f.reset_at) {
+        _f.injected++;
+        _f.reset_at = (_f.again != 0) ? (_f.commands + _f.again) : 0;
+        _f.again = 0;
+        model_tear();
+        host_reset();
+    }
+}
+
+volatile uint8_t *
+host_flash_epgsel(void)
+{
+    CHECK(_f.busy == 0);
+    return &_f.epgsel;
+}
+
+volatile uint8_t *
+host_flash_fcbef(void)
+{
+    /* written after the latch and FCMD, to launch */
+    if (_f.latched && (FCMD != 0)) {
+        model_launch(false);
+    }
+
+    _f.fcbef = 1;
+    return &_f.fcbef;
+}
+
+uint8_t
+host_flash_fccf(void)
+{
+    if ((_f.busy != 0) && (--_f.busy == 0)) {
+        if (_f.command == _CMD_BYTE_PROG) {
+            *_f.target &= _f.value;
+        } else {
+            memset(_f.target, 0xff, _f.size);
+        }
+    }
+
+    return _f.busy == 0;
+}
+
+static const volatile uint8_t *
+model_read(uint16_t address)
+{
+    CHECK(_f.busy == 0);
+
+    if ((address >= _EEPROM_BASE) && (address < (_EEPROM_BASE + EEPROM_PAGE))) {
+        return &_f.s.eeprom[(_f.epgsel ? EEPROM_PAGE : 0) + (address - _EEPROM_BASE)];
+    }
+
+    return &_f.s.memory[address];
+}
+
+static void
+model_latch(uint16_t address, uint8_t value)
+{
+    CHECK(_f.busy == 0);
+    _f.latched = true;
+    _f.address = address;
+    _f.value = value;
+}
+
+/* run the launch code copied to the stack; just the instructions it uses */
+static void
+model_run(const uint8_t *code)
+{
+    const uint16_t fstat = (uint16_t)(uintptr_t)&FSTAT;
+    uint8_t pc = 0;
+    uint8_t a = 0;
+    bool z = false;
+    uint16_t steps;
+
+    for (steps = 0; steps < 1000; steps++) {
+        const uint8_t *const op = &code[pc];
+        const uint16_t ext = ((uint16_t)op[1] << 8) | op[2];
+
+        CHECK(pc < sizeof(_launch));
+
+        switch (op[0]) {
+        case 0xa6:                              /* lda  #imm */
+            a = op[1];
+            z = (a == 0);
+            pc += 2;
+            break;
+
+        case 0xc7:                              /* sta  ext */
+            CHECK(ext == fstat);
+
+            if (a & FSTAT_FCBEF_MASK) {
+                model_launch(true);
+            }
+
+            pc += 3;
+            break;
+
+        case 0x9d:                              /* nop */
+            pc += 1;
+            break;
+
+        case 0xc6:                              /* lda  ext */
+            CHECK(ext == fstat);
+            a = FSTAT | FSTAT_FCBEF_MASK | (host_flash_fccf() ? FSTAT_FCCF_MASK : 0);
+            z = (a == 0);
+            pc += 3;
+            break;
+
+        case 0xa5:                              /* bit  #imm */
+            z = ((a & op[1]) == 0);
+            pc += 2;
+            break;
+
+        case 0x27:                              /* beq  rel */
+            pc += 2;
+
+            if (z) {
+                pc += (int8_t)op[1];
+            }
+
+            break;
+
+        case 0x81:                              /* rts */
+            CHECK(_f.busy == 0);
+            return;
+
+        default:
+            CHECK(!"unknown opcode in the launch code");
+            return;
+        }
+    }
+
+    CHECK(!"the launch code doesn't return");
+}
+
+/* reset until the resident code hands over to the image */
+static void
+boot(void)
+{
+    if (setjmp(_f.reset) != 0) {
+        /* a reset stops the running command, and the resident code starts over */
+        _f.busy = 0;
+        _f.latched = false;
+        FCMD = 0;
+        FSTAT = 0;
+
+        if (_f.resets > 100) {
+            CHECK(!"the resident code keeps resetting");
+            return;
+        }
+    }
+
+    host_interrupts = 0;
+    _HAL_update_boot();
+    host_interrupts = 1;
+}
+
+static bool
+same(const uint8_t *a, const uint8_t *b)
+{
+    return memcmp(a, b, AREA_SIZE) == 0;
+}
+
+/*
+ * From the state in before, boot and check that the active and staging
+ * areas are swapped and the state is as expected; returns the commands
+ * it took.
+ */
+static uint32_t
+check_swap(const state_t *before, uint32_t reset_at, uint32_t again, HAL_update_state_t expect)
+{
+    _f.s = *before;
+    _f.commands = 0;
+    _f.resets = 0;
+    _f.reset_at = reset_at;
+    _f.again = again;
+
+    boot();
+
+    CHECK(same(&_f.s.memory[_HAL_UPDATE_ACTIVE], &before->memory[_HAL_UPDATE_STAGE]));
+    CHECK(same(&_f.s.memory[_HAL_UPDATE_STAGE], &before->memory[_HAL_UPDATE_ACTIVE]));
+    CHECK(HAL_update_state() == expect);
+
+    /* a second reset may have been due after the swap finished */
+    _f.reset_at = 0;
+    return _f.commands;
+}
+
+/* swap with resets injected across a clean swap's commands */
+static void
+check_resets(const char *name, const state_t *before, HAL_update_state_t expect)
+{
+    static uint8_t kind[MAX_COMMANDS];
+    const uint32_t injected = _f.injected;
+    uint32_t total;
+    uint32_t n;
+    uint32_t points = 0;
+    uint32_t kinds[KINDS];
+
+    memset(_f.n, 0, sizeof(_f.n));
+    total = check_swap(before, 0, 0, expect);
+    memcpy(kinds, _f.n, sizeof(kinds));
+    memcpy(kind, _f.kind, sizeof(kind));
+
+    /*
+     * The first and last of each run of commands of a kind (each erase,
+     * the first and last byte of each copy and each journal write), and
+     * a spread of the rest; stop at the first that fails.
+     */
+    for (n = 1; (n <= total) && (host_failures == 0); n++) {
+        const bool edge = (kind[n] != kind[n - 1]) || ((n < total) && (kind[n] != kind[n + 1]));
+
+        if (edge || ((n % 499) == 0)) {
+            (void)check_swap(before, n, 1 + (random8() * 3), expect);
+            points++;
+        }
+    }
+
+    printf("update: %s: %lu flash erases, %lu flash programs, %lu EEPROM erases, %lu EEPROM programs; "
+           "reset at %lu points (%lu resets)\n",
+           name,
+           (unsigned long)kinds[FLASH_ERASE], (unsigned long)kinds[FLASH_PROGRAM],
+           (unsigned long)kinds[EEPROM_ERASE], (unsigned long)kinds[EEPROM_PROGRAM],
+           (unsigned long)points, (unsigned long)(_f.injected - injected));
+
+    /* one swap copies every sector three times */
+    CHECK(kinds[FLASH_ERASE] == (_HAL_UPDATE_SECTORS * _STEPS));
+    CHECK(points > 400);
+}
+
+static uint16_t
+resident_crc(void)
+{
+    return crc16(0xffff, &_f.s.memory[_HAL_UPDATE_RESIDENT], _HAL_UPDATE_RESIDENT_SIZE);
+}
+
+/* receive an image into the staging area, in pieces, out of order and with resends */
+static void
+test_receive(const uint8_t *image, uint16_t len)
+{
+    const uint16_t crc = crc16(0xffff, image, len);
+    const uint8_t changed = (uint8_t)~image[0];
+    uint16_t offset;
+
+    host_interrupts = 1;
+
+    CHECK(!_HAL_update_begin(len, crc, resident_crc() ^ 1));
+    CHECK(!_HAL_update_begin(HAL_UPDATE_IMAGE_SIZE + 1, crc, resident_crc()));
+
+    /* a byte can't be changed without an erase, and that fails the image */
+    CHECK(_HAL_update_begin(len, crc, resident_crc()));
+
+    while (!_HAL_update_erase_next()) {
+    }
+
+    CHECK(_HAL_update_write(0, 1, &image[0]));
+    CHECK(!_HAL_update_write(0, 1, &changed));
+    CHECK(!_HAL_update_ready());
+    CHECK(!_HAL_update_finish());
+
+    /* again, properly */
+    CHECK(_HAL_update_begin(len, crc, resident_crc()));
+
+    while (!_HAL_update_erase_next()) {
+    }
+
+    CHECK(_HAL_update_ready());
+
+    for (offset = len / 2; offset < len; offset += 6) {
+        CHECK(_HAL_update_write(offset, ((len - offset) < 6) ? (len - offset) : 6, &image[offset]));
+    }
+
+    for (offset = 0; offset < (len / 2); offset += 6) {
+        const uint8_t n = (((len / 2) - offset) < 6) ? ((len / 2) - offset) : 6;
+
+        CHECK(_HAL_update_write(offset, n, &image[offset]));
+        CHECK(_HAL_update_write(offset, n, &image[offset]));
+    }
+
+    CHECK(!_HAL_update_write(len - 1, 2, &image[len - 1]));
+    CHECK(HAL_update_state() == HAL_UPDATE_NONE);
+    CHECK(_HAL_update_finish());
+    CHECK(HAL_update_state() == HAL_UPDATE_STAGED);
+    CHECK(_HAL_update_activate());
+
+    CHECK(memcmp(&_f.s.memory[_HAL_UPDATE_STAGE], image, len) == 0);
+
+    for (offset = len; offset < AREA_SIZE; offset++) {
+        CHECK(_f.s.memory[_HAL_UPDATE_STAGE + offset] == 0xff);
+    }
+}
+
+int
+main(void)
+{
+    static uint8_t image[HAL_UPDATE_IMAGE_SIZE];
+    static state_t staged;
+    static state_t trial;
+    const uint16_t len = HAL_UPDATE_IMAGE_SIZE - 0x1a3;
+
+    /* an old image running, something left in the staging area, no journal */
+    memset(&_f.s, 0xff, sizeof(_f.s));
+    fill(&_f.s.memory[_HAL_UPDATE_ACTIVE], AREA_SIZE, 0x11);
+    _f.s.memory[_HAL_UPDATE_ACTIVE] = _OPCODE_JMP;
+    fill(&_f.s.memory[_HAL_UPDATE_STAGE], AREA_SIZE / 3, 0x22);
+    fill(&_f.s.memory[_HAL_UPDATE_RESIDENT], _HAL_UPDATE_RESIDENT_SIZE, 0x33);
+    _f.fcbef = 1;
+
+    /* a new one, staged while the old one runs */
+    fill(image, len, 0x44);
+    image[0] = _OPCODE_JMP;
+    test_receive(image, len);
+    staged = _f.s;
+
+    /* swap it in; the first boot of the new image is a trial */
+    check_resets("swap", &staged, HAL_UPDATE_TRIAL);
+    trial = _f.s;
+
+    /* not confirmed before the next reset: the old image comes back */
+    check_resets("rollback", &trial, HAL_UPDATE_ROLLED_BACK);
+    CHECK(memcmp(&_f.s.memory[_HAL_UPDATE_ACTIVE], &staged.memory[_HAL_UPDATE_ACTIVE], AREA_SIZE) == 0);
+
+    /* confirmed: later resets leave it alone */
+    _f.s = trial;
+    host_interrupts = 1;
+    HAL_update_confirm();
+    CHECK(HAL_update_state() == HAL_UPDATE_CONFIRMED);
+    _f.commands = 0;
+    boot();
+    boot();
+    CHECK(_f.commands == 0);
+    CHECK(HAL_update_state() == HAL_UPDATE_CONFIRMED);
+    CHECK(memcmp(&_f.s.memory[_HAL_UPDATE_ACTIVE], &staged.memory[_HAL_UPDATE_STAGE], AREA_SIZE) == 0);
+
+    return host_result("update");
+}